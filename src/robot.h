@@ -2,4 +2,5 @@
 
 #include "robot_vm.h"
 #include "robot_obj_file.h"
+#include "robot_vm_pool.h"
 
@@ -331,52 +331,80 @@ static void instr_clear(void *p)
  * .stack number - could be used to set stack size
  * :label - label. This label place could be used in program as address in form @label
  * name [r1 [r2 [r3]]] - instruction
+ * addi r1 r2 number - instruction with unsigned byte as the last argument (addi, subi, andi)
+ * jz r1 @label - relative branch to label of the same text or by signed count of words
+ *     from the next instruction, like jz r1 -3 (jmp, jz, jnz)
  * { aa bb cc dd } - save data at the address. Will be aligned with 0's
  * "string" - the same as previous but saves zero-ended string
  * Special instruction 'load r0 @name' or 'load r0 %name' or 'load r0 const' loads address or extension number or constant to register.
+ * 'call' is followed by 'const @name' too, it pushes return address to stack at R1, 'ret' pops it.
  */
+/* Argument after registers: */
+enum {
+	ARG_NONE,
+	ARG_BYTE,   /* Unsigned byte in C            */
+	ARG_OFFSET  /* Signed offset in words in B:C */
+};
+
 static struct _iinfo {
 	const char *name;
 	RobotVMCommand code;
 	unsigned argcnt;
+	unsigned arg;
 } instructions[] = {
 	/* Main: */
-	{ "nop", ROBOT_VM_NOP, 0 },
-	{ "load", ROBOT_VM_LOAD, 1 },
-	{ "ext", ROBOT_VM_EXT, 1 },
-	{ "write8", ROBOT_VM_W8, 2 },
-	{ "read8", ROBOT_VM_R8, 2 },
-	{ "write16", ROBOT_VM_W16, 2 },
-	{ "read16", ROBOT_VM_R16, 2 },
-	{ "write32", ROBOT_VM_W32, 2 },
-	{ "read32", ROBOT_VM_R32, 2 },
-	{ "stop", ROBOT_VM_STOP, 1 },
-	{ "move", ROBOT_VM_MOVE, 2 },
-	{ "moveif", ROBOT_VM_MOVEIF, 3 },
-	{ "moveifz", ROBOT_VM_MOVEIFZ, 3 },
-	{ "swap", ROBOT_VM_SWAP, 2 },
+	{ "nop", ROBOT_VM_NOP, 0, ARG_NONE },
+	{ "load", ROBOT_VM_LOAD, 1, ARG_NONE },
+	{ "ext", ROBOT_VM_EXT, 1, ARG_NONE },
+	{ "write8", ROBOT_VM_W8, 2, ARG_NONE },
+	{ "read8", ROBOT_VM_R8, 2, ARG_NONE },
+	{ "write16", ROBOT_VM_W16, 2, ARG_NONE },
+	{ "read16", ROBOT_VM_R16, 2, ARG_NONE },
+	{ "write32", ROBOT_VM_W32, 2, ARG_NONE },
+	{ "read32", ROBOT_VM_R32, 2, ARG_NONE },
+	{ "stop", ROBOT_VM_STOP, 1, ARG_NONE },
+	{ "move", ROBOT_VM_MOVE, 2, ARG_NONE },
+	{ "moveif", ROBOT_VM_MOVEIF, 3, ARG_NONE },
+	{ "moveifz", ROBOT_VM_MOVEIFZ, 3, ARG_NONE },
+	{ "swap", ROBOT_VM_SWAP, 2, ARG_NONE },
 	/* Binary operations: */
-	{ "lshift", ROBOT_VM_LSHIFT, 3 },
-	{ "rshift", ROBOT_VM_RSHIFT, 3 },
-	{ "sshift", ROBOT_VM_SSHIFT, 3 },
-	{ "and", ROBOT_VM_AND, 3 },
-	{ "or", ROBOT_VM_OR, 3 },
-	{ "xor", ROBOT_VM_XOR, 3 },
-	{ "neg", ROBOT_VM_NEG, 2 },
+	{ "lshift", ROBOT_VM_LSHIFT, 3, ARG_NONE },
+	{ "rshift", ROBOT_VM_RSHIFT, 3, ARG_NONE },
+	{ "sshift", ROBOT_VM_SSHIFT, 3, ARG_NONE },
+	{ "and", ROBOT_VM_AND, 3, ARG_NONE },
+	{ "or", ROBOT_VM_OR, 3, ARG_NONE },
+	{ "xor", ROBOT_VM_XOR, 3, ARG_NONE },
+	{ "neg", ROBOT_VM_NEG, 2, ARG_NONE },
 	/* Arithmetic operations: */
-	{ "incr", ROBOT_VM_INCR, 1 },
-	{ "decr", ROBOT_VM_DECR, 1 },
-	{ "incr4", ROBOT_VM_INCR4, 1 },
-	{ "decr4", ROBOT_VM_DECR4, 1 },
-	{ "add", ROBOT_VM_ADD, 3 },
-	{ "sub", ROBOT_VM_SUB, 3 },
-	{ "mul", ROBOT_VM_MUL, 3 },
-	{ "div", ROBOT_VM_DIV, 3 },
+	{ "incr", ROBOT_VM_INCR, 1, ARG_NONE },
+	{ "decr", ROBOT_VM_DECR, 1, ARG_NONE },
+	{ "incr4", ROBOT_VM_INCR4, 1, ARG_NONE },
+	{ "decr4", ROBOT_VM_DECR4, 1, ARG_NONE },
+	{ "add", ROBOT_VM_ADD, 3, ARG_NONE },
+	{ "sub", ROBOT_VM_SUB, 3, ARG_NONE },
+	{ "mul", ROBOT_VM_MUL, 3, ARG_NONE },
+	{ "div", ROBOT_VM_DIV, 3, ARG_NONE },
 	/* I/O */
-	{ "out", ROBOT_VM_OUT, 1 },
-	{ "in", ROBOT_VM_IN, 1 },
-
-	{ NULL, 0, 0 }
+	{ "out", ROBOT_VM_OUT, 1, ARG_NONE },
+	{ "in", ROBOT_VM_IN, 1, ARG_NONE },
+	/* Immediate operands: */
+	{ "addi", ROBOT_VM_ADDI, 2, ARG_BYTE },
+	{ "subi", ROBOT_VM_SUBI, 2, ARG_BYTE },
+	{ "andi", ROBOT_VM_ANDI, 2, ARG_BYTE },
+	/* Relative branches: */
+	{ "jmp", ROBOT_VM_JMP, 0, ARG_OFFSET },
+	{ "jz", ROBOT_VM_JZ, 1, ARG_OFFSET },
+	{ "jnz", ROBOT_VM_JNZ, 1, ARG_OFFSET },
+	/* Calls: */
+	{ "call", ROBOT_VM_CALL, 0, ARG_NONE },
+	{ "ret", ROBOT_VM_RET, 0, ARG_NONE },
+	/* Block memory operations: */
+	{ "memcpy", ROBOT_VM_MEMCPY, 3, ARG_NONE },
+	{ "memset", ROBOT_VM_MEMSET, 3, ARG_NONE },
+	{ "memcmp", ROBOT_VM_MEMCMP, 3, ARG_NONE },
+	{ "strlen", ROBOT_VM_STRLEN, 2, ARG_NONE },
+
+	{ NULL, 0, 0, ARG_NONE }
 };
 
 gboolean robot_obj_file_compile(RobotObjFile *self, const gchar *prog, GError **error)
@@ -388,6 +416,9 @@ gboolean robot_obj_file_compile(RobotObjFile *self, const gchar *prog, GError **
 	GArray *code = g_array_new(FALSE, TRUE, sizeof(struct instruction));
 	struct instruction cur;
 	RobotVMWord loc = 0;
+	RobotVMWord text_len, off;
+	RobotObjFileSymbol *sym;
+	gboolean neg;
 	guint i;
 	int j;
 	struct instruction *p;
@@ -601,12 +632,68 @@ gboolean robot_obj_file_compile(RobotObjFile *self, const gchar *prog, GError **
 						return FALSE;
 					}
 				}
+
+				if (instructions[j].arg != ARG_NONE)
+					s = skip_ws(s, &line);
+
+				if (instructions[j].arg == ARG_BYTE) {
+					if (!g_ascii_isdigit(*s)) {
+						g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_SYNTAX,
+								"Waiting for number at line %d", line);
+						g_array_unref(code);
+						return FALSE;
+					}
+					if (!(s = read_num(s, &cur.addr, line, error))) {
+						g_array_unref(code);
+						return FALSE;
+					}
+					if (cur.addr > 0xff) {
+						g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_SYNTAX,
+								"Immediate is greater than 255 at line %d", line);
+						g_array_unref(code);
+						return FALSE;
+					}
+					cur.C = cur.addr;
+				} else if (instructions[j].arg == ARG_OFFSET) {
+					/* Label is resolved when text is assembled: */
+					if (*s == '@') {
+						++s;
+						if (!(s = read_name(s, cur.name, sizeof(cur.name), line, error))) {
+							g_array_unref(code);
+							return FALSE;
+						}
+					} else {
+						neg = *s == '-';
+						if (*s == '-' || *s == '+')
+							++s;
+						if (!g_ascii_isdigit(*s)) {
+							g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_SYNTAX,
+									"Waiting for label or offset at line %d", line);
+							g_array_unref(code);
+							return FALSE;
+						}
+						if (!(s = read_num(s, &off, line, error))) {
+							g_array_unref(code);
+							return FALSE;
+						}
+						if (off > (neg? 0x8000u: 0x7fffu)) {
+							g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_SYNTAX,
+									"Branch offset is out of range at line %d", line);
+							g_array_unref(code);
+							return FALSE;
+						}
+						off = neg? -off: off;
+						cur.B = (off >> 8) & 0xff;
+						cur.C = off & 0xff;
+					}
+				}
 			}
 		}
 
 		g_array_append_val(code, cur);
 	}
 
+	text_len = loc;
 	loc = code->len * 4;
 
 	/* .data */
@@ -667,6 +754,26 @@ gboolean robot_obj_file_compile(RobotObjFile *self, const gchar *prog, GError **
 		p = &g_array_index(code, struct instruction, i);
 
 		if (p->code < ROBOT_VM_COMMAND_COUNT) {
+			/* Relative branch to label of this text: */
+			if (p->name[0]) {
+				sym = get_sym(self, p->name);
+				if (!sym || sym->addr >= text_len || (sym->addr & 3)) {
+					g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_SYNTAX,
+							"Branch target %s is not instruction of this text at line %d", p->name, p->line);
+					g_array_unref(code);
+					return FALSE;
+				}
+				off = (gint32)(sym->addr - (p->loc + 4)) / 4;
+				if ((gint32)off < -0x8000 || (gint32)off > 0x7fff) {
+					g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_SYNTAX,
+							"Branch target %s is too far at line %d", p->name, p->line);
+					g_array_unref(code);
+					return FALSE;
+				}
+				p->B = (off >> 8) & 0xff;
+				p->C = off & 0xff;
+			}
+
 			buf[0] = p->code;
 			buf[1] = p->A;
 			buf[2] = p->B;
@@ -723,7 +830,13 @@ const gchar* robot_instruction_to_string(gconstpointer code, gchar *buf, gsize l
 	for (i = 0; instructions[i].name; i++) {
 		if (instructions[i].code == p[0]) {
 			if (buf) {
-				if (instructions[i].argcnt == 0) {
+				if (instructions[i].arg == ARG_BYTE) {
+					snprintf(buf, len, "%s r%d r%d %d", instructions[i].name, p[1], p[2], p[3]);
+				} else if (instructions[i].arg == ARG_OFFSET && instructions[i].argcnt == 0) {
+					snprintf(buf, len, "%s %+d", instructions[i].name, (gint16)(p[2] << 8 | p[3]));
+				} else if (instructions[i].arg == ARG_OFFSET) {
+					snprintf(buf, len, "%s r%d %+d", instructions[i].name, p[1], (gint16)(p[2] << 8 | p[3]));
+				} else if (instructions[i].argcnt == 0) {
 					snprintf(buf, len, "%s", instructions[i].name);
 				} else if (instructions[i].argcnt == 1) {
 					snprintf(buf, len, "%s r%d", instructions[i].name, p[1]);
@@ -930,38 +1043,38 @@ GByteArray* robot_obj_file_to_byte_array(RobotObjFile *self, GError **error)
 	return res;
 }
 
-static gboolean load_word(GByteArray *data, guint *idx_in, RobotVMWord *w, GError **error)
+static gboolean load_word(const guint8 *data, gsize len, gsize *idx_in, RobotVMWord *w, GError **error)
 {
-	guint idx = *idx_in;
+	gsize idx = *idx_in;
 
-	if (idx + 4 > data->len) {
+	if (idx + 4 > len) {
 		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid file format (can not read word)");
 		return FALSE;
 	}
 
-	*w = (data->data[idx] << 24) | (data->data[idx + 1] << 16) | (data->data[idx + 2] << 8) | data->data[idx + 3];
+	*w = (data[idx] << 24) | (data[idx + 1] << 16) | (data[idx + 2] << 8) | data[idx + 3];
 	*idx_in = idx + 4;
 
 	return TRUE;
 }
 
-static gboolean load_string(GByteArray *data, guint *idx_in, char *buf, gsize buf_len, GError **error)
+static gboolean load_string(const guint8 *data, gsize len, gsize *idx_in, char *buf, gsize buf_len, GError **error)
 {
-	guint idx = *idx_in;
+	gsize idx = *idx_in;
 	guint i = 0;
 
-	if (idx >= data->len) {
+	if (idx >= len) {
 		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid file format (unexpected end of file)");
 		return FALSE;
 	}
 
 	for (;;) {
-		if (i >= buf_len || idx >= data->len) {
+		if (i >= buf_len || idx >= len) {
 			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid file format (unexpected end of string)");
 			return FALSE;
 		}
 
-		buf[i] = data->data[idx++];
+		buf[i] = data[idx++];
 
 		if (!buf[i])
 			break;
@@ -973,17 +1086,77 @@ static gboolean load_string(GByteArray *data, guint *idx_in, char *buf, gsize bu
 	return TRUE;
 }
 
-gboolean robot_obj_file_from_byte_array(RobotObjFile *self, GByteArray *data, GError **error)
+gboolean robot_obj_file_parse_image(RobotObjFileImage *image, const guint8 *data, gsize len, GError **error)
 {
-	guint idx = 0;
-	guint end;
-	RobotObjFileSymbol s;
-	RobotVMWord w;
+	gsize idx = 0;
 	RobotVMWord text_len;
 	RobotVMWord data_len;
 	RobotVMWord sym_len;
 	RobotVMWord relocation_len;
 	RobotVMWord depends_len;
+	guint64 total;
+
+	/* 1. loading flags and reserved: */
+	if (
+			!load_word(data, len, &idx, &image->flags, error) ||
+			!load_word(data, len, &idx, &image->SS, error) ||
+			!load_word(data, len, &idx, &image->reserved1, error) ||
+			!load_word(data, len, &idx, &image->reserved2, error) ||
+			!load_word(data, len, &idx, &image->reserved3, error) ||
+			!load_word(data, len, &idx, &text_len, error) ||
+			!load_word(data, len, &idx, &data_len, error) ||
+			!load_word(data, len, &idx, &sym_len, error) ||
+			!load_word(data, len, &idx, &relocation_len, error) ||
+			!load_word(data, len, &idx, &depends_len, error)
+	   ) {
+		return FALSE;
+	}
+
+	total = (guint64)text_len + data_len + sym_len + relocation_len + depends_len + idx;
+	if (total != len || relocation_len % 4) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid object file format (%u != %u)!",
+				(unsigned)total, (unsigned)len);
+		return FALSE;
+	}
+
+	image->text = data + idx;
+	image->text_len = text_len;
+	idx += text_len;
+	image->data = data + idx;
+	image->data_len = data_len;
+	idx += data_len;
+	image->sym = data + idx;
+	image->sym_len = sym_len;
+	idx += sym_len;
+	image->relocation = data + idx;
+	image->n_relocations = relocation_len / 4;
+	idx += relocation_len;
+	image->depends = data + idx;
+	image->depends_len = depends_len;
+
+	return TRUE;
+}
+
+gboolean robot_obj_file_image_symbol(const guint8 *table, gsize len, gsize *idx, RobotObjFileSymbol *sym, GError **error)
+{
+	return load_string(table, len, idx, sym->name, sizeof(sym->name), error) &&
+		load_word(table, len, idx, &sym->addr, error);
+}
+
+RobotVMWord robot_obj_file_image_relocation(const RobotObjFileImage *image, guint i)
+{
+	const guint8 *p = image->relocation + i * 4;
+
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+gboolean robot_obj_file_from_data(RobotObjFile *self, const guint8 *data, gsize len, GError **error)
+{
+	RobotObjFileImage image;
+	RobotObjFileSymbol s;
+	RobotVMWord w;
+	gsize idx;
+	guint i;
 
 	/* Clear all the data: */
 	self->flags = 0;
@@ -997,66 +1170,33 @@ gboolean robot_obj_file_from_byte_array(RobotObjFile *self, GByteArray *data, GE
 	g_array_set_size(self->relocation, 0);
 	g_array_set_size(self->depends, 0);
 
-	/* 1. loading flags and reserved: */
-	if (
-			!load_word(data, &idx, &self->flags, error) ||
-			!load_word(data, &idx, &self->SS, error) ||
-			!load_word(data, &idx, &self->reserved1, error) ||
-			!load_word(data, &idx, &self->reserved2, error) ||
-			!load_word(data, &idx, &self->reserved3, error) ||
-			!load_word(data, &idx, &text_len, error) ||
-			!load_word(data, &idx, &data_len, error) ||
-			!load_word(data, &idx, &sym_len, error) ||
-			!load_word(data, &idx, &relocation_len, error) ||
-			!load_word(data, &idx, &depends_len, error)
-	   ) {
+	if (!robot_obj_file_parse_image(&image, data, len, error))
 		return FALSE;
-	}
 
-	if (text_len + data_len + sym_len + relocation_len + depends_len + idx != data->len) {
-		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid object file format (%u != %u)!",
-				(unsigned)text_len + data_len + sym_len + relocation_len + depends_len + idx,
-				(unsigned)data->len);
-		return FALSE;
-	}
-
-	if (text_len) {
-		g_byte_array_set_size(self->text, text_len);
-		memcpy(self->text->data, data->data + idx, text_len);
-		idx += text_len;
-	}
+	self->flags = image.flags;
+	self->SS = image.SS;
+	self->reserved1 = image.reserved1;
+	self->reserved2 = image.reserved2;
+	self->reserved3 = image.reserved3;
 
-	if (data_len) {
-		g_byte_array_set_size(self->data, data_len);
-		memcpy(self->data->data, data->data + idx, data_len);
-		idx += data_len;
-	}
+	g_byte_array_append(self->text, image.text, image.text_len);
+	g_byte_array_append(self->data, image.data, image.data_len);
 
-	end = idx + sym_len;
-	while (idx < end) {
-		if ( !load_string(data, &idx, s.name, sizeof(s.name), error) ||
-				!load_word(data, &idx, &s.addr, error)) {
+	for (idx = 0; idx < image.sym_len; ) {
+		if (!robot_obj_file_image_symbol(image.sym, image.sym_len, &idx, &s, error))
 			return FALSE;
-		}
 
 		g_array_append_val(self->sym, s);
 	}
 
-	end = idx + relocation_len;
-	while (idx < end) {
-		if (!load_word(data, &idx, &w, error)) {
-			return FALSE;
-		}
-
+	for (i = 0; i < image.n_relocations; i++) {
+		w = robot_obj_file_image_relocation(&image, i);
 		g_array_append_val(self->relocation, w);
 	}
 
-	end = idx + depends_len;
-	while (idx < end) {
-		if ( !load_string(data, &idx, s.name, sizeof(s.name), error) ||
-				!load_word(data, &idx, &s.addr, error)) {
+	for (idx = 0; idx < image.depends_len; ) {
+		if (!robot_obj_file_image_symbol(image.depends, image.depends_len, &idx, &s, error))
 			return FALSE;
-		}
 
 		g_array_append_val(self->depends, s);
 	}
@@ -1064,6 +1204,11 @@ gboolean robot_obj_file_from_byte_array(RobotObjFile *self, GByteArray *data, GE
 	return TRUE;
 }
 
+gboolean robot_obj_file_from_byte_array(RobotObjFile *self, GByteArray *data, GError **error)
+{
+	return robot_obj_file_from_data(self, data->data, data->len, error);
+}
+
 gboolean robot_obj_file_dump(RobotObjFile *self, FILE *f, gboolean disasm, GError **error)
 {
 	guint i, j;
@@ -1138,7 +1283,7 @@ gboolean robot_obj_file_dump(RobotObjFile *self, FILE *f, gboolean disasm, GErro
 					load = FALSE;
 				} else {
 					fprintf(f, "%s\n", robot_instruction_to_string(self->text->data + i, buf, sizeof(buf)));
-					load = (self->text->data[i] == ROBOT_VM_LOAD);
+					load = (self->text->data[i] == ROBOT_VM_LOAD || self->text->data[i] == ROBOT_VM_CALL);
 				}
 
 			}
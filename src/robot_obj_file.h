@@ -73,6 +73,33 @@ void robot_obj_file_add_relocation(RobotObjFile *self, RobotVMWord addr);
 
 GByteArray* robot_obj_file_to_byte_array(RobotObjFile *self, GError **error);
 gboolean robot_obj_file_from_byte_array(RobotObjFile *self, GByteArray *from, GError **error);
+gboolean robot_obj_file_from_data(RobotObjFile *self, const guint8 *data, gsize len, GError **error);
+
+/* Sections of file parsed in place, pointers refer to parsed data. Used to load
+ * program into VM without copying it into RobotObjFile first: */
+struct _RobotObjFileImage {
+	RobotVMWord flags;
+	RobotVMWord SS;
+	RobotVMWord reserved1;
+	RobotVMWord reserved2;
+	RobotVMWord reserved3;
+
+	const guint8 *text;
+	gsize text_len;
+	const guint8 *data;
+	gsize data_len;
+	const guint8 *sym;        /* Symbols: names ending with zero byte and addresses */
+	gsize sym_len;
+	const guint8 *relocation; /* Big endian words */
+	guint n_relocations;
+	const guint8 *depends;    /* Same as symbols */
+	gsize depends_len;
+};
+
+gboolean robot_obj_file_parse_image(RobotObjFileImage *image, const guint8 *data, gsize len, GError **error);
+/* Read symbol at *idx of symbol table and move *idx to the next one: */
+gboolean robot_obj_file_image_symbol(const guint8 *table, gsize len, gsize *idx, RobotObjFileSymbol *sym, GError **error);
+RobotVMWord robot_obj_file_image_relocation(const RobotObjFileImage *image, guint i);
 
 gboolean robot_obj_file_dump(RobotObjFile *self, FILE *f, gboolean disasm, GError **error);
 
@@ -9,10 +9,12 @@
 static void usage(const char *prog);
 static GByteArray* load_file(const char *filename, GError **error);
 static void dump_obj(RobotObjFile *obj, int disasm);
+static gboolean dump_trace(const char *filename, RobotObjFile *obj, GError **error);
 
 int main(int argc, char *argv[])
 {
 	const char *input = NULL;
+	const char *trace = NULL;
 	int disasm = 0;
 	int i;
 	GByteArray *data;
@@ -22,6 +24,8 @@ int main(int argc, char *argv[])
 	for (i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--disassembler")) {
 			++disasm;
+		} else if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace")) && i + 1 < argc) {
+			trace = argv[++i];
 		} else if (!strcmp(argv[i], "--")) {
 			++i;
 			break;
@@ -41,6 +45,15 @@ int main(int argc, char *argv[])
 		input = argv[i];
 	}
 
+	/* Trace is decoded with symbols of input file, if it is given: */
+	if (trace && !input) {
+		if (!dump_trace(trace, NULL, &error)) {
+			fprintf(stderr, "Error: can't decode trace (%s)\n", error->message);
+			return EXIT_FAILURE;
+		}
+		return 0;
+	}
+
 	if (!input) {
 		fprintf(stderr, "Error: no input files.\n");
 		return EXIT_FAILURE;
@@ -60,7 +73,14 @@ int main(int argc, char *argv[])
 
 	g_byte_array_unref(data);
 
-	dump_obj(obj, disasm);
+	if (trace) {
+		if (!dump_trace(trace, obj, &error)) {
+			fprintf(stderr, "Error: can't decode trace (%s)\n", error->message);
+			return EXIT_FAILURE;
+		}
+	} else {
+		dump_obj(obj, disasm);
+	}
 
 	g_object_unref(obj);
 
@@ -71,6 +91,7 @@ static void usage(const char *prog)
 {
 	printf("%s: assembler for RobotVM.\n", prog);
 	printf("Usage: %s [-o output] input1 ...\n", prog);
+	printf("       %s --trace trace [executable]\n", prog);
 }
 
 static GByteArray* load_file(const char *filename, GError **error)
@@ -102,3 +123,46 @@ static void dump_obj(RobotObjFile *obj, int disasm)
 	robot_obj_file_dump(obj, stdout, disasm, NULL);
 }
 
+/* Print trace records from the oldest one as "address <symbol+offset> instruction rA=value": */
+static gboolean dump_trace(const char *filename, RobotObjFile *obj, GError **error)
+{
+	RobotVMTraceRecord *rec;
+	RobotObjFileSymbol *sym, *best;
+	RobotVMWord start;
+	RobotVMWord off;
+	GArray *records;
+	guint8 insn[4];
+	char buf[256];
+	guint i, j;
+
+	records = robot_vm_load_trace(filename, &start, error);
+	if (!records)
+		return FALSE;
+
+	for (i = 0; i < records->len; i++) {
+		rec = &g_array_index(records, RobotVMTraceRecord, i);
+		insn[0] = rec->op;
+		insn[1] = rec->A;
+		insn[2] = rec->B;
+		insn[3] = rec->C;
+
+		/* The nearest symbol before instruction: */
+		best = NULL;
+		off = rec->pc - start;
+		for (j = 0; obj && off < obj->text->len && j < obj->sym->len; j++) {
+			sym = &g_array_index(obj->sym, RobotObjFileSymbol, j);
+			if (sym->addr <= off && (!best || sym->addr > best->addr))
+				best = sym;
+		}
+
+		if (best)
+			printf("%08x <%s+0x%x> ", (unsigned)rec->pc, best->name, (unsigned)(off - best->addr));
+		else
+			printf("%08x ", (unsigned)rec->pc);
+		printf("%-24s r%d=%08x\n", robot_instruction_to_string(insn, buf, sizeof(buf)), rec->A, (unsigned)rec->value);
+	}
+
+	g_array_unref(records);
+
+	return TRUE;
+}
@@ -1,15 +1,77 @@
+#if defined(HAVE_MEMFD_CREATE) || defined(HAVE_MAP_NORESERVE)
+# define _GNU_SOURCE
+#endif
 #include "robot.h"
+#include "robot_vm_jit.h"
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(HAVE_MEMFD_CREATE) || defined(HAVE_MAP_NORESERVE)
+# include <sys/mman.h>
+# include <fcntl.h>
+#endif
+
+/* Memory layout. By default memory of VM is a big endian image of program.
+ * With ROBOT_VM_HOST_ORDER every aligned word is kept in host byte order, so
+ * aligned word access is plain load and store. Bytes inside of word are
+ * addressed as (address ^ MEM_SWIZZLE) then, so program still sees big endian
+ * memory when it reads or writes bytes and halfwords. */
+#if defined(ROBOT_VM_HOST_ORDER) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+# define MEM_SWIZZLE 3
+#else
+# define MEM_SWIZZLE 0
+#endif
+
+#define MEM8(mem, addr) ((mem)[(addr) ^ MEM_SWIZZLE])
+
+static inline RobotVMWord mem_get32(const guint8 *mem, RobotVMWord addr)
+{
+#if MEM_SWIZZLE
+	if (G_LIKELY(!(addr & 3)))
+		return *((const RobotVMWord*)(mem + addr));
+	return ((RobotVMWord)MEM8(mem, addr) << 24) | ((RobotVMWord)MEM8(mem, addr + 1) << 16) |
+		((RobotVMWord)MEM8(mem, addr + 2) << 8) | MEM8(mem, addr + 3);
+#else
+	return g_ntohl(*((const RobotVMWord*)(mem + addr)));
+#endif
+}
+
+static inline void mem_put32(guint8 *mem, RobotVMWord addr, RobotVMWord w)
+{
+#if MEM_SWIZZLE
+	if (G_LIKELY(!(addr & 3))) {
+		*((RobotVMWord*)(mem + addr)) = w;
+		return;
+	}
+	MEM8(mem, addr) = w >> 24;
+	MEM8(mem, addr + 1) = w >> 16;
+	MEM8(mem, addr + 2) = w >> 8;
+	MEM8(mem, addr + 3) = w;
+#else
+	*((RobotVMWord*)(mem + addr)) = g_htonl(w);
+#endif
+}
 
-static inline RobotVMWord get_word(void *p)
+static inline RobotVMWord mem_get16(const guint8 *mem, RobotVMWord addr)
 {
-	return g_ntohl(((guint32*)p)[0]);
+#if MEM_SWIZZLE
+	if (G_LIKELY(!(addr & 1)))
+		return *((const guint16*)(mem + (addr ^ 2)));
+#endif
+	return (MEM8(mem, addr) << 8) + MEM8(mem, addr + 1);
 }
 
-static inline void set_word(void *p, RobotVMWord w)
+static inline void mem_put16(guint8 *mem, RobotVMWord addr, RobotVMWord w)
 {
-	((guint32*)p)[0] = w;
+#if MEM_SWIZZLE
+	if (G_LIKELY(!(addr & 1))) {
+		*((guint16*)(mem + (addr ^ 2))) = w;
+		return;
+	}
+#endif
+	MEM8(mem, addr) = w >> 8;
+	MEM8(mem, addr + 1) = w;
 }
 
 GQuark robot_error_get(void)
@@ -43,26 +105,282 @@ typedef struct _Chunk {
 	size_t len;
 } Chunk;
 
+/* Pre-decoded instruction. Text segment is decoded into the table of these
+ * structures on load, so interpreter does not need to fetch and mask bytes
+ * of every instruction again. */
+typedef struct _Decoded {
+	guint8 cmd;
+	guint8 A, B, C;
+	RobotVMWord imm;  /* Immediate argument of LOAD in host byte order, byte of
+	                   * ADDI/SUBI/ANDI or target of relative branch */
+} Decoded;
+
+/* Internal instructions used only in decoded table: */
+enum {
+	OP_LOAD_MEM = ROBOT_VM_COMMAND_COUNT, /* LOAD with immediate outside of decoded text */
+	OP_CALL_MEM,                          /* CALL with immediate outside of decoded text,
+	                                       * it is counted as CALL                      */
+	OP_INVALID,                           /* Invalid instruction code                   */
+	OP_GOTO,                              /* load r0; const imm                         */
+	/* Superinstructions. A = B = X; R[X] = imm; R0 = imm if condition on R[C] holds:
+	 * load rX; const imm; move r0 rX       */
+	OP_JUMP,
+	/* load rX; const imm; moveif r0 rX rC  */
+	OP_JUMPIF,
+	/* load rX; const imm; moveifz r0 rX rC */
+	OP_JUMPIFZ,
+	OP_JIT,                               /* Start of compiled block, imm is its index  */
+	OP_BREAK,                             /* Breakpoint, instruction is kept in memory  */
+	OP_UNDECODED,                         /* Entry was invalidated and must be decoded  */
+
+	OP_COUNT
+};
+
+typedef gboolean (*RunFunc)(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+
+/* Masked memory has guard tail after power of two address space, so access
+ * to the last masked address does not need a check too: */
+#define MEM_GUARD 4
+
+/* Depth of return address prediction (power of two), deeper calls are
+ * returned with checked fetch: */
+#define RAS_SIZE 16
+
+/* Sparse memory reserves the whole address space of program (with guard of
+ * masked memory) once, so it grows in place: */
+#if GLIB_SIZEOF_SIZE_T > 4
+# define SPARSE_RESERVE (((gsize)1 << 32) + 4096)
+#else
+# define SPARSE_RESERVE ((gsize)1 << 30)
+#endif
+
+/* Compiler of hot blocks is available on x86-64 only: */
+#if defined(ROBOT_VM_JIT) && !defined(__x86_64__)
+# undef ROBOT_VM_JIT
+#endif
+
+#ifdef ROBOT_VM_JIT
+/* Count of jumps to instruction after which block starting at it is compiled: */
+# define JIT_THRESHOLD 256
+
+typedef struct _JitBlock {
+	RobotVMJitFunc func;    /* NULL if block was dropped */
+	guint len;              /* Greatest count of instructions executed by block */
+	guint idx;              /* Index of the first instruction in decoded text */
+	RobotVMWord end;        /* End of text block was compiled from */
+	Decoded orig;           /* Decoded first instruction */
+} JitBlock;
+#endif
+
+/* Counters of profiling variants of interpreter: */
+typedef struct _Profile {
+	guint64 ops[OP_COUNT];  /* Internal instructions are summed into LOAD */
+	guint64 *pc;            /* Per word of decoded text */
+	guint64 outside;        /* Instructions executed outside of decoded text */
+	GArray *ext;            /* guint64 EXT calls per function */
+} Profile;
+
+/* Ring buffer of trace: */
+typedef struct _Trace {
+	RobotVMTraceRecord *buf;
+	guint mask;             /* Size of buffer - 1, size is power of two */
+	guint64 pos;            /* Count of written records */
+} Trace;
+
+/* Trace file: magic, address of text, count of records and records, all words big endian: */
+#define TRACE_MAGIC 0x52564d54 /* RVMT */
+#define TRACE_RECORD_SIZE 12
+
+/* Record/replay log: magic and records. Record starts with type byte, counts,
+ * lengths, addresses and function numbers are varints (7 bits per byte, low
+ * first), register values are big endian words:
+ *   'I' length, bytes          - input read for IN (no bytes at the end of input)
+ *   'E' function, count of registers, (index byte, value) for every changed
+ *       register, count of blocks, (address, length, bytes) for every written block
+ *   'F' domain length, domain, code, message length, message
+ *                              - failure of the preceding read or call */
+#define LOG_MAGIC 0x52564d52 /* RVMR */
+#define LOG_INPUT 'I'
+#define LOG_EXT 'E'
+#define LOG_FAILURE 'F'
+
+typedef struct _Log {
+	gboolean replay;
+
+	/* Recording: */
+	FILE *file;
+	GByteArray *rec;        /* Record being written */
+	gboolean open;          /* EXT call is running or suspended */
+	RobotVMWord func;
+	RobotVMWord R[32];      /* Registers before the call */
+	GArray *writes;         /* Address and length of blocks written during the call */
+
+	/* Replay: */
+	GMappedFile *mapped;
+	const guint8 *data;
+	gsize len;
+	gsize pos;
+} Log;
+
+/* Buffer of OUT or IN instructions, it is flushed or filled by function: */
+#define CHANNEL_BUFFER 4096
+
+typedef struct _Channel {
+	guint8 buf[CHANNEL_BUFFER];
+	guint len;              /* Bytes in buffer */
+	guint pos;              /* Next byte to read (input) */
+	gpointer func;          /* RobotVMWriteFunc or RobotVMReadFunc */
+	gpointer userdata;
+	GDestroyNotify free_userdata;
+} Channel;
+
 struct _RobotVMPrivate {
 	GArray *symtable;
+	gboolean symtable_shared; /* Symtable is referenced by snapshots or forks too */
+	GPtrArray *symtable_owners; /* Shared tables which own userdata of copied symtable */
+
+	/* Memory of VM. It is allocated with g_malloc() or mapped (mem_mapped != 0): */
+	guint8 *mem;
+	gsize mem_len;
+	gsize mem_mapped;       /* Length of mapping */
+	gboolean mem_sparse;    /* Mapping is reservation of sparse memory */
+	RobotVMMemoryBackend backend;
+
+	/* Interpreter variant for memory mode and profiling: */
+	RunFunc run;
+	RobotVMMemoryMode memory_mode;
+	RobotVMWord mask;       /* Address mask in ROBOT_VM_MEMORY_MASKED mode */
+	Profile *profile;       /* NULL if profile is not counted */
+	Trace *trace;           /* NULL if trace is not written */
+	Log *log;               /* NULL if input is not recorded or replayed */
+	RobotVMHooks hooks;
+	gpointer hooks_data;
+	gboolean hooked;        /* Some hook is set */
+	gboolean hook_skip;     /* Step hook suspended VM before the next instruction */
+	/* Addresses of breakpoints (RobotVMWord). Their instructions are decoded as
+	 * OP_BREAK, which decodes the original one from memory again: */
+	GArray *breaks;
+	gboolean break_skip;    /* VM was suspended at breakpoint before the next instruction */
+	gboolean verify;        /* Verify text of loaded programs */
+	gboolean verified;      /* Text passed verify() and was not written since */
+	guint8 *relocated;      /* Relocated words of verified text, saved with state */
+	/* Return addresses pushed by CALL of verified text. RET to predicted
+	 * one doesn't check fetch: */
+	RobotVMWord ras[RAS_SIZE];
+	guint ras_top;
+	guint ras_depth;        /* Count of valid predictions */
 
 	gboolean stop;
+	RobotVMWord exit_code;  /* Argument of the last STOP */
+
+	/* Suspended EXT call. VM doesn't run until it is resumed, failure of call
+	 * is reported by the next run: */
+	gboolean pending;
+	GError *failure;
+
+	/* I/O of OUT and IN: */
+	Channel out;
+	Channel in;
+
+	/* Decoded text segment: */
+	Decoded *code;
+	RobotVMWord code_start;
+	RobotVMWord code_len;   /* Length of decoded part of text in bytes */
+	guint fused;            /* Count of superinstructions in text */
+
+#ifdef ROBOT_VM_JIT
+	gboolean jit_enabled;
+	RobotVMJit *jit;
+	guint16 *hot;           /* Counters of jumps to every word of text, NULL if JIT is off */
+	GArray *blocks;         /* JitBlock, referred by OP_JIT entries of decoded text */
+#endif
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(RobotVM, robot_vm, G_TYPE_OBJECT)
 
+static gboolean run_strict(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_masked(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_strict_profile(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_masked_profile(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_strict_trace(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_masked_trace(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_strict_hooks(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_masked_hooks(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_strict_verified(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static gboolean run_masked_verified(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error);
+static void select_run(RobotVM *self);
+static gboolean ring_submit(RobotVM *self, gpointer userdata, GError **error);
+static gboolean channel_flush(RobotVM *self, GError **error);
+static gboolean channel_fill(RobotVM *self, GError **error);
+static gboolean log_call(RobotVM *self, Symbol *sym, GError **error);
+static gboolean log_fill(RobotVM *self, GError **error);
+static void log_call_done(RobotVM *self, gboolean failed, const GError *failure);
+static void log_write(RobotVM *self, RobotVMWord addr, gsize len);
+static void log_free(RobotVM *self);
+static void channel_clear(Channel *channel);
+static gboolean stdio_write(RobotVM *vm, const guint8 *data, gsize len, gpointer userdata, GError **error);
+static gssize stdio_read(RobotVM *vm, guint8 *data, gsize len, gpointer userdata, GError **error);
+
 static void dispose(GObject *obj)
 {
 	RobotVM *self = ROBOT_VM(obj);
 
 	g_array_unref(self->priv->symtable);
 	self->priv->symtable = NULL;
+	if (self->priv->symtable_owners) {
+		g_ptr_array_unref(self->priv->symtable_owners);
+		self->priv->symtable_owners = NULL;
+	}
+}
+
+static void mem_free(RobotVM *self)
+{
+#if defined(HAVE_MEMFD_CREATE) || defined(HAVE_MAP_NORESERVE)
+	if (self->priv->mem_mapped) {
+		munmap(self->priv->mem, self->priv->mem_mapped);
+		self->priv->mem_mapped = 0;
+		self->priv->mem_sparse = FALSE;
+	} else
+#endif
+		g_free(self->priv->mem);
+	self->priv->mem = NULL;
+	self->priv->mem_len = 0;
+}
+
+static void profile_free(Profile *profile)
+{
+	g_free(profile->pc);
+	g_array_unref(profile->ext);
+	g_free(profile);
 }
 
 static void finalize(GObject *obj)
 {
 	RobotVM *self = ROBOT_VM(obj);
 
+	channel_flush(self, NULL);
+	channel_clear(&self->priv->out);
+	channel_clear(&self->priv->in);
+	log_free(self);
+	if (self->priv->failure)
+		g_error_free(self->priv->failure);
+
+	if (self->priv->profile)
+		profile_free(self->priv->profile);
+	if (self->priv->trace) {
+		g_free(self->priv->trace->buf);
+		g_free(self->priv->trace);
+	}
+	mem_free(self);
+	g_free(self->priv->code);
+	g_free(self->priv->relocated);
+	g_array_unref(self->priv->breaks);
+#ifdef ROBOT_VM_JIT
+	g_free(self->priv->hot);
+	g_array_unref(self->priv->blocks);
+	if (self->priv->jit)
+		robot_vm_jit_free(self->priv->jit);
+#endif
 	self->priv = NULL;
 }
 
@@ -77,27 +395,87 @@ static void robot_vm_init(RobotVM *self)
 {
 	self->priv = robot_vm_get_instance_private(self);
 	self->priv->symtable = g_array_new(FALSE, TRUE, sizeof(Symbol));
+	self->priv->mem = NULL;
+	self->priv->mem_len = 0;
+	self->priv->mem_mapped = 0;
+	self->priv->mem_sparse = FALSE;
+	self->priv->backend = ROBOT_VM_MEMORY_HEAP;
 	self->priv->stop = FALSE;
+	self->priv->exit_code = 0;
+	self->priv->pending = FALSE;
+	self->priv->failure = NULL;
+	memset(&self->priv->out, 0, sizeof(Channel));
+	memset(&self->priv->in, 0, sizeof(Channel));
+	self->priv->out.func = stdio_write;
+	self->priv->in.func = stdio_read;
+	self->priv->code = NULL;
+	self->priv->code_start = 0;
+	self->priv->code_len = 0;
+	self->priv->fused = 0;
+	self->priv->run = run_strict;
+	self->priv->memory_mode = ROBOT_VM_MEMORY_STRICT;
+	self->priv->mask = 0;
+	self->priv->profile = NULL;
+	self->priv->trace = NULL;
+	memset(&self->priv->hooks, 0, sizeof(RobotVMHooks));
+	self->priv->hooks_data = NULL;
+	self->priv->hooked = FALSE;
+	self->priv->hook_skip = FALSE;
+	self->priv->breaks = g_array_new(FALSE, FALSE, sizeof(RobotVMWord));
+	self->priv->break_skip = FALSE;
+	self->priv->verify = TRUE;
+	self->priv->verified = FALSE;
+#ifdef ROBOT_VM_JIT
+	self->priv->jit_enabled = TRUE;
+	self->priv->jit = NULL;
+	self->priv->hot = NULL;
+	self->priv->blocks = g_array_new(FALSE, FALSE, sizeof(JitBlock));
+#endif
 
 	g_array_set_clear_func(self->priv->symtable, symbol_clear);
 
 	self->R[0] = 0;
-	self->memory = g_byte_array_new();
 }
 
 RobotVM* robot_vm_new(void)
 {
 	RobotVM *self = g_object_new(ROBOT_TYPE_VM, NULL);
 
+	robot_vm_add_function(self, "submit", ring_submit, NULL, NULL);
+
 	return self;
 }
 
+/* Copy symtable shared with snapshots or forks before it is changed, other
+ * VMs could run with it. Userdata stays owned by the shared table: */
+static void symtable_unshare(RobotVM *self)
+{
+	GArray *symtable;
+	guint i;
+
+	if (!self->priv->symtable_shared)
+		return;
+
+	symtable = g_array_sized_new(FALSE, TRUE, sizeof(Symbol), self->priv->symtable->len);
+	g_array_append_vals(symtable, self->priv->symtable->data, self->priv->symtable->len);
+	for (i = 0; i < symtable->len; i++)
+		g_array_index(symtable, Symbol, i).free_userdata = NULL;
+	g_array_set_clear_func(symtable, symbol_clear);
+
+	if (!self->priv->symtable_owners)
+		self->priv->symtable_owners = g_ptr_array_new_with_free_func((GDestroyNotify)g_array_unref);
+	g_ptr_array_add(self->priv->symtable_owners, self->priv->symtable);
+	self->priv->symtable = symtable;
+	self->priv->symtable_shared = FALSE;
+}
+
 /* Callback manipulation: */
 guint robot_vm_add_function(RobotVM *self, const char *name, RobotVMFunc func, gpointer userdata, GDestroyNotify free_userdata)
 {
 	guint i;
 	Symbol *sym;
 
+	symtable_unshare(self);
 	for (i = 0; i < self->priv->symtable->len; i++) {
 		sym = &g_array_index(self->priv->symtable, Symbol, i);
 
@@ -126,6 +504,14 @@ guint robot_vm_add_function(RobotVM *self, const char *name, RobotVMFunc func, g
 	return self->priv->symtable->len - 1;
 }
 
+const gchar* robot_vm_get_function_name(RobotVM *self, guint idx)
+{
+	if (idx >= self->priv->symtable->len)
+		return NULL;
+
+	return g_array_index(self->priv->symtable, Symbol, idx).name;
+}
+
 gboolean robot_vm_has_function(RobotVM *self, const char *name)
 {
 	return robot_vm_get_function(self, name) >= 0;
@@ -147,229 +533,675 @@ gint robot_vm_get_function(RobotVM *self, const char *name)
 	return -1;
 }
 
-/* Execute one instruction: */
-static inline gboolean exec(RobotVM *self, GError **error)
+/* Whether there is breakpoint at addr: */
+static gboolean is_break(RobotVM *self, RobotVMWord addr)
 {
-	RobotVMWord a;
-	Symbol *sym;
-	RobotVMCommand cmd;
-	guint8 A, B, C;
+	guint i;
 
-#define GET(r, addr) \
-	do { \
-		if ((addr) + 4 >= self->memory->len) { \
-			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "out of memory"); \
-			return FALSE; \
-		} \
-		r = g_ntohl(*((RobotVMWord*)(self->memory->data + (addr)))); \
-	} while (0)
+	for (i = 0; i < self->priv->breaks->len; i++) {
+		if (g_array_index(self->priv->breaks, RobotVMWord, i) == addr)
+			return TRUE;
+	}
 
-#define PUT(addr, v) \
-	do { \
-		if ((addr) + 4 >= self->memory->len) { \
-			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "out of memory"); \
-			return FALSE; \
-		} \
-		*((RobotVMWord*)(self->memory->data + (addr))) = g_htonl(v); \
-	} while (0)
+	return FALSE;
+}
 
-	if (self->R[0] + 4 > self->memory->len) {
-		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT,
-				"Invalid value of PC (%x)", (unsigned)self->R[0]);
-		return FALSE;
+/* Decode instruction at address pc. pc + 4 must be inside memory. Move at
+ * breakpoint is not fused with LOAD if breaks is TRUE, otherwise breakpoints
+ * are ignored: */
+static void decode_insn(RobotVM *self, RobotVMWord pc, Decoded *d, gboolean breaks)
+{
+	RobotVMWord w = mem_get32(self->priv->mem, pc);
+	guint8 cmd = w >> 24;
+
+	d->cmd = cmd < ROBOT_VM_COMMAND_COUNT? cmd: OP_INVALID;
+	d->A = (w >> 16) & 0x1f;
+	d->B = (w >> 8) & 0x1f;
+	d->C = w & 0x1f;
+	d->imm = 0;
+
+	switch (d->cmd) {
+		case ROBOT_VM_ADDI:
+		case ROBOT_VM_SUBI:
+		case ROBOT_VM_ANDI:
+			d->imm = w & 0xff;
+			return;
+
+		case ROBOT_VM_JMP:
+		case ROBOT_VM_JZ:
+		case ROBOT_VM_JNZ:
+			d->imm = pc + 4 + (RobotVMWord)(gint16)(w & 0xffff) * 4;
+			return;
 	}
 
-	cmd = self->memory->data[self->R[0]++];
-	A = self->memory->data[self->R[0]++] & 0x1f;
-	B = self->memory->data[self->R[0]++] & 0x1f;
-	C = self->memory->data[self->R[0]++] & 0x1f;
-	switch (cmd) {
-		case ROBOT_VM_NOP:    /* No operation                              */
-			break;
+	if (d->cmd == ROBOT_VM_CALL) {
+		if (pc >= self->priv->code_start && pc + 8 <= self->priv->code_start + self->priv->code_len)
+			d->imm = mem_get32(self->priv->mem, pc + 4);
+		else
+			d->cmd = OP_CALL_MEM;
+		return;
+	}
 
-		case ROBOT_VM_LOAD:
-			GET(a, self->R[0]);
-			self->R[0] += 4;
-			self->R[A] = a;
-			break;
+	if (d->cmd == ROBOT_VM_LOAD) {
+		/* Immediate could be cached only if it is placed inside decoded text: */
+		if (pc >= self->priv->code_start && pc + 8 <= self->priv->code_start + self->priv->code_len) {
+			d->imm = mem_get32(self->priv->mem, pc + 4);
+		} else {
+			d->cmd = OP_LOAD_MEM;
+			return;
+		}
 
-		case ROBOT_VM_EXT:   /* Call function by number in symtable       */
-			if (self->priv->symtable->len <= self->R[A]) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_INVALID_ADDRESS,
-						"Invalid function reference: %u\n", (unsigned)self->R[A]);
-				return FALSE;
-			}
-			sym = &g_array_index(self->priv->symtable, Symbol, self->R[A]);
-			if (!sym->func) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Invalid function");
-				return FALSE;
+		if (d->A == 0) {
+			d->cmd = OP_GOTO;
+			return;
+		}
+
+		/* RobotVM has no jumps, so they are written as load of address and move to R0: */
+		if (pc + 12 > self->priv->code_start + self->priv->code_len ||
+				(breaks && G_UNLIKELY(self->priv->breaks->len) && is_break(self, pc + 8)))
+			return;
+
+		w = mem_get32(self->priv->mem, pc + 8);
+		if (((w >> 16) & 0x1f) == 0 && ((w >> 8) & 0x1f) == d->A) {
+			switch (w >> 24) {
+				case ROBOT_VM_MOVE:
+					d->cmd = OP_JUMP;
+					break;
+				case ROBOT_VM_MOVEIF:
+					d->cmd = OP_JUMPIF;
+					break;
+				case ROBOT_VM_MOVEIFZ:
+					d->cmd = OP_JUMPIFZ;
+					break;
+				default:
+					return;
 			}
+			d->B = d->A;
+			d->C = w & 0x1f;
+		}
+	}
+}
 
-			return sym->func(self, sym->userdata, error);
+/* Instruction at breakpoint is decoded as OP_BREAK: */
+static void decode(RobotVM *self, RobotVMWord pc, Decoded *d)
+{
+	decode_insn(self, pc, d, TRUE);
+	if (G_UNLIKELY(self->priv->breaks->len) && is_break(self, pc))
+		d->cmd = OP_BREAK;
+}
 
-		case ROBOT_VM_W8:  /* Write byte to address. (*A = B)           */
-			if (self->R[A] >= self->memory->len) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Write out of memory");
-				return FALSE;
-			}
-			self->memory->data[self->R[A]] = self->R[B];
-			break;
+#ifdef ROBOT_VM_JIT
+static gboolean invalidate(RobotVM *self, RobotVMWord addr, gsize len);
 
-		case ROBOT_VM_R8:  /* Read byte from address. (B = *A)          */
-			if (self->R[B] >= self->memory->len) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Write out of memory");
-				return FALSE;
-			}
-			self->R[A] = self->memory->data[self->R[B]];
-			break;
+/* Put back the first instruction of block. Its code stays in buffer until flush: */
+static void jit_drop(RobotVM *self, JitBlock *blk)
+{
+	self->priv->code[blk->idx] = blk->orig;
+	if (self->priv->hot)
+		self->priv->hot[blk->idx] = 0;
+	blk->func = NULL;
+}
 
-		case ROBOT_VM_W16:    /* Write uint16 to address. (*A = B)         */
-			if (self->R[A] + 1 >= self->memory->len) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Write out of memory");
-				return FALSE;
-			}
-			self->memory->data[self->R[A]] = self->R[B] >> 8;
-			self->memory->data[self->R[A] + 1] = self->R[B];
-			break;
+/* Drop all compiled blocks: */
+static void jit_flush(RobotVM *self)
+{
+	JitBlock *blk;
+	guint i;
 
-		case ROBOT_VM_R16:    /* Read uint16 from address. (B = *A)        */
-			if (self->R[B] + 1 >= self->memory->len) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Write out of memory");
-				return FALSE;
-			}
-			self->R[A] = (self->memory->data[self->R[B]] << 8) + self->memory->data[self->R[B] + 1];
-			break;
+	if (!self->priv->blocks->len)
+		return;
 
-		case ROBOT_VM_W32:
-			PUT(self->R[B], self->R[A]);
-			break;
+	for (i = 0; i < self->priv->blocks->len; i++) {
+		blk = &g_array_index(self->priv->blocks, JitBlock, i);
+		if (blk->func)
+			jit_drop(self, blk);
+	}
+	g_array_set_size(self->priv->blocks, 0);
+	robot_vm_jit_flush(self->priv->jit);
+}
 
-		case ROBOT_VM_R32:
-			GET(self->R[A], self->R[B]);
-			break;
+/* Drop blocks compiled from text in [start, end). Returns TRUE if there were some: */
+static gboolean jit_drop_range(RobotVM *self, guint64 start, guint64 end)
+{
+	JitBlock *blk;
+	gboolean res = FALSE;
+	guint i;
 
-		case ROBOT_VM_SWAP: /* Swap A and B                              */
-			a = self->R[A];
-			self->R[A] = self->R[B];
-			self->R[B] = a;
-			break;
+	for (i = 0; i < self->priv->blocks->len; i++) {
+		blk = &g_array_index(self->priv->blocks, JitBlock, i);
+		if (blk->func && start < blk->end && end > self->priv->code_start + (guint64)blk->idx * 4) {
+			jit_drop(self, blk);
+			res = TRUE;
+		}
+	}
 
-		case ROBOT_VM_MOVE:
-			self->R[A] = self->R[B];
-			break;
+	return res;
+}
 
-		case ROBOT_VM_MOVEIF:
-			if (self->R[C])
-				self->R[A] = self->R[B];
-			break;
+/* Compiled block wrote into text: */
+static gboolean jit_invalidate(RobotVM *self, RobotVMWord addr, guint len)
+{
+	return invalidate(self, addr, len);
+}
 
-		case ROBOT_VM_MOVEIFZ:
-			if (self->R[C] == 0)
-				self->R[A] = self->R[B];
-			break;
+/* Allocate counters of jumps for decoded text: */
+static void jit_reset(RobotVM *self)
+{
+	jit_flush(self);
+	g_free(self->priv->hot);
+	self->priv->hot = NULL;
+
+	/* Compiled blocks are not profiled, traced or hooked and could run over breakpoint: */
+	if (self->priv->jit_enabled && self->priv->code && !self->priv->profile && !self->priv->trace &&
+			!self->priv->hooked && !self->priv->breaks->len)
+		self->priv->hot = g_new0(guint16, self->priv->code_len / 4 + 1);
+}
 
-		case ROBOT_VM_STOP:
-			self->priv->stop = TRUE;
-			break;
+/* Instruction at offset off of text became hot, compile block starting at it: */
+static void jit_hot(RobotVM *self, RobotVMWord off)
+{
+	Decoded *d = &self->priv->code[off >> 2];
+	JitBlock blk;
+
+	if ((off & 3) || d->cmd == OP_JIT)
+		return;
+	if (!self->priv->jit && !(self->priv->jit = robot_vm_jit_new(jit_invalidate)))
+		return;
+	if (d->cmd == OP_UNDECODED)
+		decode(self, self->priv->code_start + off, d);
+
+	if (robot_vm_jit_full(self->priv->jit))
+		jit_flush(self);
+
+	blk.func = robot_vm_jit_compile(self->priv->jit, self, self->priv->code_start + off,
+			self->priv->code_start, self->priv->code_len, &blk.len, &blk.end);
+	if (!blk.func)
+		return;
+
+	blk.idx = off >> 2;
+	blk.orig = *d;
+	g_array_append_val(self->priv->blocks, blk);
+	d->cmd = OP_JIT;
+	d->imm = self->priv->blocks->len - 1;
+}
+#endif
 
-		/* Binary operations: */
-		case ROBOT_VM_LSHIFT:
-			self->R[A] = self->R[B] << (self->R[C] & 31);
-			break;
+/* Drop decoded instructions overlapped by memory region [addr, addr + len).
+ * Returns TRUE if compiled blocks were dropped too: */
+static gboolean invalidate(RobotVM *self, RobotVMWord addr, gsize len)
+{
+	guint64 start = addr;
+	guint64 end = start + len;
+	guint64 code_start = self->priv->code_start;
+	guint64 code_end = code_start + self->priv->code_len;
+	gboolean res = FALSE;
+	gsize i;
+
+	if (end <= code_start || start >= code_end)
+		return FALSE;
 
-		case ROBOT_VM_RSHIFT:
-			self->R[A] = self->R[B] >> (self->R[C] & 31);
-			break;
+	/* Word at start could be immediate of LOAD or the last part of superinstruction: */
+	if (start < code_start + 8)
+		start = code_start;
+	else
+		start -= 8;
 
-		case ROBOT_VM_SSHIFT:
-			self->R[A] = ((gint32)self->R[B]) >> (self->R[C] & 31);
-			break;
+	if (end > code_end)
+		end = code_end;
 
-		case ROBOT_VM_AND:
-			self->R[A] = self->R[B] & self->R[C];
-			break;
+	/* Program modifies itself, its text must be checked again on every fetch: */
+	if (self->priv->verified) {
+		self->priv->verified = FALSE;
+		select_run(self);
+	}
 
-		case ROBOT_VM_OR:
-			self->R[A] = self->R[B] | self->R[C];
-			break;
+#ifdef ROBOT_VM_JIT
+	/* Blocks starting in the range are dropped too, their heads are marked: */
+	res = jit_drop_range(self, start, end);
+#endif
 
-		case ROBOT_VM_XOR:
-			self->R[A] = self->R[B] ^ self->R[C];
-			break;
+	for (i = (start - code_start) >> 2; i < (end - code_start + 3) >> 2; i++) {
+		self->priv->code[i].cmd = OP_UNDECODED;
+	}
 
-		case ROBOT_VM_NEG:
-			self->R[A] = ~self->R[B];
-			break;
+	return res;
+}
 
-		/* Arithmetic operations: */
-		case ROBOT_VM_INCR:   /* ++self->A                                 */
-			++self->R[A];
-			break;
+/* Fast check for writes of up to 4 bytes into the text: */
+#define INVALIDATE(addr, len) \
+	do { \
+		if (G_UNLIKELY((RobotVMWord)((addr) - (self->priv->code_start - 3)) < self->priv->code_len + 3)) \
+			invalidate(self, (addr), (len)); \
+	} while (0)
 
-		case ROBOT_VM_DECR:   /* --self->A                                 */
-			--self->R[A];
-			break;
+/* Decode instruction outside of the decoded text into tmp: */
+static Decoded* fetch_slow(RobotVM *self, Decoded *tmp, GError **error)
+{
+	RobotVMWord pc = self->R[0];
 
-		case ROBOT_VM_INCR4:   /* ++self->A                                 */
-			self->R[A] += 4;
-			break;
+	if (pc + 4 > self->priv->mem_len || pc + 4 < pc) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT,
+				"Invalid value of PC (%x)", (unsigned)pc);
+		return NULL;
+	}
 
-		case ROBOT_VM_DECR4:   /* --self->A                                 */
-			self->R[A] -= 4;
-			break;
+	decode(self, pc, tmp);
 
-		case ROBOT_VM_ADD:
-			/* TODO: overflow! */
-			self->R[A] = self->R[B] + self->R[C];
-			break;
+	return tmp;
+}
 
-		case ROBOT_VM_SUB:
-			/* TODO: overflow! */
-			self->R[A] = self->R[B] + self->R[C];
-			break;
+/* VM reached breakpoint at R0. Without hook it waits before the instruction: */
+static gboolean break_hit(RobotVM *self, GError **error)
+{
+	if (!self->priv->hooks.breakpoint) {
+		robot_vm_suspend(self);
+		return TRUE;
+	}
 
-		case ROBOT_VM_MUL:
-			/* TODO: overflow! */
-			self->R[A] = self->R[B] * self->R[C];
-			break;
+	return self->priv->hooks.breakpoint(self, self->R[0], self->priv->hooks_data, error);
+}
 
-		case ROBOT_VM_DIV:    /* PUSH(POP() / POP())                       */
-			if (!self->R[C]) {
-				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Division by zero");
-				return FALSE;
-			}
-			self->R[A] = self->R[B] / self->R[C];
-			self->R[31] = self->R[B] % self->R[C];
-			break;
+/* Bulk memory instructions. Byte order of host order memory is swizzled
+ * inside of words, so there they loop over bytes instead of using libc: */
+static inline void copy_bytes(guint8 *mem, RobotVMWord dst, RobotVMWord src, gsize n)
+{
+#if MEM_SWIZZLE
+	gsize i;
+
+	if (dst <= src || dst >= (guint64)src + n) {
+		for (i = 0; i < n; i++)
+			MEM8(mem, dst + i) = MEM8(mem, src + i);
+	} else {
+		for (i = n; i--; )
+			MEM8(mem, dst + i) = MEM8(mem, src + i);
+	}
+#else
+	memmove(mem + dst, mem + src, n);
+#endif
+}
 
-		/* I/O */
-		case ROBOT_VM_OUT:    /* Out symbol from stack to console.         */
-			/* TODO: unicode! */
-			/* TODO: channels? */
-			putchar(self->R[A]);
-			break;
+static inline void set_bytes(guint8 *mem, RobotVMWord dst, guint8 value, gsize n)
+{
+#if MEM_SWIZZLE
+	gsize i;
+
+	for (i = 0; i < n; i++)
+		MEM8(mem, dst + i) = value;
+#else
+	memset(mem + dst, value, n);
+#endif
+}
 
-		case ROBOT_VM_IN:     /* Input symbol from console to stack.       */
-			/* TODO: unicode! */
-			/* TODO: channels? */
-			self->R[A] = getchar();
-			break;
+static inline int compare_bytes(const guint8 *mem, RobotVMWord a, RobotVMWord b, gsize n)
+{
+#if MEM_SWIZZLE
+	gsize i;
 
-		default:
-			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_INVALID_INSTRUCTION,
-					"Invalid instruction %02x at %x", self->memory->data[self->R[0]], (unsigned)self->R[0]);
+	for (i = 0; i < n; i++) {
+		if (MEM8(mem, a + i) != MEM8(mem, b + i))
+			return MEM8(mem, a + i) < MEM8(mem, b + i)? -1: 1;
+	}
+	return 0;
+#else
+	return memcmp(mem + a, mem + b, n);
+#endif
+}
+
+static inline gboolean find_zero(const guint8 *mem, RobotVMWord addr, gsize n, gsize *pos)
+{
+#if MEM_SWIZZLE
+	gsize i;
+
+	for (i = 0; i < n; i++) {
+		if (!MEM8(mem, addr + i)) {
+			*pos = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+#else
+	const guint8 *p = memchr(mem + addr, 0, n);
+
+	if (!p)
+		return FALSE;
+	*pos = p - (mem + addr);
+	return TRUE;
+#endif
+}
+
+/* Contiguous part of block at *addr. Strict memory checks the whole block,
+ * masked one wraps address, so block is split at the end of address space: */
+static gboolean block_span(RobotVM *self, RobotVMWord *addr, gsize len, gsize *n, GError **error)
+{
+	if (self->priv->memory_mode == ROBOT_VM_MEMORY_MASKED) {
+		*addr &= self->priv->mask;
+		*n = MIN(len, (gsize)self->priv->mask + 1 - *addr);
+		return TRUE;
+	}
+
+	if ((guint64)*addr + len > self->priv->mem_len) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Block out of memory");
+		return FALSE;
+	}
+	*n = len;
+	return TRUE;
+}
+
+static gboolean block_copy(RobotVM *self, RobotVMWord dst, RobotVMWord src, RobotVMWord len, GError **error)
+{
+	gsize n, m;
+
+	while (len) {
+		if (!block_span(self, &dst, len, &n, error) || !block_span(self, &src, n, &m, error))
+			return FALSE;
+		copy_bytes(self->priv->mem, dst, src, m);
+		invalidate(self, dst, m);
+		dst += m;
+		src += m;
+		len -= m;
+	}
+
+	return TRUE;
+}
+
+static gboolean block_set(RobotVM *self, RobotVMWord dst, guint8 value, RobotVMWord len, GError **error)
+{
+	gsize n;
+
+	while (len) {
+		if (!block_span(self, &dst, len, &n, error))
+			return FALSE;
+		set_bytes(self->priv->mem, dst, value, n);
+		invalidate(self, dst, n);
+		dst += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+static gboolean block_compare(RobotVM *self, RobotVMWord a, RobotVMWord b, RobotVMWord len, RobotVMWord *res, GError **error)
+{
+	gsize n, m;
+	int r;
+
+	while (len) {
+		if (!block_span(self, &a, len, &n, error) || !block_span(self, &b, n, &m, error))
 			return FALSE;
+		r = compare_bytes(self->priv->mem, a, b, m);
+		if (r) {
+			*res = r < 0? (RobotVMWord)-1: 1;
+			return TRUE;
+		}
+		a += m;
+		b += m;
+		len -= m;
 	}
+
+	*res = 0;
 	return TRUE;
 }
 
+static gboolean block_length(RobotVM *self, RobotVMWord addr, RobotVMWord *res, GError **error)
+{
+	const guint8 *mem = self->priv->mem;
+	gsize pos, end;
+
+	if (self->priv->memory_mode == ROBOT_VM_MEMORY_MASKED) {
+		addr &= self->priv->mask;
+		end = (gsize)self->priv->mask + 1;
+		if (find_zero(mem, addr, end - addr, &pos)) {
+			*res = pos;
+			return TRUE;
+		}
+		/* String wraps around the end of address space: */
+		if (find_zero(mem, 0, addr, &pos)) {
+			*res = end - addr + pos;
+			return TRUE;
+		}
+	} else if (addr < self->priv->mem_len && find_zero(mem, addr, self->priv->mem_len - addr, &pos)) {
+		*res = pos;
+		return TRUE;
+	}
+
+	g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "String out of memory");
+	return FALSE;
+}
+
+/* Return address predictor of verified text: */
+static inline void ras_push(RobotVMPrivate *priv, RobotVMWord addr)
+{
+	priv->ras[priv->ras_top++ & (RAS_SIZE - 1)] = addr;
+	if (priv->ras_depth < RAS_SIZE)
+		++priv->ras_depth;
+}
+
+/* Whether return address was predicted by CALL, so it is inside of text: */
+static inline gboolean ras_pop(RobotVMPrivate *priv, RobotVMWord addr)
+{
+	if (!priv->ras_depth)
+		return FALSE;
+	--priv->ras_depth;
+	return priv->ras[--priv->ras_top & (RAS_SIZE - 1)] == addr;
+}
+
+/* Interpreter can be built in two variants: with switch() dispatch and with
+ * threaded dispatch using GCC "labels as values" extension. In the second
+ * case every instruction jumps directly to the handler of the next one. */
+#if defined(ROBOT_VM_THREADED) && !defined(__GNUC__)
+# undef ROBOT_VM_THREADED
+#endif
+
+/* Interpreter variants. Every one is instantiated from robot_vm_loop.h: */
+#define RUN_NAME run_strict
+#define RUN_MASKED 0
+#define RUN_PROFILE 0
+#define RUN_TRACE 0
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_masked
+#define RUN_MASKED 1
+#define RUN_PROFILE 0
+#define RUN_TRACE 0
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_strict_profile
+#define RUN_MASKED 0
+#define RUN_PROFILE 1
+#define RUN_TRACE 0
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_masked_profile
+#define RUN_MASKED 1
+#define RUN_PROFILE 1
+#define RUN_TRACE 0
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_strict_verified
+#define RUN_MASKED 0
+#define RUN_PROFILE 0
+#define RUN_TRACE 0
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 1
+#define RUN_FALLBACK run_strict
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+#undef RUN_FALLBACK
+
+#define RUN_NAME run_masked_verified
+#define RUN_MASKED 1
+#define RUN_PROFILE 0
+#define RUN_TRACE 0
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 1
+#define RUN_FALLBACK run_masked
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+#undef RUN_FALLBACK
+
+#define RUN_NAME run_strict_trace
+#define RUN_MASKED 0
+#define RUN_PROFILE 1
+#define RUN_TRACE 1
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_masked_trace
+#define RUN_MASKED 1
+#define RUN_PROFILE 1
+#define RUN_TRACE 1
+#define RUN_HOOKS 0
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_strict_hooks
+#define RUN_MASKED 0
+#define RUN_PROFILE 1
+#define RUN_TRACE 1
+#define RUN_HOOKS 1
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+#define RUN_NAME run_masked_hooks
+#define RUN_MASKED 1
+#define RUN_PROFILE 1
+#define RUN_TRACE 1
+#define RUN_HOOKS 1
+#define RUN_VERIFIED 0
+#include "robot_vm_loop.h"
+#undef RUN_NAME
+#undef RUN_MASKED
+#undef RUN_PROFILE
+#undef RUN_TRACE
+#undef RUN_HOOKS
+#undef RUN_VERIFIED
+
+/* Choose interpreter variant for memory mode, hooks, profiling, tracing and verification: */
+static void select_run(RobotVM *self)
+{
+	if (self->priv->memory_mode == ROBOT_VM_MEMORY_MASKED) {
+		if (self->priv->hooked)
+			self->priv->run = run_masked_hooks;
+		else if (self->priv->trace)
+			self->priv->run = run_masked_trace;
+		else if (self->priv->profile)
+			self->priv->run = run_masked_profile;
+		else
+			self->priv->run = self->priv->verified? run_masked_verified: run_masked;
+	} else {
+		if (self->priv->hooked)
+			self->priv->run = run_strict_hooks;
+		else if (self->priv->trace)
+			self->priv->run = run_strict_trace;
+		else if (self->priv->profile)
+			self->priv->run = run_strict_profile;
+		else
+			self->priv->run = self->priv->verified? run_strict_verified: run_strict;
+	}
+}
+
+/* Output is flushed whenever VM returns to host: */
+static inline gboolean run_done(RobotVM *self, gboolean res, GError **error)
+{
+	if (self->priv->out.len && !channel_flush(self, res? error: NULL))
+		return FALSE;
+
+	return res;
+}
+
+static inline gboolean run(RobotVM *self, guint64 count, gboolean ext_break, GError **error)
+{
+	return run_done(self, self->priv->run(self, &count, ext_break, error), error);
+}
+
+/* VM with pending call is parked: it executes nothing, and failure of resumed
+ * call is returned by the next run. Returns TRUE if VM must not run: */
+static gboolean parked(RobotVM *self, gboolean *res, GError **error)
+{
+	*res = TRUE;
+
+	if (G_UNLIKELY(self->priv->failure)) {
+		g_propagate_error(error, self->priv->failure);
+		self->priv->failure = NULL;
+		*res = FALSE;
+		return TRUE;
+	}
+
+	return self->priv->pending;
+}
+
 /* Execute program throw the end: */
 gboolean robot_vm_exec(RobotVM *self, GError **error)
 {
+	gboolean res;
+
 	self->priv->stop = FALSE;
 
 	while (!self->priv->stop) {
-		if (!exec(self, error))
+		if (parked(self, &res, error))
+			return res;
+		if (!run(self, G_MAXUINT64, FALSE, error))
 			return FALSE;
 	}
 
@@ -379,7 +1211,10 @@ gboolean robot_vm_exec(RobotVM *self, GError **error)
 /* Execute one program instruction: */
 gboolean robot_vm_step(RobotVM *self, gboolean *stop, GError **error)
 {
-	gboolean res = exec(self, error);
+	gboolean res;
+
+	if (!parked(self, &res, error))
+		res = run(self, 1, FALSE, error);
 
 	if (res && stop) {
 		*stop = self->priv->stop;
@@ -391,97 +1226,2102 @@ gboolean robot_vm_step(RobotVM *self, gboolean *stop, GError **error)
 /* Execute program until some syscall: */
 gboolean robot_vm_next(RobotVM *self, gboolean *stop, GError **error)
 {
+	gboolean res;
+
 	self->priv->stop = FALSE;
 
-	while (!self->priv->stop) {
-		if (self->R[0] < self->memory->len &&
-				self->memory->data[self->R[0]] == ROBOT_VM_EXT) {
-			break;
-		}
+	if (parked(self, &res, error)) {
+		if (res && stop)
+			*stop = FALSE;
+		return res;
+	}
 
-		if (!exec(self, error)) {
-			return FALSE;
-		}
+	if (!run(self, G_MAXUINT64, TRUE, error)) {
+		return FALSE;
 	}
 
-	if (*stop)
+	if (stop)
 		*stop = self->priv->stop;
 
 	return TRUE;
 }
 
-void robot_vm_allocate_memory(RobotVM *self, gsize len)
+/* Execute at most max_instructions instructions. Stops on STOP, before EXT or
+ * on error. EXT at the start of slice is executed, so every call makes progress: */
+gboolean robot_vm_run_for(RobotVM *self, guint64 max_instructions, guint64 *executed, gboolean *stop, GError **error)
 {
-	if (len > self->memory->len) {
-		g_byte_array_set_size(self->memory, len);
-	}
-}
+	guint64 budget = max_instructions;
+	guint64 first = 1;
+	gboolean res = TRUE;
 
-gboolean robot_vm_load(RobotVM *self, RobotObjFile *obj, GError **error)
-{
-	gsize sz = 2;
-	gsize sz2 = 2;
-	gsize s;
-	guint i;
-	RobotVMWord w, r;
-	RobotObjFileSymbol *sym;
+	self->priv->stop = FALSE;
 
-	for (i = 0; i < obj->depends->len; i++) {
-		sym = &g_array_index(obj->depends, RobotObjFileSymbol, i);
-		if (sym->name[0] != '%') {
-			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_NAME, "Unresolved: %s", sym->name);
-			return FALSE;
-		}
+	if (parked(self, &res, error)) {
+		budget = 0;
+	} else if (budget) {
+		res = self->priv->run(self, &first, FALSE, error);
+		budget -= 1 - first;
 
-		if (!robot_vm_has_function(self, sym->name + 1)) {
-			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_NAME, "Unresolved syscall: %s", sym->name);
-			return FALSE;
-		}
+		if (res && budget && !self->priv->stop && !self->priv->pending)
+			res = self->priv->run(self, &budget, TRUE, error);
 	}
 
-	while (sz > 1 && sz < obj->text->len)
-		sz <<= 1;
-	while (sz2 > 1 && sz2 < obj->data->len)
-		sz2 <<= 1;
-
-	s = sz + sz2 + obj->SS + 0x10000;
-	if (self->memory->len < s) {
-		robot_vm_allocate_memory(self, s); 
-	}
+	res = run_done(self, res, error);
 
-	self->R[0] = obj->SS;
-	self->R[1] = obj->SS;
+	if (executed)
+		*executed = max_instructions - budget;
+	if (stop)
+		*stop = self->priv->stop;
 
-	/* Load text and data segments: */
-	memcpy(self->memory->data + self->R[1], obj->text->data, obj->text->len);
-	memcpy(self->memory->data + self->R[1] + sz, obj->data->data, obj->data->len);
+	return res;
+}
 
-	/* Process relocations: */
-	for (i = 0; i < obj->relocation->len; i++) {
-		r = g_array_index(obj->relocation, RobotVMWord, i);
+/* Called by function of EXT instruction which can't complete now: */
+void robot_vm_suspend(RobotVM *self)
+{
+	self->priv->pending = TRUE;
+}
 
-		if (r < obj->text->len) {
-			r += self->R[1];
-			GET(w, r);
-			w += self->R[1];
-			PUT(r, w);
-		} else {
-			r += self->R[1];
-			r += sz;
-			r -= obj->text->len;
+gboolean robot_vm_is_pending(RobotVM *self)
+{
+	return self->priv->pending;
+}
 
-			GET(w, r);
-			w += self->R[1] + sz;
-			PUT(r, w);
-		}
+/* Complete pending call. Failure (taken by VM) is returned by the next run: */
+void robot_vm_resume(RobotVM *self, GError *failure)
+{
+	g_return_if_fail(self->priv->pending);
+
+	self->priv->pending = FALSE;
+	if (G_UNLIKELY(self->priv->log && self->priv->log->open))
+		log_call_done(self, failure != NULL, failure);
+	if (failure) {
+		g_clear_error(&self->priv->failure);
+		self->priv->failure = failure;
+	}
+}
+
+/* Complete pending call with result word on the top of stack, as function
+ * would push it. Overflow of stack is failure of the call: */
+void robot_vm_resume_word(RobotVM *self, RobotVMWord result)
+{
+	GError *failure = NULL;
+
+	g_return_if_fail(self->priv->pending);
+
+	robot_vm_stack_push_word(self, result, &failure);
+	robot_vm_resume(self, failure);
+}
+
+/* Value of STOP argument after program stopped: */
+RobotVMWord robot_vm_get_exit_code(RobotVM *self)
+{
+	return self->priv->exit_code;
+}
+
+/* Switch memory mode. Memory is reallocated for masked mode if needed: */
+void robot_vm_set_memory_mode(RobotVM *self, RobotVMMemoryMode mode)
+{
+	self->priv->memory_mode = mode;
+
+	switch (mode) {
+		case ROBOT_VM_MEMORY_MASKED:
+			robot_vm_allocate_memory(self, self->priv->mem_len);
+			break;
+
+		default:
+			self->priv->mask = 0;
+			break;
+	}
+	select_run(self);
+}
+
+RobotVMMemoryMode robot_vm_get_memory_mode(RobotVM *self)
+{
+	return self->priv->memory_mode;
+}
+
+/* Count of jumps fused into superinstructions by robot_vm_load: */
+guint robot_vm_get_fused_count(RobotVM *self)
+{
+	return self->priv->fused;
+}
+
+/* Turn on or off compilation of hot blocks (it is on by default if RobotVM
+ * is built with ROBOT_VM_JIT): */
+void robot_vm_set_jit_enabled(RobotVM *self, gboolean enabled)
+{
+#ifdef ROBOT_VM_JIT
+	self->priv->jit_enabled = enabled;
+	jit_reset(self);
+#endif
+}
+
+void robot_vm_set_verify_enabled(RobotVM *self, gboolean enabled)
+{
+	self->priv->verify = enabled;
+	if (!enabled && self->priv->verified) {
+		self->priv->verified = FALSE;
+		select_run(self);
+	}
+}
+
+gboolean robot_vm_is_verified(RobotVM *self)
+{
+	return self->priv->verified;
+}
+
+/* Count of blocks compiled since the last flush: */
+guint robot_vm_get_jit_count(RobotVM *self)
+{
+#ifdef ROBOT_VM_JIT
+	return self->priv->blocks->len;
+#else
+	return 0;
+#endif
+}
+
+/* Counters of text are allocated for loaded program: */
+static void profile_reset(RobotVM *self)
+{
+	Profile *prof = self->priv->profile;
+
+	memset(prof->ops, 0, sizeof(prof->ops));
+	g_free(prof->pc);
+	prof->pc = g_new0(guint64, self->priv->code_len / 4 + 1);
+	prof->outside = 0;
+	g_array_set_size(prof->ext, 0);
+}
+
+void robot_vm_set_profiling(RobotVM *self, gboolean enabled)
+{
+	if (enabled && !self->priv->profile) {
+		self->priv->profile = g_new0(Profile, 1);
+		self->priv->profile->ext = g_array_new(FALSE, TRUE, sizeof(guint64));
+		profile_reset(self);
+	} else if (!enabled && self->priv->profile) {
+		profile_free(self->priv->profile);
+		self->priv->profile = NULL;
+	}
+
+	select_run(self);
+#ifdef ROBOT_VM_JIT
+	jit_reset(self);
+#endif
+}
+
+RobotVMProfile* robot_vm_get_profile(RobotVM *self)
+{
+	Profile *prof = self->priv->profile;
+	RobotVMProfile *res;
+	guint i;
+
+	if (!prof)
+		return NULL;
+
+	res = g_new0(RobotVMProfile, 1);
+	memcpy(res->opcodes, prof->ops, sizeof(res->opcodes));
+	/* Instructions which are decoded into internal ones are LOADs: */
+	for (i = OP_LOAD_MEM; i < OP_UNDECODED; i++) {
+		if (i != OP_INVALID && i != OP_JIT && i != OP_BREAK)
+			res->opcodes[ROBOT_VM_LOAD] += prof->ops[i];
+	}
+
+	res->text_start = self->priv->code_start;
+	res->text_len = self->priv->code_len / 4;
+	res->pc = g_new(guint64, res->text_len);
+	memcpy(res->pc, prof->pc, sizeof(guint64) * res->text_len);
+	res->outside = prof->outside;
+	res->n_functions = prof->ext->len;
+	res->functions = g_new(guint64, res->n_functions);
+	memcpy(res->functions, prof->ext->data, sizeof(guint64) * res->n_functions);
+
+	return res;
+}
+
+void robot_vm_profile_free(RobotVMProfile *profile)
+{
+	g_free(profile->pc);
+	g_free(profile->functions);
+	g_free(profile);
+}
+
+void robot_vm_set_trace(RobotVM *self, guint n_records)
+{
+	Trace *trace = self->priv->trace;
+	guint size = 1;
+
+	while (size < n_records && size < G_MAXUINT / 2 + 1)
+		size <<= 1;
+
+	if (trace && (!n_records || trace->mask != size - 1)) {
+		g_free(trace->buf);
+		g_free(trace);
+		self->priv->trace = trace = NULL;
+	}
+	if (n_records && !trace) {
+		trace = g_new(Trace, 1);
+		trace->buf = g_new0(RobotVMTraceRecord, size);
+		trace->mask = size - 1;
+		trace->pos = 0;
+		self->priv->trace = trace;
+	}
+
+	select_run(self);
+#ifdef ROBOT_VM_JIT
+	jit_reset(self);
+#endif
+}
+
+GArray* robot_vm_get_trace(RobotVM *self)
+{
+	Trace *trace = self->priv->trace;
+	GArray *res = g_array_new(FALSE, FALSE, sizeof(RobotVMTraceRecord));
+	guint64 i;
+
+	if (!trace)
+		return res;
+
+	i = trace->pos > trace->mask? trace->pos - trace->mask - 1: 0;
+	for (; i < trace->pos; i++)
+		g_array_append_val(res, trace->buf[i & trace->mask]);
+
+	return res;
+}
+
+static void put_word(GByteArray *data, RobotVMWord w)
+{
+	w = g_htonl(w);
+	g_byte_array_append(data, (const guint8*)&w, 4);
+}
+
+static RobotVMWord get_word(const guint8 *p)
+{
+	return ((RobotVMWord)p[0] << 24) | ((RobotVMWord)p[1] << 16) | ((RobotVMWord)p[2] << 8) | p[3];
+}
+
+gboolean robot_vm_dump_trace(RobotVM *self, const gchar *filename, GError **error)
+{
+	GArray *records = robot_vm_get_trace(self);
+	GByteArray *data = g_byte_array_new();
+	RobotVMTraceRecord *rec;
+	guint8 insn[4];
+	gboolean res;
+	guint i;
+
+	put_word(data, TRACE_MAGIC);
+	put_word(data, self->priv->code_start);
+	put_word(data, records->len);
+	for (i = 0; i < records->len; i++) {
+		rec = &g_array_index(records, RobotVMTraceRecord, i);
+		insn[0] = rec->op;
+		insn[1] = rec->A;
+		insn[2] = rec->B;
+		insn[3] = rec->C;
+		put_word(data, rec->pc);
+		g_byte_array_append(data, insn, 4);
+		put_word(data, rec->value);
+	}
+
+	res = g_file_set_contents(filename, (const gchar*)data->data, data->len, error);
+	g_byte_array_unref(data);
+	g_array_unref(records);
+
+	return res;
+}
+
+GArray* robot_vm_load_trace(const gchar *filename, RobotVMWord *text_start, GError **error)
+{
+	RobotVMTraceRecord rec;
+	GArray *res;
+	gchar *data;
+	const guint8 *p;
+	gsize len;
+	guint n, i;
+
+	if (!g_file_get_contents(filename, &data, &len, error))
+		return NULL;
+
+	p = (const guint8*)data;
+	n = len >= 12? get_word(p + 8): 0;
+	if (len < 12 || get_word(p) != TRACE_MAGIC || (len - 12) / TRACE_RECORD_SIZE != n) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Invalid trace file `%s'", filename);
+		g_free(data);
+		return NULL;
+	}
+
+	if (text_start)
+		*text_start = get_word(p + 4);
+	res = g_array_sized_new(FALSE, FALSE, sizeof(RobotVMTraceRecord), n);
+	for (i = 0, p += 12; i < n; i++, p += TRACE_RECORD_SIZE) {
+		rec.pc = get_word(p);
+		rec.op = p[4];
+		rec.A = p[5];
+		rec.B = p[6];
+		rec.C = p[7];
+		rec.value = get_word(p + 8);
+		g_array_append_val(res, rec);
+	}
+	g_free(data);
+
+	return res;
+}
+
+void robot_vm_set_hooks(RobotVM *self, const RobotVMHooks *hooks, gpointer userdata)
+{
+	if (hooks)
+		self->priv->hooks = *hooks;
+	else
+		memset(&self->priv->hooks, 0, sizeof(RobotVMHooks));
+	self->priv->hooks_data = userdata;
+	/* Breakpoint hook is called by every variant: */
+	self->priv->hooked = self->priv->hooks.step || self->priv->hooks.write;
+	self->priv->hook_skip = FALSE;
+
+	select_run(self);
+#ifdef ROBOT_VM_JIT
+	jit_reset(self);
+#endif
+}
+
+/* Instruction at breakpoint and LOAD which could be fused with it are decoded
+ * again when they are fetched: */
+static void break_undecode(RobotVMPrivate *priv, Decoded *code, RobotVMWord addr)
+{
+	RobotVMWord off = addr - priv->code_start;
+
+	if (off < priv->code_len && !(off & 3)) {
+		code[off >> 2].cmd = OP_UNDECODED;
+		if (off >= 8)
+			code[(off - 8) >> 2].cmd = OP_UNDECODED;
+	}
+}
+
+static void break_changed(RobotVM *self, RobotVMWord addr)
+{
+	if (self->priv->code)
+		break_undecode(self->priv, self->priv->code, addr);
+#ifdef ROBOT_VM_JIT
+	jit_reset(self);
+#endif
+}
+
+void robot_vm_set_breakpoint(RobotVM *self, RobotVMWord addr)
+{
+	if (is_break(self, addr))
+		return;
+
+	g_array_append_val(self->priv->breaks, addr);
+	break_changed(self, addr);
+}
+
+gboolean robot_vm_clear_breakpoint(RobotVM *self, RobotVMWord addr)
+{
+	guint i;
+
+	for (i = 0; i < self->priv->breaks->len; i++) {
+		if (g_array_index(self->priv->breaks, RobotVMWord, i) == addr) {
+			g_array_remove_index_fast(self->priv->breaks, i);
+			/* VM waits at the cleared breakpoint: */
+			if (addr == self->R[0])
+				self->priv->break_skip = FALSE;
+			break_changed(self, addr);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Host changed memory directly: */
+void robot_vm_invalidate(RobotVM *self, RobotVMWord addr, gsize len)
+{
+	if (self->priv->code)
+		invalidate(self, addr, len);
+}
+
+#ifdef HAVE_MAP_NORESERVE
+/* Pages of zeroes are not copied, so they are not committed: */
+static void sparse_copy(guint8 *dst, const guint8 *src, gsize len)
+{
+	static const guint8 zero[4096];
+	gsize off, n;
+
+	for (off = 0; off < len; off += n) {
+		n = MIN(sizeof(zero), len - off);
+		if (memcmp(src + off, zero, n))
+			memcpy(dst + off, src + off, n);
+	}
+}
+#endif
+
+/* Grow sparse memory to len bytes. Reserved pages are made accessible, kernel
+ * commits them when they are touched first. Returns FALSE if address space
+ * can't be reserved, memory stays as it was then: */
+static gboolean sparse_grow(RobotVM *self, gsize len)
+{
+#ifdef HAVE_MAP_NORESERVE
+	gsize page = sysconf(_SC_PAGESIZE);
+	gsize commit = (len + page - 1) & ~(page - 1);
+	guint8 *mem;
+
+	if (commit > SPARSE_RESERVE)
+		return FALSE;
+
+	if (self->priv->mem_sparse) {
+		if (mprotect(self->priv->mem, commit, PROT_READ | PROT_WRITE))
+			return FALSE;
+		self->priv->mem_len = len;
+		return TRUE;
+	}
+
+	mem = mmap(NULL, SPARSE_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		return FALSE;
+	if (mprotect(mem, commit, PROT_READ | PROT_WRITE)) {
+		munmap(mem, SPARSE_RESERVE);
+		return FALSE;
+	}
+
+	sparse_copy(mem, self->priv->mem, self->priv->mem_len);
+	mem_free(self);
+	self->priv->mem = mem;
+	self->priv->mem_mapped = SPARSE_RESERVE;
+	self->priv->mem_sparse = TRUE;
+	self->priv->mem_len = len;
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+void robot_vm_allocate_memory(RobotVM *self, gsize len)
+{
+	gsize size;
+
+#if MEM_SWIZZLE
+	/* Memory must consist of whole words: */
+	len = (len + 3) & ~(gsize)3;
+#endif
+	if (self->priv->memory_mode == ROBOT_VM_MEMORY_MASKED) {
+		/* Address space only grows, so addresses valid before stay valid: */
+		size = (gsize)self->priv->mask + 1;
+		while (size < len && size <= G_MAXUINT32)
+			size <<= 1;
+		self->priv->mask = size - 1;
+		len = size + MEM_GUARD;
+	}
+
+	if (len <= self->priv->mem_len)
+		return;
+
+	/* Sparse memory falls back to heap if it can't be reserved: */
+	if (self->priv->backend == ROBOT_VM_MEMORY_SPARSE && sparse_grow(self, len))
+		return;
+
+#if defined(HAVE_MEMFD_CREATE) || defined(HAVE_MAP_NORESERVE)
+	if (self->priv->mem_mapped) {
+		/* Mapping of snapshot can't grow, memory moves to heap: */
+		guint8 *mem = g_malloc0(len);
+
+		memcpy(mem, self->priv->mem, self->priv->mem_len);
+		mem_free(self);
+		self->priv->mem = mem;
+		self->priv->mem_len = len;
+		return;
+	}
+#endif
+
+	self->priv->mem = g_realloc(self->priv->mem, len);
+	memset(self->priv->mem + self->priv->mem_len, 0, len - self->priv->mem_len);
+	self->priv->mem_len = len;
+}
+
+gboolean robot_vm_set_memory_backend(RobotVM *self, RobotVMMemoryBackend backend, GError **error)
+{
+	gsize len = self->priv->mem_len;
+
+#ifndef HAVE_MAP_NORESERVE
+	if (backend == ROBOT_VM_MEMORY_SPARSE) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Sparse memory is not supported on this system");
+		return FALSE;
+	}
+#endif
+	if (backend == self->priv->backend)
+		return TRUE;
+
+	self->priv->backend = backend;
+	if (!len)
+		return TRUE;
+
+	if (backend == ROBOT_VM_MEMORY_SPARSE) {
+		if (sparse_grow(self, len))
+			return TRUE;
+		self->priv->backend = ROBOT_VM_MEMORY_HEAP;
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Can't reserve address space: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	/* Back to heap, mapping of snapshot stays as it is: */
+#ifdef HAVE_MAP_NORESERVE
+	if (self->priv->mem_sparse) {
+		guint8 *mem = self->priv->mem;
+
+		self->priv->mem = g_malloc(len);
+		memcpy(self->priv->mem, mem, len);
+		munmap(mem, self->priv->mem_mapped);
+		self->priv->mem_mapped = 0;
+		self->priv->mem_sparse = FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+RobotVMMemoryBackend robot_vm_get_memory_backend(RobotVM *self)
+{
+	return self->priv->backend;
+}
+
+gsize robot_vm_get_memory_size(RobotVM *self)
+{
+	return self->priv->mem_len;
+}
+
+/* Copy big endian image to VM memory and back. Range must be checked by caller. */
+static void copy_to_memory(RobotVM *self, RobotVMWord addr, const guint8 *src, gsize len)
+{
+#if MEM_SWIZZLE
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		MEM8(self->priv->mem, addr + i) = src[i];
+	}
+#else
+	memcpy(self->priv->mem + addr, src, len);
+#endif
+}
+
+static void copy_from_memory(RobotVM *self, RobotVMWord addr, guint8 *dst, gsize len)
+{
+#if MEM_SWIZZLE
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		dst[i] = MEM8(self->priv->mem, addr + i);
+	}
+#else
+	memcpy(dst, self->priv->mem + addr, len);
+#endif
+}
+
+static gboolean check_range(RobotVM *self, RobotVMWord addr, gsize len, GError **error)
+{
+	if ((guint64)addr + len > self->priv->mem_len) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_INVALID_ADDRESS,
+				"Invalid memory access (%x, %u bytes)", (unsigned)addr, (unsigned)len);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Access to memory of VM. Data is in program (big endian) byte order: */
+gboolean robot_vm_read_memory(RobotVM *self, RobotVMWord addr, gpointer data, gsize len, GError **error)
+{
+	if (!check_range(self, addr, len, error))
+		return FALSE;
+
+	copy_from_memory(self, addr, data, len);
+
+	return TRUE;
+}
+
+gboolean robot_vm_write_memory(RobotVM *self, RobotVMWord addr, gconstpointer data, gsize len, GError **error)
+{
+	if (!check_range(self, addr, len, error))
+		return FALSE;
+
+	copy_to_memory(self, addr, data, len);
+	robot_vm_invalidate(self, addr, len);
+	if (G_UNLIKELY(self->priv->log && self->priv->log->open))
+		log_write(self, addr, len);
+
+	return TRUE;
+}
+
+gboolean robot_vm_read_word(RobotVM *self, RobotVMWord addr, RobotVMWord *w, GError **error)
+{
+	if (!check_range(self, addr, sizeof(RobotVMWord), error))
+		return FALSE;
+
+	*w = mem_get32(self->priv->mem, addr);
+
+	return TRUE;
+}
+
+gboolean robot_vm_write_word(RobotVM *self, RobotVMWord addr, RobotVMWord w, GError **error)
+{
+	if (!check_range(self, addr, sizeof(RobotVMWord), error))
+		return FALSE;
+
+	mem_put32(self->priv->mem, addr, w);
+	robot_vm_invalidate(self, addr, sizeof(RobotVMWord));
+	if (G_UNLIKELY(self->priv->log && self->priv->log->open))
+		log_write(self, addr, sizeof(RobotVMWord));
+
+	return TRUE;
+}
+
+static void put_varint(GByteArray *data, guint64 v)
+{
+	guint8 b;
+
+	do {
+		b = v & 0x7f;
+		v >>= 7;
+		if (v)
+			b |= 0x80;
+		g_byte_array_append(data, &b, 1);
+	} while (v);
+}
+
+static void put_string(GByteArray *data, const gchar *s)
+{
+	gsize len = strlen(s);
+
+	put_varint(data, len);
+	g_byte_array_append(data, (const guint8*)s, len);
+}
+
+static gboolean get_varint(Log *log, guint64 *v)
+{
+	guint shift = 0;
+	guint8 b;
+
+	*v = 0;
+	do {
+		if (log->pos >= log->len || shift > 63)
+			return FALSE;
+		b = log->data[log->pos++];
+		*v |= (guint64)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	return TRUE;
+}
+
+/* Next len bytes of replayed log, NULL if there are less of them: */
+static const guint8* get_bytes(Log *log, guint64 len)
+{
+	const guint8 *p = log->data + log->pos;
+
+	if (len > log->len - log->pos)
+		return NULL;
+	log->pos += len;
+
+	return p;
+}
+
+static void log_free(RobotVM *self)
+{
+	Log *log = self->priv->log;
+
+	if (!log)
+		return;
+	if (log->file)
+		fclose(log->file);
+	if (log->rec)
+		g_byte_array_unref(log->rec);
+	if (log->writes)
+		g_array_unref(log->writes);
+	if (log->mapped)
+		g_mapped_file_unref(log->mapped);
+	g_free(log);
+	self->priv->log = NULL;
+}
+
+/* Records are buffered by stdio, so recording costs one copy: */
+static void log_put_record(Log *log)
+{
+	fwrite(log->rec->data, 1, log->rec->len, log->file);
+	g_byte_array_set_size(log->rec, 0);
+}
+
+/* Failure without error has empty domain: */
+static void log_put_failure(Log *log, const GError *failure)
+{
+	guint8 type = LOG_FAILURE;
+
+	g_byte_array_append(log->rec, &type, 1);
+	put_string(log->rec, failure? g_quark_to_string(failure->domain): "");
+	put_varint(log->rec, failure? (guint32)failure->code: 0);
+	put_string(log->rec, failure? failure->message: "");
+}
+
+static gboolean log_mismatch(RobotVM *self, GError **error)
+{
+	g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Replay log doesn't match program at offset %lu",
+			(gulong)self->priv->log->pos);
+
+	return FALSE;
+}
+
+/* Failure of replayed read or call, if the log has it after its record: */
+static gboolean log_get_failure(RobotVM *self, GError **error)
+{
+	Log *log = self->priv->log;
+	const guint8 *domain, *message;
+	guint64 domain_len, code, message_len;
+	gchar *name;
+
+	if (log->pos >= log->len || log->data[log->pos] != LOG_FAILURE)
+		return TRUE;
+
+	log->pos++;
+	if (!get_varint(log, &domain_len) || !(domain = get_bytes(log, domain_len)) || !get_varint(log, &code) ||
+			!get_varint(log, &message_len) || !(message = get_bytes(log, message_len)))
+		return log_mismatch(self, error);
+	if (domain_len) {
+		name = g_strndup((const gchar*)domain, domain_len);
+		g_set_error(error, g_quark_from_string(name), (gint)(guint32)code, "%.*s", (int)message_len, message);
+		g_free(name);
+	}
+
+	return FALSE;
+}
+
+/* Input of IN is recorded as it is read, or it is taken from the log: */
+static gboolean log_fill(RobotVM *self, GError **error)
+{
+	Log *log = self->priv->log;
+	Channel *in = &self->priv->in;
+	guint8 type = LOG_INPUT;
+	GError *err = NULL;
+	const guint8 *p;
+	guint64 len;
+	gssize n = 0;
+
+	if (log->replay) {
+		if (!(p = get_bytes(log, 1)) || *p != LOG_INPUT || !get_varint(log, &len) ||
+				len > sizeof(in->buf) || !(p = get_bytes(log, len)))
+			return log_mismatch(self, error);
+		memcpy(in->buf, p, len);
+		in->len = len;
+
+		return log_get_failure(self, error);
+	}
+
+	if (in->func)
+		n = ((RobotVMReadFunc)in->func)(self, in->buf, sizeof(in->buf), in->userdata, &err);
+	if (n > 0)
+		in->len = MIN((gsize)n, sizeof(in->buf));
+
+	g_byte_array_append(log->rec, &type, 1);
+	put_varint(log->rec, in->len);
+	g_byte_array_append(log->rec, in->buf, in->len);
+	if (n < 0) {
+		log_put_failure(log, err);
+		g_propagate_error(error, err);
+	}
+	log_put_record(log);
+
+	return n >= 0;
+}
+
+/* Memory written by host during recorded call. Adjacent blocks (as words
+ * pushed to stack) are merged: */
+static void log_write(RobotVM *self, RobotVMWord addr, gsize len)
+{
+	GArray *writes = self->priv->log->writes;
+	RobotVMWord block[2] = { addr, len };
+	RobotVMWord *last;
+
+	if (writes->len) {
+		last = &g_array_index(writes, RobotVMWord, writes->len - 2);
+		if (last[0] + last[1] == addr) {
+			last[1] += len;
+			return;
+		}
+		if (addr + len == last[0]) {
+			last[0] = addr;
+			last[1] += len;
+			return;
+		}
+	}
+	g_array_append_vals(writes, block, 2);
+}
+
+/* Record of completed call. Written blocks are taken from memory now, blocks
+ * which are not in memory anymore (function reallocated it) are dropped: */
+static void log_call_done(RobotVM *self, gboolean failed, const GError *failure)
+{
+	Log *log = self->priv->log;
+	GByteArray *rec = log->rec;
+	RobotVMWord *block;
+	guint8 b = LOG_EXT;
+	guint i, n = 0;
+	gsize pos;
+
+	log->open = FALSE;
+	g_byte_array_append(rec, &b, 1);
+	put_varint(rec, log->func);
+
+	for (i = 0; i < G_N_ELEMENTS(log->R); i++)
+		n += self->R[i] != log->R[i];
+	b = n;
+	g_byte_array_append(rec, &b, 1);
+	for (i = 0; i < G_N_ELEMENTS(log->R); i++) {
+		if (self->R[i] != log->R[i]) {
+			b = i;
+			g_byte_array_append(rec, &b, 1);
+			put_word(rec, self->R[i]);
+		}
+	}
+
+	for (i = n = 0; i < log->writes->len; i += 2) {
+		block = &g_array_index(log->writes, RobotVMWord, i);
+		if (check_range(self, block[0], block[1], NULL))
+			memmove(&g_array_index(log->writes, RobotVMWord, 2 * n++), block, 2 * sizeof(RobotVMWord));
+	}
+	put_varint(rec, n);
+	for (i = 0; i < n; i++) {
+		block = &g_array_index(log->writes, RobotVMWord, 2 * i);
+		put_varint(rec, block[0]);
+		put_varint(rec, block[1]);
+		pos = rec->len;
+		g_byte_array_set_size(rec, pos + block[1]);
+		copy_from_memory(self, block[0], rec->data + pos, block[1]);
+	}
+
+	if (failed)
+		log_put_failure(log, failure);
+	log_put_record(log);
+}
+
+static gboolean log_replay_call(RobotVM *self, RobotVMWord func, GError **error)
+{
+	Log *log = self->priv->log;
+	guint64 v, n, i, addr, len;
+	const guint8 *p;
+
+	if (!(p = get_bytes(log, 1)) || *p != LOG_EXT || !get_varint(log, &v) || v != func ||
+			!(p = get_bytes(log, 1)))
+		return log_mismatch(self, error);
+
+	n = *p;
+	for (i = 0; i < n; i++) {
+		if (!(p = get_bytes(log, 5)) || p[0] >= G_N_ELEMENTS(self->R))
+			return log_mismatch(self, error);
+		self->R[p[0]] = get_word(p + 1);
+	}
+
+	if (!get_varint(log, &n))
+		return log_mismatch(self, error);
+	for (i = 0; i < n; i++) {
+		if (!get_varint(log, &addr) || addr > G_MAXUINT32 || !get_varint(log, &len) ||
+				!(p = get_bytes(log, len)))
+			return log_mismatch(self, error);
+		if (!robot_vm_write_memory(self, addr, p, len, error))
+			return FALSE;
+	}
+
+	return log_get_failure(self, error);
+}
+
+/* Call of EXT function with its result recorded, or its result from the log: */
+static gboolean log_call(RobotVM *self, Symbol *sym, GError **error)
+{
+	Log *log = self->priv->log;
+	RobotVMWord func = sym - (Symbol*)self->priv->symtable->data;
+	GError *err = NULL;
+	gboolean res;
+
+	if (log->replay)
+		return log_replay_call(self, func, error);
+
+	memcpy(log->R, self->R, sizeof(log->R));
+	log->func = func;
+	log->open = TRUE;
+	g_array_set_size(log->writes, 0);
+
+	res = sym->func(self, sym->userdata, &err);
+	/* Suspended call is recorded when it is resumed. Function could stop recording too: */
+	if (self->priv->log == log && log->open && (!res || !self->priv->pending))
+		log_call_done(self, !res, err);
+	if (!res)
+		g_propagate_error(error, err);
+
+	return res;
+}
+
+gboolean robot_vm_start_recording(RobotVM *self, const gchar *filename, GError **error)
+{
+	FILE *file = fopen(filename, "wb");
+	Log *log;
+
+	if (!file) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't create log `%s': %s", filename, strerror(errno));
+		return FALSE;
+	}
+
+	log_free(self);
+	log = g_new0(Log, 1);
+	log->file = file;
+	log->rec = g_byte_array_new();
+	log->writes = g_array_new(FALSE, FALSE, sizeof(RobotVMWord));
+	put_word(log->rec, LOG_MAGIC);
+	log_put_record(log);
+	self->priv->log = log;
+
+	return TRUE;
+}
+
+gboolean robot_vm_stop_recording(RobotVM *self, GError **error)
+{
+	Log *log = self->priv->log;
+	gboolean res;
+
+	if (!log || log->replay)
+		return TRUE;
+
+	res = !fflush(log->file) && !ferror(log->file);
+	if (!res)
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't write log `%s'", strerror(errno));
+	log_free(self);
+
+	return res;
+}
+
+gboolean robot_vm_start_replay(RobotVM *self, const gchar *filename, GError **error)
+{
+	GMappedFile *mapped = g_mapped_file_new(filename, FALSE, error);
+	Log *log;
+
+	if (!mapped)
+		return FALSE;
+	if (g_mapped_file_get_length(mapped) < 4 ||
+			get_word((const guint8*)g_mapped_file_get_contents(mapped)) != LOG_MAGIC) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Invalid replay log `%s'", filename);
+		g_mapped_file_unref(mapped);
+		return FALSE;
+	}
+
+	log_free(self);
+	log = g_new0(Log, 1);
+	log->replay = TRUE;
+	log->mapped = mapped;
+	log->data = (const guint8*)g_mapped_file_get_contents(mapped);
+	log->len = g_mapped_file_get_length(mapped);
+	log->pos = 4;
+	self->priv->log = log;
+
+	return TRUE;
+}
+
+void robot_vm_stop_replay(RobotVM *self)
+{
+	if (self->priv->log && self->priv->log->replay)
+		log_free(self);
+}
+
+/* Stack grows down from SS, R1 points to the top. Every value takes whole words. */
+#define STACK_SLOT(len) (((len) + 3) & ~(gsize)3)
+
+gboolean robot_vm_stack_push(RobotVM *self, gconstpointer data, gsize len, GError **error)
+{
+	gsize slot = STACK_SLOT(len);
+
+	if (self->R[1] < slot) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_STACK, "Stack overflow");
+		return FALSE;
+	}
+
+	if (!robot_vm_write_memory(self, self->R[1] - slot, data, len, error))
+		return FALSE;
+	self->R[1] -= slot;
+
+	return TRUE;
+}
+
+gboolean robot_vm_stack_pop(RobotVM *self, gpointer data, gsize len, GError **error)
+{
+	if (!robot_vm_stack_nth(self, 0, data, len, error))
+		return FALSE;
+	self->R[1] += STACK_SLOT(len);
+
+	return TRUE;
+}
+
+gboolean robot_vm_stack_nth(RobotVM *self, guint idx, gpointer data, gsize len, GError **error)
+{
+	guint64 addr = self->R[1] + (guint64)idx * STACK_SLOT(len);
+
+	if (addr + len > self->priv->mem_len) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_STACK, "Stack underflow");
+		return FALSE;
+	}
+
+	return robot_vm_read_memory(self, addr, data, len, error);
+}
+
+gboolean robot_vm_stack_pop_word(RobotVM *self, RobotVMWord *w, GError **error)
+{
+	if (self->R[1] + (guint64)sizeof(RobotVMWord) > self->priv->mem_len) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_STACK, "Stack underflow");
+		return FALSE;
+	}
+
+	*w = mem_get32(self->priv->mem, self->R[1]);
+	self->R[1] += sizeof(RobotVMWord);
+
+	return TRUE;
+}
+
+gboolean robot_vm_stack_push_word(RobotVM *self, RobotVMWord w, GError **error)
+{
+	if (self->R[1] < sizeof(RobotVMWord)) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_STACK, "Stack overflow");
+		return FALSE;
+	}
+
+	if (!robot_vm_write_word(self, self->R[1] - sizeof(RobotVMWord), w, error))
+		return FALSE;
+	self->R[1] -= sizeof(RobotVMWord);
+
+	return TRUE;
+}
+
+/* Standard function %submit. Executes all requests of syscall ring from head
+ * to tail, failed request doesn't stop the others: */
+static gboolean ring_submit(RobotVM *self, gpointer userdata, GError **error)
+{
+	RobotVMWord argv[ROBOT_VM_RING_MAX_ARGS];
+	RobotVMWord ring, size, head, tail;
+	RobotVMWord entry, func, args, argc;
+	RobotVMWord result, sp;
+	GError *err = NULL;
+	Symbol *sym;
+	guint status;
+
+	if (!robot_vm_stack_pop_word(self, &ring, error) ||
+			!robot_vm_read_word(self, ring, &size, error) ||
+			!robot_vm_read_word(self, ring + 4, &head, error) ||
+			!robot_vm_read_word(self, ring + 8, &tail, error))
+		return FALSE;
+
+	if (!size || (size & (size - 1)) || tail - head > size) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid syscall ring at %x", (unsigned)ring);
+		return FALSE;
+	}
+
+	for (; head != tail; head++) {
+		entry = ring + ROBOT_VM_RING_HEADER + (head & (size - 1)) * ROBOT_VM_RING_ENTRY;
+		if (!robot_vm_read_word(self, entry, &func, error) ||
+				!robot_vm_read_word(self, entry + 4, &args, error) ||
+				!robot_vm_read_word(self, entry + 8, &argc, error))
+			return FALSE;
+
+		status = ROBOT_ERROR_NONE;
+		result = 0;
+		sp = self->R[1];
+
+		/* Arguments are pushed as if program pushed them before EXT: */
+		if (func >= self->priv->symtable->len) {
+			status = ROBOT_ERROR_INVALID_ADDRESS;
+		} else if (!(sym = &g_array_index(self->priv->symtable, Symbol, func))->func || sym->func == ring_submit) {
+			status = ROBOT_ERROR_EXECUTION_FAULT;
+		} else if (argc > ROBOT_VM_RING_MAX_ARGS) {
+			status = ROBOT_ERROR_STACK;
+		} else if (!robot_vm_read_memory(self, args, argv, argc * 4, &err) ||
+				!robot_vm_stack_push(self, argv, argc * 4, &err) ||
+				!sym->func(self, sym->userdata, &err)) {
+			/* Function could fail without error: */
+			status = err && err->domain == ROBOT_ERROR && err->code != ROBOT_ERROR_NONE? err->code: ROBOT_ERROR_GENERAL;
+			g_clear_error(&err);
+		} else if (self->priv->pending) {
+			/* Batch can't wait for single call: */
+			self->priv->pending = FALSE;
+			status = ROBOT_ERROR_EXECUTION_FAULT;
+		} else if (self->R[1] < sp) {
+			robot_vm_read_word(self, self->R[1], &result, NULL);
+		}
+		self->R[1] = sp;
+
+		if (!robot_vm_write_word(self, entry + 8, status, error) ||
+				!robot_vm_write_word(self, entry + 12, result, error))
+			return FALSE;
+	}
+
+	return robot_vm_write_word(self, ring + 4, head, error);
+}
+
+/* I/O channels: */
+static void channel_clear(Channel *channel)
+{
+	if (channel->free_userdata)
+		channel->free_userdata(channel->userdata);
+	channel->userdata = NULL;
+	channel->free_userdata = NULL;
+}
+
+static gboolean channel_flush(RobotVM *self, GError **error)
+{
+	Channel *out = &self->priv->out;
+	guint len = out->len;
+
+	out->len = 0;
+	if (!len || !out->func)
+		return TRUE;
+
+	return ((RobotVMWriteFunc)out->func)(self, out->buf, len, out->userdata, error);
+}
+
+/* Output is flushed before input, so prompt is shown before program waits: */
+static gboolean channel_fill(RobotVM *self, GError **error)
+{
+	Channel *in = &self->priv->in;
+	gssize n;
+
+	in->pos = in->len = 0;
+	if (!channel_flush(self, error))
+		return FALSE;
+	if (G_UNLIKELY(self->priv->log))
+		return log_fill(self, error);
+	if (!in->func)
+		return TRUE;
+
+	n = ((RobotVMReadFunc)in->func)(self, in->buf, sizeof(in->buf), in->userdata, error);
+	if (n < 0)
+		return FALSE;
+	in->len = MIN((gsize)n, sizeof(in->buf));
+
+	return TRUE;
+}
+
+/* Standard output and input. Input is read by one byte as host may read stdin too: */
+static gboolean stdio_write(RobotVM *vm, const guint8 *data, gsize len, gpointer userdata, GError **error)
+{
+	if (fwrite(data, 1, len, stdout) != len) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't write output `%s'", strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gssize stdio_read(RobotVM *vm, guint8 *data, gsize len, gpointer userdata, GError **error)
+{
+	int c = getchar();
+
+	if (c == EOF)
+		return 0;
+	data[0] = c;
+
+	return 1;
+}
+
+static gboolean fd_write(RobotVM *vm, const guint8 *data, gsize len, gpointer userdata, GError **error)
+{
+	int fd = GPOINTER_TO_INT(userdata);
+	gssize n;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't write output `%s'", strerror(errno));
+			return FALSE;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+static gssize fd_read(RobotVM *vm, guint8 *data, gsize len, gpointer userdata, GError **error)
+{
+	gssize n;
+
+	do {
+		n = read(GPOINTER_TO_INT(userdata), data, len);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't read input `%s'", strerror(errno));
+
+	return n;
+}
+
+static gboolean buffer_write(RobotVM *vm, const guint8 *data, gsize len, gpointer userdata, GError **error)
+{
+	g_byte_array_append(userdata, data, len);
+
+	return TRUE;
+}
+
+/* Input from copy of data: */
+typedef struct _InputData {
+	gsize len;
+	gsize pos;
+	guint8 data[];
+} InputData;
+
+static gssize data_read(RobotVM *vm, guint8 *data, gsize len, gpointer userdata, GError **error)
+{
+	InputData *in = userdata;
+
+	len = MIN(len, in->len - in->pos);
+	memcpy(data, in->data + in->pos, len);
+	in->pos += len;
+
+	return len;
+}
+
+void robot_vm_set_output_func(RobotVM *self, RobotVMWriteFunc func, gpointer userdata, GDestroyNotify free_userdata)
+{
+	channel_flush(self, NULL);
+	channel_clear(&self->priv->out);
+	self->priv->out.func = func;
+	self->priv->out.userdata = userdata;
+	self->priv->out.free_userdata = free_userdata;
+}
+
+void robot_vm_set_output_fd(RobotVM *self, int fd)
+{
+	robot_vm_set_output_func(self, fd_write, GINT_TO_POINTER(fd), NULL);
+}
+
+void robot_vm_set_output_buffer(RobotVM *self, GByteArray *buffer)
+{
+	robot_vm_set_output_func(self, buffer_write, g_byte_array_ref(buffer), (GDestroyNotify)g_byte_array_unref);
+}
+
+gboolean robot_vm_flush_output(RobotVM *self, GError **error)
+{
+	return channel_flush(self, error);
+}
+
+void robot_vm_set_input_func(RobotVM *self, RobotVMReadFunc func, gpointer userdata, GDestroyNotify free_userdata)
+{
+	channel_clear(&self->priv->in);
+	self->priv->in.func = func;
+	self->priv->in.userdata = userdata;
+	self->priv->in.free_userdata = free_userdata;
+	self->priv->in.pos = self->priv->in.len = 0;
+}
+
+void robot_vm_set_input_fd(RobotVM *self, int fd)
+{
+	robot_vm_set_input_func(self, fd_read, GINT_TO_POINTER(fd), NULL);
+}
+
+void robot_vm_set_input_data(RobotVM *self, gconstpointer data, gsize len)
+{
+	InputData *in = g_malloc(sizeof(InputData) + len);
+
+	in->len = len;
+	in->pos = 0;
+	memcpy(in->data, data, len);
+	robot_vm_set_input_func(self, data_read, in, g_free);
+}
+
+#define GET(r, addr) \
+	do { \
+		if ((addr) + 4 >= self->priv->mem_len) { \
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "out of memory"); \
+			return FALSE; \
+		} \
+		r = mem_get32(self->priv->mem, (addr)); \
+	} while (0)
+
+#define PUT(addr, v) \
+	do { \
+		if ((addr) + 4 >= self->priv->mem_len) { \
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "out of memory"); \
+			return FALSE; \
+		} \
+		mem_put32(self->priv->mem, (addr), (v)); \
+	} while (0)
+
+/* Only syscalls the VM has could be left unresolved: */
+static gboolean check_depend(RobotVM *self, const RobotObjFileSymbol *sym, GError **error)
+{
+	if (sym->name[0] != '%') {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_NAME, "Unresolved: %s", sym->name);
+		return FALSE;
+	}
+
+	if (!robot_vm_has_function(self, sym->name + 1)) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_NAME, "Unresolved syscall: %s", sym->name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Copy text and data segments into memory at SS. Returns size of text with padding: */
+static gsize load_segments(RobotVM *self, const RobotObjFileImage *image)
+{
+	gsize sz = 2;
+	gsize sz2 = 2;
+	gsize s;
+
+	while (sz > 1 && sz < image->text_len)
+		sz <<= 1;
+	while (sz2 > 1 && sz2 < image->data_len)
+		sz2 <<= 1;
+
+	s = sz + sz2 + image->SS + 0x10000;
+	if (self->priv->mem_len < s) {
+		robot_vm_allocate_memory(self, s); 
+	}
+
+	self->R[0] = image->SS;
+	self->R[1] = image->SS;
+
+	copy_to_memory(self, self->R[1], image->text, image->text_len);
+	copy_to_memory(self, self->R[1] + sz, image->data, image->data_len);
+
+	return sz;
+}
+
+/* Relocated words of text are marked in relocated for verify(): */
+static gboolean relocate(RobotVM *self, RobotVMWord r, gsize text_len, gsize sz, guint8 *relocated, GError **error)
+{
+	RobotVMWord w;
+
+	if (r < text_len) {
+		if (!(r & 3))
+			relocated[r >> 2] = 1;
+		r += self->R[1];
+		GET(w, r);
+		w += self->R[1];
+		PUT(r, w);
+	} else {
+		r += self->R[1];
+		r += sz;
+		r -= text_len;
+
+		GET(w, r);
+		w += self->R[1] + sz;
+		PUT(r, w);
+	}
+
+	return TRUE;
+}
+
+static gboolean link_depend(RobotVM *self, const RobotObjFileSymbol *sym, GError **error)
+{
+	PUT(sym->addr + self->R[1], robot_vm_get_function(self, sym->name + 1));
+
+	return TRUE;
+}
+
+/* Check that decoded text can be run by interpreter which doesn't check fetch.
+ * Any word of text could be executed (computed jump could land at immediate or
+ * data), so every word must either keep execution inside of text or leave it
+ * by instruction which is followed by checked fetch (MOVE to R0, EXT, STOP):
+ * - fall through must stay inside of text,
+ * - target of fused jump must be relocated address of word inside of text,
+ *   target of relative branch must be word inside of text,
+ * - no other instruction could compute R0.
+ * Syscall references are checked by robot_vm_load() already and invalid
+ * instructions fault as usual, so they are allowed. */
+static gboolean verify(RobotVM *self, const guint8 *relocated)
+{
+	guint n = self->priv->code_len / 4;
+	RobotVMWord target;
+	Decoded tmp;
+	Decoded *d = &tmp;
+	guint i, next;
+
+	for (i = 0; i < n; i++) {
+		/* Instructions are checked as they are decoded without breakpoints,
+		 * breakpoint only splits superinstruction into checked LOAD and move: */
+		decode_insn(self, self->priv->code_start + i * 4, d, FALSE);
+		next = i + 1;
+
+		switch (d->cmd) {
+			case ROBOT_VM_STOP:
+			case ROBOT_VM_EXT:
+			case ROBOT_VM_RET:
+			case OP_LOAD_MEM:
+			case OP_CALL_MEM:
+			case OP_INVALID:
+				continue;
+
+			case ROBOT_VM_LOAD:
+				/* Relocated immediate inside text is address of code, it is
+				 * jumped to by computed move. Other immediates are constants: */
+				target = d->imm - self->priv->code_start;
+				if (relocated[i + 1] && target < self->priv->code_len && (target & 3))
+					return FALSE;
+				next = i + 2;
+				break;
+
+			case ROBOT_VM_JMP:
+			case ROBOT_VM_JZ:
+			case ROBOT_VM_JNZ:
+				target = d->imm - self->priv->code_start;
+				if (target >= self->priv->code_len || (target & 3))
+					return FALSE;
+				if (d->cmd == ROBOT_VM_JMP)
+					continue;
+				break;
+
+			case ROBOT_VM_CALL:
+			case OP_GOTO:
+			case OP_JUMP:
+			case OP_JUMPIF:
+			case OP_JUMPIFZ:
+				target = d->imm - self->priv->code_start;
+				if (!relocated[i + 1] || target >= self->priv->code_len || (target & 3))
+					return FALSE;
+				if (d->cmd == OP_GOTO)
+					continue;
+				/* Superinstruction could be executed as LOAD and move too,
+				 * return address of CALL is fetched without check: */
+				next = d->cmd == OP_JUMP || d->cmd == ROBOT_VM_CALL? i + 2: i + 3;
+				break;
+
+			case ROBOT_VM_SWAP:
+				if (d->B == 0)
+					return FALSE;
+				if (d->A == 0)
+					return FALSE;
+				break;
+
+			case ROBOT_VM_MOVE:
+				/* Return of hand-written call doesn't fall through: */
+				if (d->A == 0)
+					continue;
+				break;
+
+			case ROBOT_VM_NOP:
+			case ROBOT_VM_W8:
+			case ROBOT_VM_W16:
+			case ROBOT_VM_W32:
+			case ROBOT_VM_MEMCPY:
+			case ROBOT_VM_MEMSET:
+			case ROBOT_VM_OUT:
+			case ROBOT_VM_MOVEIF:
+			case ROBOT_VM_MOVEIFZ:
+				break;
+
+			default:
+				if (d->A == 0)
+					return FALSE;
+				break;
+		}
+
+		if (next >= n)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Decode text segment of loaded program and reset state of previous one.
+ * Relocated words are marked in relocated, NULL if text is not verified: */
+static void load_done(RobotVM *self, RobotVMWord text_start, gsize text_len, const guint8 *relocated)
+{
+	guint i;
+
+#ifdef ROBOT_VM_JIT
+	jit_flush(self);
+#endif
+	g_free(self->priv->code);
+	self->priv->code_start = text_start;
+	self->priv->code_len = text_len & ~3;
+	self->priv->code = g_new(Decoded, self->priv->code_len / 4);
+	self->priv->fused = 0;
+	for (i = 0; i < self->priv->code_len / 4; i++) {
+		decode(self, self->priv->code_start + i * 4, &self->priv->code[i]);
+		if (self->priv->code[i].cmd >= OP_JUMP && self->priv->code[i].cmd <= OP_JUMPIFZ)
+			++self->priv->fused;
+	}
+#ifdef ROBOT_VM_JIT
+	jit_reset(self);
+#endif
+	if (self->priv->profile)
+		profile_reset(self);
+
+	self->priv->verified = self->priv->verify && relocated && verify(self, relocated);
+	g_free(self->priv->relocated);
+	self->priv->relocated = NULL;
+	if (self->priv->verified) {
+		self->priv->relocated = g_malloc(self->priv->code_len / 4 + 1);
+		memcpy(self->priv->relocated, relocated, self->priv->code_len / 4 + 1);
+	}
+	self->priv->ras_depth = 0;
+	self->priv->hook_skip = FALSE;
+	self->priv->break_skip = FALSE;
+	select_run(self);
+
+	/* Call of previous program is not waited for: */
+	self->priv->pending = FALSE;
+	g_clear_error(&self->priv->failure);
+}
+
+gboolean robot_vm_load(RobotVM *self, RobotObjFile *obj, GError **error)
+{
+	RobotObjFileImage image;
+	guint8 *relocated;
+	gsize sz;
+	guint i;
+
+	for (i = 0; i < obj->depends->len; i++) {
+		if (!check_depend(self, &g_array_index(obj->depends, RobotObjFileSymbol, i), error))
+			return FALSE;
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.SS = obj->SS;
+	image.text = obj->text->data;
+	image.text_len = obj->text->len;
+	image.data = obj->data->data;
+	image.data_len = obj->data->len;
+	sz = load_segments(self, &image);
+	relocated = g_new0(guint8, obj->text->len / 4 + 1);
+
+	for (i = 0; i < obj->relocation->len; i++) {
+		if (!relocate(self, g_array_index(obj->relocation, RobotVMWord, i), obj->text->len, sz, relocated, error)) {
+			g_free(relocated);
+			return FALSE;
+		}
 	}
 
 	for (i = 0; i < obj->depends->len; i++) {
-		sym = &g_array_index(obj->depends, RobotObjFileSymbol, i);
+		if (!link_depend(self, &g_array_index(obj->depends, RobotObjFileSymbol, i), error)) {
+			g_free(relocated);
+			return FALSE;
+		}
+	}
+
+	load_done(self, self->R[1], obj->text->len, relocated);
+	g_free(relocated);
+
+	return TRUE;
+}
+
+/* Load program parsed in place. Its segments are copied only once, straight
+ * into memory of VM: */
+gboolean robot_vm_load_image(RobotVM *self, const RobotObjFileImage *image, GError **error)
+{
+	RobotObjFileSymbol sym;
+	guint8 *relocated;
+	gboolean res = FALSE;
+	gsize sz, idx;
+	guint i;
+
+	for (idx = 0; idx < image->depends_len; ) {
+		if (!robot_obj_file_image_symbol(image->depends, image->depends_len, &idx, &sym, error) ||
+				!check_depend(self, &sym, error))
+			return FALSE;
+	}
+
+	sz = load_segments(self, image);
+	relocated = g_new0(guint8, image->text_len / 4 + 1);
+
+	for (i = 0; i < image->n_relocations; i++) {
+		if (!relocate(self, robot_obj_file_image_relocation(image, i), image->text_len, sz, relocated, error))
+			goto leave;
+	}
+
+	for (idx = 0; idx < image->depends_len; ) {
+		if (!robot_obj_file_image_symbol(image->depends, image->depends_len, &idx, &sym, NULL) ||
+				!link_depend(self, &sym, error))
+			goto leave;
+	}
+
+	load_done(self, self->R[1], image->text_len, relocated);
+	res = TRUE;
+
+leave:
+	g_free(relocated);
+	return res;
+}
+
+gboolean robot_vm_load_file(RobotVM *self, const gchar *filename, GError **error)
+{
+	RobotObjFileImage image;
+	GMappedFile *file;
+	gboolean res;
+
+	file = g_mapped_file_new(filename, FALSE, error);
+	if (!file)
+		return FALSE;
+
+	res = robot_obj_file_parse_image(&image, (const guint8*)g_mapped_file_get_contents(file),
+				g_mapped_file_get_length(file), error) &&
+		robot_vm_load_image(self, &image, error);
+
+	g_mapped_file_unref(file);
+	return res;
+}
+
+/* Snapshot of VM. Memory image is kept in memfd (if it is available), so forks
+ * map it privately and kernel copies only pages which are written: */
+struct _RobotVMSnapshot {
+	gint ref_count;
+
+	int fd;
+	guint8 *image;          /* Memory image if memfd is not used */
+	gsize len;
+
+	RobotVMWord R[32];
+	RobotVMWord exit_code;
+	RobotVMMemoryMode memory_mode;
+	RobotVMMemoryBackend backend;
+	RobotVMWord mask;
+	gboolean verified;
+	GArray *symtable;
+
+	Decoded *code;
+	RobotVMWord code_start;
+	RobotVMWord code_len;
+	guint fused;
+};
+
+/* Pages of zeroes are not written to memfd, they stay holes: */
+#define SNAPSHOT_PAGE 4096
+
+#ifdef HAVE_MEMFD_CREATE
+static gboolean snapshot_write(RobotVMSnapshot *snapshot, const guint8 *mem, GError **error)
+{
+	static const guint8 zero[SNAPSHOT_PAGE];
+	gsize off, n;
+	gssize l;
 
-		PUT(sym->addr + self->R[1], robot_vm_get_function(self, sym->name + 1));
+	snapshot->fd = memfd_create("robot-vm-snapshot", MFD_CLOEXEC);
+	if (snapshot->fd < 0 || ftruncate(snapshot->fd, snapshot->len) < 0) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't create snapshot: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	for (off = 0; off < snapshot->len; off += n) {
+		n = MIN(SNAPSHOT_PAGE, snapshot->len - off);
+		if (!memcmp(mem + off, zero, n))
+			continue;
+
+		l = pwrite(snapshot->fd, mem + off, n, off);
+		if (l != (gssize)n) {
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't write snapshot: %s", g_strerror(errno));
+			return FALSE;
+		}
 	}
 
 	return TRUE;
 }
+#endif
+
+RobotVMSnapshot* robot_vm_snapshot(RobotVM *self, GError **error)
+{
+	RobotVMSnapshot *snapshot = g_new0(RobotVMSnapshot, 1);
+#ifdef ROBOT_VM_JIT
+	JitBlock *blk;
+#endif
+	guint i;
+
+	snapshot->ref_count = 1;
+	snapshot->fd = -1;
+	snapshot->len = self->priv->mem_len;
+
+#ifdef HAVE_MEMFD_CREATE
+	if (!snapshot_write(snapshot, self->priv->mem, error)) {
+		robot_vm_snapshot_unref(snapshot);
+		return NULL;
+	}
+#else
+	snapshot->image = g_malloc(snapshot->len);
+	memcpy(snapshot->image, self->priv->mem, snapshot->len);
+#endif
+
+	memcpy(snapshot->R, self->R, sizeof(self->R));
+	snapshot->exit_code = self->priv->exit_code;
+	snapshot->memory_mode = self->priv->memory_mode;
+	snapshot->backend = self->priv->backend;
+	snapshot->verified = self->priv->verified;
+	snapshot->mask = self->priv->mask;
+	snapshot->symtable = g_array_ref(self->priv->symtable);
+	self->priv->symtable_shared = TRUE;
+
+	snapshot->code_start = self->priv->code_start;
+	snapshot->code_len = self->priv->code_len;
+	snapshot->fused = self->priv->fused;
+	if (self->priv->code) {
+		snapshot->code = g_new(Decoded, self->priv->code_len / 4);
+		memcpy(snapshot->code, self->priv->code, sizeof(Decoded) * (self->priv->code_len / 4));
+#ifdef ROBOT_VM_JIT
+		/* Compiled blocks belong to VM: */
+		for (i = 0; i < self->priv->blocks->len; i++) {
+			blk = &g_array_index(self->priv->blocks, JitBlock, i);
+			if (blk->func)
+				snapshot->code[blk->idx] = blk->orig;
+		}
+#endif
+		/* So do breakpoints: */
+		for (i = 0; i < self->priv->breaks->len; i++)
+			break_undecode(self->priv, snapshot->code, g_array_index(self->priv->breaks, RobotVMWord, i));
+	}
+
+	return snapshot;
+}
+
+RobotVMSnapshot* robot_vm_snapshot_ref(RobotVMSnapshot *snapshot)
+{
+	g_atomic_int_inc(&snapshot->ref_count);
+
+	return snapshot;
+}
+
+void robot_vm_snapshot_unref(RobotVMSnapshot *snapshot)
+{
+	if (!g_atomic_int_dec_and_test(&snapshot->ref_count))
+		return;
+
+#ifdef HAVE_MEMFD_CREATE
+	if (snapshot->fd >= 0)
+		close(snapshot->fd);
+#endif
+	g_free(snapshot->image);
+	if (snapshot->symtable)
+		g_array_unref(snapshot->symtable);
+	g_free(snapshot->code);
+	g_free(snapshot);
+}
+
+RobotVM* robot_vm_fork(RobotVMSnapshot *snapshot, GError **error)
+{
+	RobotVM *self = robot_vm_new();
+
+#ifdef HAVE_MEMFD_CREATE
+	if (snapshot->len) {
+		gpointer p = mmap(NULL, snapshot->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, snapshot->fd, 0);
+
+		if (p == MAP_FAILED) {
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't map snapshot: %s", g_strerror(errno));
+			g_object_unref(self);
+			return NULL;
+		}
+		self->priv->mem = p;
+		self->priv->mem_mapped = snapshot->len;
+	}
+#else
+	self->priv->mem = g_malloc(snapshot->len);
+	memcpy(self->priv->mem, snapshot->image, snapshot->len);
+#endif
+	self->priv->mem_len = snapshot->len;
+
+	memcpy(self->R, snapshot->R, sizeof(self->R));
+	self->priv->exit_code = snapshot->exit_code;
+	self->priv->memory_mode = snapshot->memory_mode;
+	self->priv->backend = snapshot->backend;
+	self->priv->verified = snapshot->verified;
+	self->priv->ras_depth = 0;
+	select_run(self);
+	self->priv->mask = snapshot->mask;
+
+	/* Functions are shared with VM the snapshot was taken from: */
+	g_array_unref(self->priv->symtable);
+	self->priv->symtable = g_array_ref(snapshot->symtable);
+	self->priv->symtable_shared = TRUE;
+
+	self->priv->code_start = snapshot->code_start;
+	self->priv->code_len = snapshot->code_len;
+	self->priv->fused = snapshot->fused;
+	if (snapshot->code) {
+		self->priv->code = g_new(Decoded, snapshot->code_len / 4);
+		memcpy(self->priv->code, snapshot->code, sizeof(Decoded) * (snapshot->code_len / 4));
+	}
+#ifdef ROBOT_VM_JIT
+	jit_reset(self);
+#endif
+
+	return self;
+}
+
+/* State file, all words big endian:
+ *   magic, flags, exit code, R0-R31, mask, length of memory (high and low word),
+ *   start and length of text, count of functions, count of chunks,
+ *   names of functions (length and name padded to word),
+ *   relocated words of text (byte per word and one more, padded to word) if it is verified,
+ *   chunks: first page, count of pages, page of file.
+ * Chunks of memory without pages of zeroes follow from the next whole page of
+ * file, so they could be mapped. Pages are kept in program byte order: */
+#define STATE_MAGIC 0x52564d53 /* RVMS */
+#define STATE_HEADER (42 * 4)
+#define STATE_PAGE SNAPSHOT_PAGE
+#define STATE_STOP 1
+#define STATE_MASKED 2
+#define STATE_VERIFIED 4
+
+static void put_bytes(GByteArray *data, const guint8 *p, gsize len)
+{
+	static const guint8 pad[3];
+
+	g_byte_array_append(data, p, len);
+	g_byte_array_append(data, pad, (4 - (len & 3)) & 3);
+}
+
+gboolean robot_vm_save_state(RobotVM *self, const gchar *filename, GError **error)
+{
+	static const guint8 zero[STATE_PAGE];
+	RobotVMPrivate *priv = self->priv;
+	GByteArray *head;
+	GArray *chunks;
+	RobotVMWord *chunk;
+	guint8 page[STATE_PAGE];
+	gsize n_pages = (priv->mem_len + STATE_PAGE - 1) / STATE_PAGE;
+	gsize i, n, data_page;
+	gboolean verified = priv->verified && priv->relocated;
+	gboolean res = TRUE;
+	FILE *file;
+
+	if (priv->pending) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Can't save state of VM waiting for call");
+		return FALSE;
+	}
+
+	/* Runs of pages which are not zeroes, as first page and count: */
+	chunks = g_array_new(FALSE, FALSE, sizeof(RobotVMWord) * 2);
+	for (i = 0; i < n_pages; i++) {
+		n = MIN(STATE_PAGE, priv->mem_len - i * STATE_PAGE);
+		if (!memcmp(priv->mem + i * STATE_PAGE, zero, n))
+			continue;
+
+		chunk = chunks->len? &g_array_index(chunks, RobotVMWord, 2 * (chunks->len - 1)): NULL;
+		if (chunk && chunk[0] + chunk[1] == i) {
+			++chunk[1];
+		} else {
+			g_array_set_size(chunks, chunks->len + 1);
+			chunk = &g_array_index(chunks, RobotVMWord, 2 * (chunks->len - 1));
+			chunk[0] = i;
+			chunk[1] = 1;
+		}
+	}
+
+	head = g_byte_array_new();
+	put_word(head, STATE_MAGIC);
+	put_word(head, (priv->stop? STATE_STOP: 0) |
+			(priv->memory_mode == ROBOT_VM_MEMORY_MASKED? STATE_MASKED: 0) |
+			(verified? STATE_VERIFIED: 0));
+	put_word(head, priv->exit_code);
+	for (i = 0; i < G_N_ELEMENTS(self->R); i++)
+		put_word(head, self->R[i]);
+	put_word(head, priv->mask);
+	put_word(head, (guint64)priv->mem_len >> 32);
+	put_word(head, priv->mem_len & 0xffffffff);
+	put_word(head, priv->code_start);
+	put_word(head, priv->code_len);
+	put_word(head, priv->symtable->len);
+	put_word(head, chunks->len);
+
+	for (i = 0; i < priv->symtable->len; i++) {
+		const gchar *name = g_array_index(priv->symtable, Symbol, i).name;
+
+		put_word(head, strlen(name));
+		put_bytes(head, (const guint8*)name, strlen(name));
+	}
+	if (verified)
+		put_bytes(head, priv->relocated, priv->code_len / 4 + 1);
+
+	data_page = (head->len + 12 * chunks->len + STATE_PAGE - 1) / STATE_PAGE;
+	for (i = 0; i < chunks->len; i++) {
+		chunk = &g_array_index(chunks, RobotVMWord, 2 * i);
+		put_word(head, chunk[0]);
+		put_word(head, chunk[1]);
+		put_word(head, data_page);
+		data_page += chunk[1];
+	}
+	g_byte_array_set_size(head, (head->len + STATE_PAGE - 1) / STATE_PAGE * STATE_PAGE);
+
+	file = fopen(filename, "wb");
+	if (!file) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't create state `%s': %s", filename, strerror(errno));
+		res = FALSE;
+		goto leave;
+	}
+
+	fwrite(head->data, 1, head->len, file);
+	for (i = 0; i < chunks->len; i++) {
+		chunk = &g_array_index(chunks, RobotVMWord, 2 * i);
+		for (n = chunk[0]; n < chunk[0] + chunk[1]; n++) {
+			/* The last page of memory could be partial: */
+			memset(page, 0, sizeof(page));
+			copy_from_memory(self, n * STATE_PAGE, page, MIN(STATE_PAGE, priv->mem_len - n * STATE_PAGE));
+			fwrite(page, 1, sizeof(page), file);
+		}
+	}
+
+	if (fclose(file)) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Can't write state `%s': %s", filename, strerror(errno));
+		res = FALSE;
+	}
+
+leave:
+	g_byte_array_unref(head);
+	g_array_unref(chunks);
+	return res;
+}
+
+/* Memory of restored VM. Where pages of file and of host match, chunks are
+ * mapped copy-on-write, other ones are copied: */
+static void state_memory(RobotVM *self, const gchar *filename, const guint8 *data, const guint8 *chunks,
+		guint n_chunks, gsize mem_len)
+{
+	gsize addr, len, off;
+	guint i;
+#if !MEM_SWIZZLE && (defined(HAVE_MEMFD_CREATE) || defined(HAVE_MAP_NORESERVE))
+	gsize page = sysconf(_SC_PAGESIZE);
+	guint8 *mem;
+	int fd;
+
+	mem_free(self);
+	mem = mem_len? mmap(NULL, mem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0): MAP_FAILED;
+	if (mem != MAP_FAILED) {
+		self->priv->mem = mem;
+		self->priv->mem_mapped = mem_len;
+		self->priv->mem_len = mem_len;
+
+		fd = open(filename, O_RDONLY);
+		for (i = 0; i < n_chunks; i++, chunks += 12) {
+			addr = (gsize)get_word(chunks) * STATE_PAGE;
+			len = (gsize)get_word(chunks + 4) * STATE_PAGE;
+			off = (gsize)get_word(chunks + 8) * STATE_PAGE;
+			if (fd >= 0 && !(addr % page) && !(len % page) && !(off % page) &&
+					mmap(mem + addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off) != MAP_FAILED)
+				continue;
+			memcpy(mem + addr, data + off, MIN(len, mem_len - addr));
+		}
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+#endif
+
+	mem_free(self);
+	self->priv->mem = g_malloc0(mem_len);
+	self->priv->mem_len = mem_len;
+	for (i = 0; i < n_chunks; i++, chunks += 12) {
+		addr = (gsize)get_word(chunks) * STATE_PAGE;
+		len = (gsize)get_word(chunks + 4) * STATE_PAGE;
+		off = (gsize)get_word(chunks + 8) * STATE_PAGE;
+		copy_to_memory(self, addr, data + off, MIN(len, mem_len - addr));
+	}
+}
+
+/* Functions are moved so that they have saved numbers, functions VM doesn't
+ * have are added without function: */
+static void state_bind(RobotVM *self, gchar **names)
+{
+	GArray *symtable;
+	Symbol tmp;
+	gint j;
+	guint i;
+
+	symtable_unshare(self);
+	symtable = self->priv->symtable;
+
+	for (i = 0; names[i]; i++) {
+		j = robot_vm_get_function(self, names[i]);
+		if (j < 0) {
+			j = robot_vm_add_function(self, names[i], NULL, NULL, NULL);
+			symtable = self->priv->symtable;
+		}
+		if ((guint)j != i) {
+			tmp = g_array_index(symtable, Symbol, i);
+			g_array_index(symtable, Symbol, i) = g_array_index(symtable, Symbol, j);
+			g_array_index(symtable, Symbol, j) = tmp;
+		}
+	}
+}
+
+gboolean robot_vm_restore_state(RobotVM *self, const gchar *filename, GError **error)
+{
+	GMappedFile *file;
+	const guint8 *data, *p, *end, *relocated = NULL, *chunks;
+	RobotVMWord flags, mask, code_start, code_len, n_symbols, n_chunks;
+	gchar **names = NULL;
+	guint64 mem_len, addr, len, off;
+	gsize file_len;
+	guint i;
 
+	file = g_mapped_file_new(filename, FALSE, error);
+	if (!file)
+		return FALSE;
+	data = (const guint8*)g_mapped_file_get_contents(file);
+	file_len = g_mapped_file_get_length(file);
+	end = data + file_len;
+
+	/* Whole file is checked before VM is changed: */
+	if (file_len < STATE_HEADER || get_word(data) != STATE_MAGIC)
+		goto invalid;
+	flags = get_word(data + 4);
+	mem_len = ((guint64)get_word(data + 144) << 32) | get_word(data + 148);
+	code_start = get_word(data + 152);
+	code_len = get_word(data + 156);
+	n_symbols = get_word(data + 160);
+	n_chunks = get_word(data + 164);
+	mask = get_word(data + 140);
+	if (mem_len > G_MAXSIZE - STATE_PAGE || (guint64)code_start + code_len > mem_len || (code_len & 3))
+		goto invalid;
+	/* Masked interpreter accesses mask + MEM_GUARD bytes without checks: */
+	if ((flags & STATE_MASKED) && ((((guint64)mask + 1) & mask) || (guint64)mask + 1 + MEM_GUARD > mem_len))
+		goto invalid;
+#if MEM_SWIZZLE
+	if (mem_len & 3)
+		goto invalid;
+#endif
+
+	p = data + STATE_HEADER;
+	names = g_new0(gchar*, MIN(n_symbols, file_len / 4) + 1);
+	for (i = 0; i < n_symbols; i++) {
+		if (end - p < 4)
+			goto invalid;
+		len = get_word(p);
+		if (len >= sizeof(((Symbol*)NULL)->name) || (guint64)(end - p - 4) < ((len + 3) & ~3))
+			goto invalid;
+		names[i] = g_strndup((const gchar*)p + 4, len);
+		p += 4 + ((len + 3) & ~3);
+	}
+	if (flags & STATE_VERIFIED) {
+		if ((guint64)(end - p) < code_len / 4 + 1)
+			goto invalid;
+		relocated = p;
+		p += (code_len / 4 + 1 + 3) & ~3;
+	}
+	if (p > end || (guint64)(end - p) < (guint64)n_chunks * 12)
+		goto invalid;
+	chunks = p;
+	for (i = 0; i < n_chunks; i++, p += 12) {
+		addr = (guint64)get_word(p) * STATE_PAGE;
+		len = (guint64)get_word(p + 4) * STATE_PAGE;
+		off = (guint64)get_word(p + 8) * STATE_PAGE;
+		if (addr >= mem_len || len > mem_len + STATE_PAGE - 1 - addr || off > file_len || len > file_len - off)
+			goto invalid;
+	}
+
+	state_memory(self, filename, data, chunks, n_chunks, mem_len);
+	for (i = 0; i < G_N_ELEMENTS(self->R); i++)
+		self->R[i] = get_word(data + 12 + i * 4);
+	self->priv->exit_code = get_word(data + 8);
+	self->priv->memory_mode = flags & STATE_MASKED? ROBOT_VM_MEMORY_MASKED: ROBOT_VM_MEMORY_STRICT;
+	self->priv->mask = mask;
+	state_bind(self, names);
+	load_done(self, code_start, code_len, relocated);
+	self->priv->stop = (flags & STATE_STOP) != 0;
+
+	g_strfreev(names);
+	g_mapped_file_unref(file);
+	return TRUE;
+
+invalid:
+	g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Invalid state file `%s'", filename);
+	g_strfreev(names);
+	g_mapped_file_unref(file);
+	return FALSE;
+}
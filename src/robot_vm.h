@@ -56,10 +56,44 @@ typedef enum _RobotVMCommand {
 	/* I/O */
 	ROBOT_VM_OUT,    /* Out symbol from stack to console.         */
 	ROBOT_VM_IN,     /* Input symbol from console to stack.       */
+	/* Immediate operands, C is unsigned byte: */
+	ROBOT_VM_ADDI,   /* A = B + C                                 */
+	ROBOT_VM_SUBI,   /* A = B - C                                 */
+	ROBOT_VM_ANDI,   /* A = B & C                                 */
+	/* Relative branches, B:C is signed offset in words from the next
+	 * instruction, so they don't need relocation: */
+	ROBOT_VM_JMP,    /* R0 += offset * 4                          */
+	ROBOT_VM_JZ,     /* R0 += offset * 4 if A == 0                */
+	ROBOT_VM_JNZ,    /* R0 += offset * 4 if A != 0                */
+	/* Calls, R1 is stack pointer: */
+	ROBOT_VM_CALL,   /* R1 -= 4; *R1 = R0 + 8; R0 = *(R0 + 4)     */
+	ROBOT_VM_RET,    /* R0 = *R1; R1 += 4                         */
+	/* Block memory operations, C is length in bytes: */
+	ROBOT_VM_MEMCPY, /* Copy C bytes from B to A, they may overlap */
+	ROBOT_VM_MEMSET, /* Fill C bytes at A with low byte of B      */
+	ROBOT_VM_MEMCMP, /* A = -1, 0 or 1 comparing C bytes at A, B  */
+	ROBOT_VM_STRLEN, /* A = length of zero-ended string at B      */
 
 	ROBOT_VM_COMMAND_COUNT
 } RobotVMCommand;
 
+/* Memory access checks: */
+typedef enum _RobotVMMemoryMode {
+	ROBOT_VM_MEMORY_STRICT, /* Every access is checked, invalid one stops VM with error */
+	ROBOT_VM_MEMORY_MASKED  /* Address space is power of two, addresses are wrapped.
+	                         * Faster, but invalid access silently reads or writes
+	                         * other memory of the same VM. */
+} RobotVMMemoryMode;
+
+/* Allocation of memory: */
+typedef enum _RobotVMMemoryBackend {
+	ROBOT_VM_MEMORY_HEAP,   /* Memory is allocated and zeroed when it grows       */
+	ROBOT_VM_MEMORY_SPARSE  /* Address space is reserved once and grows in place,
+	                         * pages are committed when program touches them.
+	                         * Allocation of big memory is cheap then and resident
+	                         * size follows memory used by program. */
+} RobotVMMemoryBackend;
+
 /* Type conversion macroses: */
 #define ROBOT_TYPE_VM                   (robot_vm_get_type())
 #define ROBOT_VM(obj)                   (G_TYPE_CHECK_INSTANCE_CAST((obj),  ROBOT_TYPE_VM, RobotVM))
@@ -82,7 +116,6 @@ typedef guint32 RobotVMWord;
 struct _RobotVM {
 	GObject parent_instance;
 
-	GByteArray *memory;   /* VM memory.                                         */
 	RobotVMWord R[32];    /* Registers                                          */
 
 	/* Some registers has special meaning:
@@ -112,12 +145,67 @@ typedef struct _RobotVMObj {
 RobotVM* robot_vm_new(void);
 
 void robot_vm_allocate_memory(RobotVM *self, gsize len);
+gsize robot_vm_get_memory_size(RobotVM *self);
+void robot_vm_set_memory_mode(RobotVM *self, RobotVMMemoryMode mode);
+RobotVMMemoryMode robot_vm_get_memory_mode(RobotVM *self);
+/* Move memory to another backend. Fails if sparse memory is not supported: */
+gboolean robot_vm_set_memory_backend(RobotVM *self, RobotVMMemoryBackend backend, GError **error);
+RobotVMMemoryBackend robot_vm_get_memory_backend(RobotVM *self);
 typedef struct _RobotObjFile RobotObjFile;
 gboolean robot_vm_load(RobotVM *self, RobotObjFile *obj, GError **error);
+/* Load executable file mapped into memory without reading it into RobotObjFile,
+ * so segments of program are copied only once: */
+gboolean robot_vm_load_file(RobotVM *self, const gchar *filename, GError **error);
+typedef struct _RobotObjFileImage RobotObjFileImage;
+gboolean robot_vm_load_image(RobotVM *self, const RobotObjFileImage *image, GError **error);
 
 guint robot_vm_add_function(RobotVM *self, const char *name, RobotVMFunc func, gpointer userdata, GDestroyNotify free_userdata);
 gboolean robot_vm_has_function(RobotVM *self, const char *name);
 gint robot_vm_get_function(RobotVM *self, const char *name);
+/* Name of function by number, NULL if there is no such function: */
+const gchar* robot_vm_get_function_name(RobotVM *self, guint idx);
+
+/* Syscall ring. Program fills entries of ring in its memory and executes all
+ * of them by one call of standard function %submit, address of ring is on the
+ * top of stack. Entry calls function added by robot_vm_add_function() as EXT
+ * does: argument words are pushed onto stack, word the function left on stack
+ * is the result. Ring is (all words big endian):
+ *   header  - size (count of entries, power of two), head, tail, reserved.
+ *             Entries are taken from head to tail, indices wrap by size.
+ *             Program moves tail, %submit moves head.
+ *   entries - function number, address of arguments, count of arguments,
+ *             result. Count of arguments is replaced by completion status:
+ *             0 or code of error (RobotErrorCodes) of failed function. */
+#define ROBOT_VM_RING_HEADER 16
+#define ROBOT_VM_RING_ENTRY 16
+#define ROBOT_VM_RING_MAX_ARGS 64
+
+/* I/O of OUT and IN instructions. Bytes are buffered in VM: output is written by
+ * write function when buffer is full, before EXT, before input is read and when
+ * VM returns to host. Input is read by read function when buffer is empty.
+ * By default VM uses stdout and stdin, NULL function discards output or gives
+ * empty input. */
+typedef gboolean (*RobotVMWriteFunc)(RobotVM *vm, const guint8 *data, gsize len, gpointer userdata, GError **error);
+/* Returns count of read bytes (0 at the end of input, IN gets -1 then) or -1 on error: */
+typedef gssize (*RobotVMReadFunc)(RobotVM *vm, guint8 *data, gsize len, gpointer userdata, GError **error);
+
+void robot_vm_set_output_func(RobotVM *self, RobotVMWriteFunc func, gpointer userdata, GDestroyNotify free_userdata);
+void robot_vm_set_output_fd(RobotVM *self, int fd);
+/* Capture output into buffer (it is referenced by VM): */
+void robot_vm_set_output_buffer(RobotVM *self, GByteArray *buffer);
+gboolean robot_vm_flush_output(RobotVM *self, GError **error);
+
+void robot_vm_set_input_func(RobotVM *self, RobotVMReadFunc func, gpointer userdata, GDestroyNotify free_userdata);
+void robot_vm_set_input_fd(RobotVM *self, int fd);
+/* Input from copy of data: */
+void robot_vm_set_input_data(RobotVM *self, gconstpointer data, gsize len);
+
+/* Access to VM memory. Data is copied in program (big endian) byte order
+ * regardless of memory layout used by VM: */
+gboolean robot_vm_read_memory(RobotVM *self, RobotVMWord addr, gpointer data, gsize len, GError **error);
+gboolean robot_vm_write_memory(RobotVM *self, RobotVMWord addr, gconstpointer data, gsize len, GError **error);
+gboolean robot_vm_read_word(RobotVM *self, RobotVMWord addr, RobotVMWord *w, GError **error);
+gboolean robot_vm_write_word(RobotVM *self, RobotVMWord addr, RobotVMWord w, GError **error);
 
 gboolean robot_vm_stack_push(RobotVM *self, gconstpointer data, gsize len, GError **error);
 gboolean robot_vm_stack_pop(RobotVM *self, gpointer data, gsize len, GError **error);
@@ -125,12 +213,161 @@ gboolean robot_vm_stack_nth(RobotVM *self, guint idx, gpointer data, gsize len,
 gboolean robot_vm_stack_pop_word(RobotVM *self, RobotVMWord *w, GError **error);
 gboolean robot_vm_stack_push_word(RobotVM *self, RobotVMWord w, GError **error);
 
-/* Execute program throw the end: */
+/* Execute program throw the end or until call is suspended: */
 gboolean robot_vm_exec(RobotVM *self, GError **error);
 /* Execute one program instruction: */
 gboolean robot_vm_step(RobotVM *self, gboolean *stop, GError **error);
 /* Execute program until some syscall: */
 gboolean robot_vm_next(RobotVM *self, gboolean *stop, GError **error);
+/* Execute at most max_instructions instructions of program. Returns on STOP,
+ * before EXT (unless it is the first instruction) or when budget is spent: */
+gboolean robot_vm_run_for(RobotVM *self, guint64 max_instructions, guint64 *executed, gboolean *stop, GError **error);
+
+/* Suspendable calls. Function of EXT which has to wait (for example until robot
+ * finishes animated move) calls robot_vm_suspend() and returns TRUE. VM returns
+ * to host after EXT and is pending: running it executes nothing until the host
+ * resumes it later, for example from GMainLoop callback. So one thread can drive
+ * many VMs waiting for their calls. Results of call are pushed onto stack by
+ * robot_vm_stack_push_word() before robot_vm_resume() as function would push them.
+ * Functions called by %submit and by RobotVMPool can't suspend. */
+void robot_vm_suspend(RobotVM *self);
+gboolean robot_vm_is_pending(RobotVM *self);
+/* Complete pending call. If failure is not NULL, VM takes it and the next run
+ * fails with it as if function failed: */
+void robot_vm_resume(RobotVM *self, GError *failure);
+/* Complete pending call with one result word: */
+void robot_vm_resume_word(RobotVM *self, RobotVMWord result);
+
+/* Return code of stopped program (value of STOP argument): */
+RobotVMWord robot_vm_get_exit_code(RobotVM *self);
+
+/* Count of load/move-to-R0 jumps executed as single superinstruction: */
+guint robot_vm_get_fused_count(RobotVM *self);
+
+/* Compilation of hot blocks into machine code (RobotVM built with ROBOT_VM_JIT).
+ * It is on by default, results of program are the same with it and without: */
+void robot_vm_set_jit_enabled(RobotVM *self, gboolean enabled);
+/* Count of compiled blocks: */
+guint robot_vm_get_jit_count(RobotVM *self);
+
+/* Verification of text at load. Verified program is run without range check of
+ * every fetch, only computed jumps are checked. Write to text drops program back
+ * to checked interpreter. It is on by default and applies to next load: */
+void robot_vm_set_verify_enabled(RobotVM *self, gboolean enabled);
+/* Whether loaded program passed verification and is still unmodified: */
+gboolean robot_vm_is_verified(RobotVM *self);
+
+/* Execution profile. Counted by separate interpreter variants, so VM without
+ * profiling doesn't pay for it. Superinstructions are counted as instructions
+ * they are made of, hot blocks are not compiled while profile is counted. */
+typedef struct _RobotVMProfile {
+	guint64 opcodes[ROBOT_VM_COMMAND_COUNT]; /* Executed instructions per opcode */
+	RobotVMWord text_start;  /* Address of text */
+	guint text_len;          /* Count of text words */
+	guint64 *pc;             /* Executed instructions per text word */
+	guint64 outside;         /* Executed instructions outside of text */
+	guint n_functions;
+	guint64 *functions;      /* EXT calls per function number */
+} RobotVMProfile;
+
+/* Start counting profile from zero or stop it. Loading of program resets it: */
+void robot_vm_set_profiling(RobotVM *self, gboolean enabled);
+/* Copy of current profile, NULL if it is not counted: */
+RobotVMProfile* robot_vm_get_profile(RobotVM *self);
+void robot_vm_profile_free(RobotVMProfile *profile);
+
+/* Execution trace. Ring buffer of VM keeps the last executed instructions,
+ * VM doesn't compile hot blocks and doesn't fuse instructions while it is traced: */
+typedef struct _RobotVMTraceRecord {
+	RobotVMWord pc;     /* Address of instruction */
+	guint8 op, A, B, C; /* Instruction, jumps decoded by VM are written as LOAD */
+	RobotVMWord value;  /* Value of register A after instruction (before it for EXT
+	                     * and instruction which failed) */
+} RobotVMTraceRecord;
+
+/* Keep trace of the last n_records instructions (rounded up to power of two),
+ * 0 - stop tracing. Trace is cleared if size changes: */
+void robot_vm_set_trace(RobotVM *self, guint n_records);
+/* Records of trace from the oldest one (GArray of RobotVMTraceRecord): */
+GArray* robot_vm_get_trace(RobotVM *self);
+/* Write trace to binary file (decoded by robot_objdump --trace): */
+gboolean robot_vm_dump_trace(RobotVM *self, const gchar *filename, GError **error);
+/* Read trace file. Address of text of traced program is stored to *text_start: */
+GArray* robot_vm_load_trace(const gchar *filename, RobotVMWord *text_start, GError **error);
+
+/* Hooks of debugger or other host tool. Step and write hooks are called by
+ * separate interpreter variant which runs only while one of them is set, VM
+ * without them doesn't check them. Hook returns FALSE with error to fail the run.
+ * It can call robot_vm_suspend() to return to host before the instruction (step,
+ * breakpoint) or after it (write), VM continues after robot_vm_resume() and the
+ * hook is not called again for that instruction. Hooks must not change R0 or
+ * text. Profile and trace are counted as usual, hot blocks are not compiled and
+ * instructions are not fused while step or write hook is set. */
+typedef struct _RobotVMHooks {
+	/* Before instruction at pc: */
+	gboolean (*step)(RobotVM *vm, RobotVMWord pc, gpointer userdata, GError **error);
+	/* After program wrote len bytes at addr: */
+	gboolean (*write)(RobotVM *vm, RobotVMWord addr, RobotVMWord len, gpointer userdata, GError **error);
+	/* At breakpoint at pc, before its instruction (and step hook): */
+	gboolean (*breakpoint)(RobotVM *vm, RobotVMWord pc, gpointer userdata, GError **error);
+} RobotVMHooks;
+
+/* Hooks are copied, NULL (or hooks without functions) removes them: */
+void robot_vm_set_hooks(RobotVM *self, const RobotVMHooks *hooks, gpointer userdata);
+
+/* Breakpoints. Instruction at breakpoint is replaced in decoded text and kept in
+ * memory, so program reads its original text and runs at full speed of interpreter
+ * between breakpoints (hot blocks are not compiled while breakpoints are set).
+ * At breakpoint VM calls breakpoint hook or, if it is not set, suspends itself
+ * before the instruction. Resumed VM executes it without stopping again: */
+void robot_vm_set_breakpoint(RobotVM *self, RobotVMWord addr);
+/* Returns FALSE if there was no breakpoint at addr: */
+gboolean robot_vm_clear_breakpoint(RobotVM *self, RobotVMWord addr);
+
+/* Record and replay of program input. Recording VM writes into binary log every
+ * input read for IN and result of every EXT call: registers changed by function
+ * and memory it wrote with robot_vm_write_memory() and other functions of VM
+ * (direct writes of host into memory are not seen). Replaying VM takes them from
+ * the log without calling read function and functions of EXT, suspended calls
+ * are completed at once, so replay runs at full speed of interpreter. It fails
+ * if program asks for other input than the log has. */
+gboolean robot_vm_start_recording(RobotVM *self, const gchar *filename, GError **error);
+/* Flush and close the log. Call suspended at the moment is not in the log: */
+gboolean robot_vm_stop_recording(RobotVM *self, GError **error);
+gboolean robot_vm_start_replay(RobotVM *self, const gchar *filename, GError **error);
+void robot_vm_stop_replay(RobotVM *self);
+
+/* Sampling profile. Timer signal (SIGPROF) records R0 of VM hz times per second
+ * of process CPU time into buffer of max_samples addresses. It doesn't slow
+ * interpreter down, but only one VM of process can be sampled at a time. Rate
+ * is limited by timer tick of kernel. Inside of compiled blocks R0 is the start
+ * of the block. */
+gboolean robot_vm_start_sampling(RobotVM *self, guint hz, guint max_samples, GError **error);
+/* Stop sampling and return recorded addresses (GArray of RobotVMWord), NULL if VM
+ * is not sampled. Count of samples which didn't fit into buffer is stored to *dropped: */
+GArray* robot_vm_stop_sampling(RobotVM *self, guint *dropped);
+
+/* Snapshot of VM state. VMs forked from snapshot start with its registers and
+ * share its memory copy-on-write, so fork is cheap and memory of forked VM grows
+ * only with pages it writes. */
+typedef struct _RobotVMSnapshot RobotVMSnapshot;
+RobotVMSnapshot* robot_vm_snapshot(RobotVM *self, GError **error);
+RobotVMSnapshot* robot_vm_snapshot_ref(RobotVMSnapshot *snapshot);
+void robot_vm_snapshot_unref(RobotVMSnapshot *snapshot);
+RobotVM* robot_vm_fork(RobotVMSnapshot *snapshot, GError **error);
+
+/* State of VM in file: registers, memory, names of functions and stop flag.
+ * Pages of zeroes are not written and other pages are aligned in the file, so
+ * restored VM maps them copy-on-write where it can. VM waiting for pending call
+ * can't be saved. Text is decoded and verified again by restore. */
+gboolean robot_vm_save_state(RobotVM *self, const gchar *filename, GError **error);
+/* Replace state of VM with saved one. Functions are bound by name: added ones
+ * are reordered to the saved numbers, EXT of saved function which VM doesn't
+ * have fails until it is added: */
+gboolean robot_vm_restore_state(RobotVM *self, const gchar *filename, GError **error);
+
+/* Must be called after host modified VM memory directly (drops decoded instructions): */
+void robot_vm_invalidate(RobotVM *self, RobotVMWord addr, gsize len);
 
 G_END_DECLS
 
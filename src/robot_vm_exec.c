@@ -3,6 +3,35 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+
+/* Prime rate doesn't beat with periodic work of program: */
+#define DEFAULT_SAMPLE_RATE 997
+/* Buffer for ten minutes of CPU time at default rate: */
+#define MAX_SAMPLES (DEFAULT_SAMPLE_RATE * 600)
+
+/* Records in trace ring buffer by default: */
+#define DEFAULT_TRACE_SIZE 65536
+
+/* Trace is dumped between slices of execution when SIGUSR1 is received: */
+static volatile sig_atomic_t dump_requested = 0;
+static void on_dump_request(int sig)
+{
+	dump_requested = 1;
+}
+
+static gboolean dump_trace(RobotVM *vm, const char *name)
+{
+	GError *error = NULL;
+
+	if (!robot_vm_dump_trace(vm, name, &error)) {
+		fprintf(stderr, "Error: can't write trace `%s'\n", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
 
 static char* (*rl_cb)(const char* prompt) = NULL;
 static char *rl(const char *prompt)
@@ -18,33 +47,592 @@ static char *rl(const char *prompt)
 	return fgets(buf, sizeof(buf), stdin);
 }
 
-static unsigned r32(const unsigned char *p)
+/* Debugger of --debug mode. Program runs at full speed between breakpoints,
+ * VM suspends itself at them and at writes into watched memory: */
+typedef struct _Watch {
+	RobotVMWord addr;
+	RobotVMWord len;
+} Watch;
+
+typedef struct _Debugger {
+	RobotVM *vm;
+	RobotObjFile *obj;
+	RobotVMWord SS;     /* Address of text */
+	GArray *breaks;     /* RobotVMWord */
+	GArray *watches;    /* Watch */
+} Debugger;
+
+static gboolean watch_write(RobotVM *vm, RobotVMWord addr, RobotVMWord len, gpointer userdata, GError **error)
 {
-	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	Debugger *dbg = userdata;
+	Watch *w;
+	guint i;
+
+	for (i = 0; i < dbg->watches->len; i++) {
+		w = &g_array_index(dbg->watches, Watch, i);
+		if (addr - w->addr < w->len || w->addr - addr < len) {
+			printf("Watch %08x: %u bytes written at %08x\n", (unsigned)w->addr, (unsigned)len, (unsigned)addr);
+			robot_vm_suspend(vm);
+			break;
+		}
+	}
+
+	return TRUE;
 }
 
-int main(int argc, char *argv[])
+/* Writes are checked by slower interpreter only while something is watched: */
+static void debug_update_hooks(Debugger *dbg)
 {
-	RobotObjFile *obj;
+	RobotVMHooks hooks = { NULL, watch_write, NULL };
+
+	robot_vm_set_hooks(dbg->vm, dbg->watches->len? &hooks: NULL, dbg);
+}
+
+/* Address is number or name of label (with or without '@'): */
+static gboolean debug_parse_addr(Debugger *dbg, const char *s, RobotVMWord *addr)
+{
+	RobotObjFileSymbol *sym;
+	char *end;
+	guint i;
+
+	if (!s)
+		return FALSE;
+
+	*addr = strtoul(s, &end, 0);
+	if (end != s && !*end)
+		return TRUE;
+
+	if (*s == '@')
+		++s;
+	for (i = 0; i < dbg->obj->sym->len; i++) {
+		sym = &g_array_index(dbg->obj->sym, RobotObjFileSymbol, i);
+		if (!strcmp(sym->name, s)) {
+			*addr = dbg->SS + sym->addr;
+			return TRUE;
+		}
+	}
+
+	printf("Invalid address `%s'\n", s);
+	return FALSE;
+}
+
+/* Print instruction at R0 with the nearest label before it: */
+static void debug_where(Debugger *dbg)
+{
+	RobotVMWord pc = dbg->vm->R[0];
+	const RobotObjFileSymbol *label = NULL;
+	RobotObjFileSymbol *sym;
+	unsigned char buf[4];
+	char instr[256];
+	guint i;
+
+	for (i = 0; i < dbg->obj->sym->len; i++) {
+		sym = &g_array_index(dbg->obj->sym, RobotObjFileSymbol, i);
+		if (sym->addr < dbg->obj->text->len && dbg->SS + sym->addr <= pc &&
+				(!label || sym->addr > label->addr))
+			label = sym;
+	}
+
+	if (robot_vm_read_memory(dbg->vm, pc, buf, 4, NULL))
+		robot_instruction_to_string(buf, instr, sizeof(instr));
+	else
+		strcpy(instr, "${OUT OF MEMORY}$");
+
+	if (label)
+		printf("%08x <%s+%u> %s\n", (unsigned)pc, label->name, (unsigned)(pc - dbg->SS - label->addr), instr);
+	else
+		printf("%08x %s\n", (unsigned)pc, instr);
+}
+
+static void debug_regs(Debugger *dbg)
+{
+	RobotVM *vm = dbg->vm;
+	RobotVMWord T, w;
+	int i;
+
+	for (i = 0; i < 32; i++)
+		printf("R%-2d=%08x%s", i, (unsigned)vm->R[i], i % 8 == 7? "\n": " ");
+
+	/* Stack is under text: */
+	printf("$ ");
+	for (i = 0, T = vm->R[1]; i < 8 && T < dbg->SS && robot_vm_read_word(vm, T, &w, NULL); i++, T += 4)
+		printf("%08x ", (unsigned)w);
+	printf("\n");
+}
+
+static void debug_mem(Debugger *dbg, RobotVMWord addr, RobotVMWord len)
+{
+	unsigned char buf[16];
+	RobotVMWord n, i;
+
+	while (len) {
+		n = MIN(len, sizeof(buf));
+		if (!robot_vm_read_memory(dbg->vm, addr, buf, n, NULL)) {
+			printf("%08x: out of memory\n", (unsigned)addr);
+			return;
+		}
+		printf("%08x:", (unsigned)addr);
+		for (i = 0; i < n; i++)
+			printf(" %02x", buf[i]);
+		printf("%*s  ", (int)(sizeof(buf) - n) * 3, "");
+		for (i = 0; i < n; i++)
+			putchar(g_ascii_isprint(buf[i])? buf[i]: '.');
+		printf("\n");
+		addr += n;
+		len -= n;
+	}
+}
+
+static void debug_sym(Debugger *dbg, const char *prefix)
+{
+	RobotObjFileSymbol *sym;
+	guint i;
+
+	for (i = 0; i < dbg->obj->sym->len; i++) {
+		sym = &g_array_index(dbg->obj->sym, RobotObjFileSymbol, i);
+		if (!prefix || g_str_has_prefix(sym->name, prefix))
+			printf("%08x %s\n", (unsigned)(dbg->SS + sym->addr), sym->name);
+	}
+}
+
+/* Index of breakpoint at addr, -1 if there is no one: */
+static gint debug_find_break(Debugger *dbg, RobotVMWord addr)
+{
+	guint i;
+
+	for (i = 0; i < dbg->breaks->len; i++) {
+		if (g_array_index(dbg->breaks, RobotVMWord, i) == addr)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Remove breakpoint or watch at addr: */
+static void debug_delete(Debugger *dbg, RobotVMWord addr)
+{
+	gint idx = debug_find_break(dbg, addr);
+	guint i;
+
+	if (idx >= 0) {
+		robot_vm_clear_breakpoint(dbg->vm, addr);
+		g_array_remove_index(dbg->breaks, idx);
+		return;
+	}
+
+	for (i = 0; i < dbg->watches->len; i++) {
+		if (g_array_index(dbg->watches, Watch, i).addr == addr) {
+			g_array_remove_index(dbg->watches, i);
+			debug_update_hooks(dbg);
+			return;
+		}
+	}
+
+	printf("No breakpoint or watch at %08x\n", (unsigned)addr);
+}
+
+/* Run program until breakpoint, watched write or stop. Count 0 runs it without limit: */
+static gboolean debug_run(Debugger *dbg, guint64 count, gboolean *stop, GError **error)
+{
+	RobotVM *vm = dbg->vm;
+	gboolean res = TRUE;
+
+	if (robot_vm_is_pending(vm))
+		robot_vm_resume(vm, NULL);
+
+	if (!count) {
+		res = robot_vm_exec(vm, error);
+		*stop = res && !robot_vm_is_pending(vm);
+	} else {
+		while (res && count-- && !*stop && !robot_vm_is_pending(vm))
+			res = robot_vm_step(vm, stop, error);
+	}
+	if (!res)
+		return FALSE;
+
+	if (*stop) {
+		printf("Program stopped with exit code %u\n", (unsigned)robot_vm_get_exit_code(vm));
+	} else {
+		/* Watch reports itself, VM waits after the write: */
+		if (robot_vm_is_pending(vm) && debug_find_break(dbg, vm->R[0]) >= 0)
+			printf("Breakpoint\n");
+		debug_where(dbg);
+	}
+
+	return TRUE;
+}
+
+static const char *debug_help =
+	"break [ADDR]      set breakpoint or list them\n"
+	"watch ADDR [LEN]  stop after writes into LEN bytes (4 by default) at ADDR\n"
+	"delete ADDR       remove breakpoint or watch\n"
+	"continue          run until breakpoint, watched write or stop\n"
+	"step [N]          execute N instructions\n"
+	"regs              print registers and top of stack\n"
+	"mem ADDR [LEN]    dump LEN bytes (64 by default) of memory\n"
+	"sym [PREFIX]      print addresses of labels\n"
+	"quit              stop program\n"
+	"ADDR is number or label.\n";
+
+/* Command loop of debugger. Returns FALSE on execution fault: */
+static gboolean debug_run_commands(RobotVM *vm, RobotObjFile *obj, GError **error)
+{
+	Debugger dbg = { vm, obj, vm->R[1], NULL, NULL };
+	gboolean stop = FALSE;
+	gboolean res = TRUE;
+	RobotVMWord addr, len;
+	gchar **argv;
+	const char *cmd;
+	char *line;
+	guint i;
+
+	dbg.breaks = g_array_new(FALSE, FALSE, sizeof(RobotVMWord));
+	dbg.watches = g_array_new(FALSE, FALSE, sizeof(Watch));
+	debug_where(&dbg);
+
+	while (res && (line = rl("> "))) {
+		argv = g_strsplit_set(g_strstrip(line), " \t", 3);
+		cmd = argv[0];
+
+		if (!*cmd) {
+			/* Empty line */
+		} else if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit")) {
+			if (!stop)
+				fprintf(stderr, "Stopped by user.\n");
+			g_strfreev(argv);
+			break;
+		} else if (!strcmp(cmd, "help")) {
+			printf("%s", debug_help);
+		} else if (!strcmp(cmd, "break")) {
+			if (!argv[1]) {
+				for (i = 0; i < dbg.breaks->len; i++)
+					printf("Breakpoint %08x\n", (unsigned)g_array_index(dbg.breaks, RobotVMWord, i));
+				for (i = 0; i < dbg.watches->len; i++)
+					printf("Watch %08x %u\n", (unsigned)g_array_index(dbg.watches, Watch, i).addr,
+							(unsigned)g_array_index(dbg.watches, Watch, i).len);
+			} else if (debug_parse_addr(&dbg, argv[1], &addr) && debug_find_break(&dbg, addr) < 0) {
+				robot_vm_set_breakpoint(vm, addr);
+				g_array_append_val(dbg.breaks, addr);
+			}
+		} else if (!strcmp(cmd, "watch")) {
+			Watch w = { 0, 4 };
+
+			if (debug_parse_addr(&dbg, argv[1], &w.addr) && (!argv[2] || debug_parse_addr(&dbg, argv[2], &w.len))) {
+				g_array_append_val(dbg.watches, w);
+				debug_update_hooks(&dbg);
+			}
+		} else if (!strcmp(cmd, "delete")) {
+			if (debug_parse_addr(&dbg, argv[1], &addr))
+				debug_delete(&dbg, addr);
+		} else if (!strcmp(cmd, "regs")) {
+			debug_regs(&dbg);
+		} else if (!strcmp(cmd, "mem")) {
+			len = 64;
+			if (debug_parse_addr(&dbg, argv[1], &addr) && (!argv[2] || debug_parse_addr(&dbg, argv[2], &len)))
+				debug_mem(&dbg, addr, len);
+		} else if (!strcmp(cmd, "sym")) {
+			debug_sym(&dbg, argv[1]);
+		} else if (stop && (!strcmp(cmd, "continue") || !strcmp(cmd, "step"))) {
+			printf("Program is stopped\n");
+		} else if (!strcmp(cmd, "continue")) {
+			res = debug_run(&dbg, 0, &stop, error);
+		} else if (!strcmp(cmd, "step")) {
+			len = 1;
+			if (!argv[1] || debug_parse_addr(&dbg, argv[1], &len))
+				res = debug_run(&dbg, len? len: 1, &stop, error);
+		} else {
+			printf("Unknown command `%s', try help\n", cmd);
+		}
+
+		g_strfreev(argv);
+	}
+
+	g_array_unref(dbg.breaks);
+	g_array_unref(dbg.watches);
+
+	return res;
+}
+
+/* Map executable and load it into new VM. Object file of program is read only
+ * if its symbols are needed (stored to *objp), otherwise VM loads file in place: */
+static RobotVM* load_vm(const char *name, gint mem, gboolean masked, gboolean sparse, gboolean nojit, gboolean noverify, gboolean profile, RobotObjFile **objp)
+{
+	RobotObjFileImage image;
+	RobotObjFile *obj = NULL;
 	RobotVM *vm;
 	GError *error = NULL;
-	GByteArray *data;
-	FILE *f = NULL;
-	unsigned char buf[256];
+	GMappedFile *file;
+	const guint8 *data;
+	gsize len;
+
+	file = g_mapped_file_new(name, FALSE, &error);
+	if (!file) {
+		fprintf(stderr, "Error: can't open file `%s'\n", error->message);
+		return NULL;
+	}
+	data = (const guint8*)g_mapped_file_get_contents(file);
+	len = g_mapped_file_get_length(file);
+
+	if (!robot_obj_file_parse_image(&image, data, len, &error) ||
+			(objp && !robot_obj_file_from_data(obj = robot_obj_file_new(), data, len, &error))) {
+		fprintf(stderr, "Error: can't parse file `%s'\n", error->message);
+		g_error_free(error);
+		if (obj)
+			g_object_unref(obj);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	if (mem <= (int)(image.text_len + image.data_len + image.SS + 0x1000)) {
+		fprintf(stderr, "WARNING: memory size is too small!\n");
+		mem = image.text_len + image.data_len + image.SS + 0x1000;
+		fprintf(stderr, "I will use mem = %d\n", mem);
+	}
+
+	vm = robot_vm_new();
+	if (masked)
+		robot_vm_set_memory_mode(vm, ROBOT_VM_MEMORY_MASKED);
+	if (sparse && !robot_vm_set_memory_backend(vm, ROBOT_VM_MEMORY_SPARSE, &error)) {
+		fprintf(stderr, "WARNING: %s\n", error->message);
+		g_clear_error(&error);
+	}
+	if (nojit)
+		robot_vm_set_jit_enabled(vm, FALSE);
+	if (noverify)
+		robot_vm_set_verify_enabled(vm, FALSE);
+	if (profile)
+		robot_vm_set_profiling(vm, TRUE);
+	robot_vm_allocate_memory(vm, mem);
+
+	if (!robot_vm_load_image(vm, &image, &error)) {
+		fprintf(stderr, "Error: can't load file into VM `%s'\n", error->message);
+		g_error_free(error);
+		g_object_unref(vm);
+		if (obj)
+			g_object_unref(obj);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+	g_mapped_file_unref(file);
+
+	if (objp)
+		*objp = obj;
+
+	return vm;
+}
+
+static gint symbol_cmp(gconstpointer a, gconstpointer b)
+{
+	const RobotObjFileSymbol *sa = *(RobotObjFileSymbol* const*)a;
+	const RobotObjFileSymbol *sb = *(RobotObjFileSymbol* const*)b;
+
+	return sa->addr < sb->addr? -1: sa->addr > sb->addr;
+}
+
+/* Write counts of text words as lines "label;address instruction count"
+ * (folded stacks of flamegraph.pl). Summary lines written after them start
+ * with '#' and must be filtered out for flamegraph.pl: */
+static void write_counts(FILE *f, RobotObjFile *obj, const guint64 *counts, guint len)
+{
+	GPtrArray *labels = g_ptr_array_new();
+	const char *label = "<text>";
+	RobotObjFileSymbol *sym;
+	gboolean load = FALSE;
 	char instr[256];
-	int l;
-	int i, j;
+	guint i, l;
+
+	for (i = 0; i < obj->sym->len; i++) {
+		sym = &g_array_index(obj->sym, RobotObjFileSymbol, i);
+		if (sym->addr < obj->text->len)
+			g_ptr_array_add(labels, sym);
+	}
+	g_ptr_array_sort(labels, symbol_cmp);
+
+	for (i = 0, l = 0; i < len; i++) {
+		while (l < labels->len && ((RobotObjFileSymbol*)g_ptr_array_index(labels, l))->addr <= i * 4)
+			label = ((RobotObjFileSymbol*)g_ptr_array_index(labels, l++))->name;
+
+		if (load) {
+			load = FALSE;
+			continue;
+		}
+		load = (obj->text->data[i * 4] == ROBOT_VM_LOAD || obj->text->data[i * 4] == ROBOT_VM_CALL);
+
+		if (counts[i])
+			fprintf(f, "%s;%08x %s %" G_GUINT64_FORMAT "\n", label, i * 4,
+					robot_instruction_to_string(obj->text->data + i * 4, instr, sizeof(instr)), counts[i]);
+	}
+
+	g_ptr_array_unref(labels);
+}
+
+/* Write profile of VM counted by interpreter: */
+static gboolean write_profile(RobotVM *vm, RobotObjFile *obj, const char *name)
+{
+	RobotVMProfile *prof = robot_vm_get_profile(vm);
+	const char *fname;
+	guint64 total = 0;
+	guint8 op;
+	guint i;
+	FILE *f;
+
+	f = fopen(name, "w");
+	if (!f) {
+		fprintf(stderr, "Error: can't open file `%s'\n", strerror(errno));
+		return FALSE;
+	}
+
+	write_counts(f, obj, prof->pc, prof->text_len);
+	for (op = 0; op < ROBOT_VM_COMMAND_COUNT; op++)
+		total += prof->opcodes[op];
+	fprintf(f, "# Instructions: %" G_GUINT64_FORMAT "\n", total);
+	for (op = 0; op < ROBOT_VM_COMMAND_COUNT; op++) {
+		if (prof->opcodes[op])
+			fprintf(f, "# %s: %" G_GUINT64_FORMAT "\n", robot_instruction_to_string(&op, NULL, 0), prof->opcodes[op]);
+	}
+	for (i = 0; i < prof->n_functions; i++) {
+		fname = robot_vm_get_function_name(vm, i);
+		if (prof->functions[i])
+			fprintf(f, "# ext %s: %" G_GUINT64_FORMAT "\n", fname? fname: "?", prof->functions[i]);
+	}
+	if (prof->outside)
+		fprintf(f, "# Outside of text: %" G_GUINT64_FORMAT "\n", prof->outside);
+
+	fclose(f);
+	robot_vm_profile_free(prof);
+
+	return TRUE;
+}
+
+/* Write samples of R0 resolved against text of program loaded at start: */
+static gboolean write_samples(GArray *samples, guint dropped, RobotObjFile *obj, RobotVMWord start, const char *name)
+{
+	guint len = obj->text->len / 4;
+	guint64 *counts = g_new0(guint64, len);
+	guint64 outside = 0;
+	RobotVMWord off;
+	guint i;
+	FILE *f;
+
+	f = fopen(name, "w");
+	if (!f) {
+		fprintf(stderr, "Error: can't open file `%s'\n", strerror(errno));
+		g_free(counts);
+		return FALSE;
+	}
+
+	for (i = 0; i < samples->len; i++) {
+		off = g_array_index(samples, RobotVMWord, i) - start;
+		if (off / 4 < len)
+			++counts[off / 4];
+		else
+			++outside;
+	}
+
+	write_counts(f, obj, counts, len);
+	fprintf(f, "# Samples: %u\n", samples->len);
+	if (outside)
+		fprintf(f, "# Outside of text: %" G_GUINT64_FORMAT "\n", outside);
+	if (dropped)
+		fprintf(f, "# Dropped: %u\n", dropped);
+
+	fclose(f);
+	g_free(counts);
+
+	return TRUE;
+}
+
+/* Run all programs in pool and print results: */
+static int run_pool(int n, char *files[], gint jobs, gint mem, gboolean masked, gboolean sparse, gboolean nojit, gboolean noverify)
+{
+	RobotVMPool *pool;
+	RobotVM *vm;
+	GError *error = NULL;
+	RobotVMWord code;
+	guint64 executed;
+	int res = 0;
+	int i;
+
+	pool = robot_vm_pool_new(jobs);
+	for (i = 0; i < n; i++) {
+		vm = load_vm(files[i], mem, masked, sparse, nojit, noverify, FALSE, NULL);
+		if (!vm)
+			return EXIT_FAILURE;
+
+		robot_vm_pool_add(pool, vm);
+		g_object_unref(vm);
+	}
+
+	if (!robot_vm_pool_run(pool, &error)) {
+		fprintf(stderr, "Error: can't run VM pool `%s'\n", error->message);
+		return EXIT_FAILURE;
+	}
+	fflush(stdout);
+
+	for (i = 0; i < n; i++) {
+		if (robot_vm_pool_get_result(pool, i, &code, &executed, &error)) {
+			printf("%s: exit code %u, %" G_GUINT64_FORMAT " instructions\n", files[i], (unsigned)code, executed);
+		} else {
+			printf("%s: execution fault `%s', %" G_GUINT64_FORMAT " instructions\n", files[i], error->message, executed);
+			g_clear_error(&error);
+			res = EXIT_FAILURE;
+		}
+	}
+
+	g_object_unref(pool);
+
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotVM *vm;
+	RobotObjFile *obj = NULL;
+	GError *error = NULL;
+	RobotVMWord SS;
 
 	GOptionContext *optctx;
-	gboolean stop = FALSE;
 	gboolean debug = FALSE;
 	gint mem = 0x10000;
 	gboolean readline = FALSE;
+	gboolean stats = FALSE;
+	gboolean masked = FALSE;
+	gboolean sparse = FALSE;
+	gboolean nojit = FALSE;
+	gboolean noverify = FALSE;
+	gchar *profile = NULL;
+	gchar *sample = NULL;
+	gchar *trace = NULL;
+	gchar *record = NULL;
+	gchar *replay = NULL;
+	gchar *save_state = NULL;
+	gchar *restore_state = NULL;
+	gint trace_size = DEFAULT_TRACE_SIZE;
+	gint rate = DEFAULT_SAMPLE_RATE;
+	GArray *samples;
+	guint dropped;
+	gint jobs = -1;
+	int res = 0;
 
 	GOptionEntry options[] = {
 		{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug, "enable debug mode", "yes" },
 		{ "readline", 'l', 0, G_OPTION_ARG_NONE, &readline, "try to use readline", "yes" },
 		{ "memory", 'm', 0, G_OPTION_ARG_INT, &mem, "memory size in kilobytes", "M" },
+		{ "stats", 's', 0, G_OPTION_ARG_NONE, &stats, "print VM statistics", "yes" },
+		{ "masked", 'M', 0, G_OPTION_ARG_NONE, &masked, "wrap memory addresses instead of checking them", "yes" },
+		{ "sparse", 0, 0, G_OPTION_ARG_NONE, &sparse, "reserve memory and commit pages on first touch", "yes" },
+		{ "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "run all files in N threads (0 - one per processor)", "N" },
+		{ "no-jit", 0, 0, G_OPTION_ARG_NONE, &nojit, "don't compile hot blocks to machine code", "yes" },
+		{ "no-verify", 0, 0, G_OPTION_ARG_NONE, &noverify, "check every fetch instead of verifying text at load", "yes" },
+		{ "profile", 'p', 0, G_OPTION_ARG_FILENAME, &profile, "write execution profile to FILE", "FILE" },
+		{ "sample", 0, 0, G_OPTION_ARG_FILENAME, &sample, "write sampling profile to FILE", "FILE" },
+		{ "sample-rate", 0, 0, G_OPTION_ARG_INT, &rate, "samples per second of CPU time", "HZ" },
+		{ "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace, "write trace of the last instructions to FILE on exit, fault or SIGUSR1", "FILE" },
+		{ "trace-size", 0, 0, G_OPTION_ARG_INT, &trace_size, "count of instructions in trace", "N" },
+		{ "record", 0, 0, G_OPTION_ARG_FILENAME, &record, "record input and results of functions to FILE", "FILE" },
+		{ "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay, "take input and results of functions from FILE", "FILE" },
+		{ "save-state", 0, 0, G_OPTION_ARG_FILENAME, &save_state, "write state of VM to FILE when program stops", "FILE" },
+		{ "restore-state", 0, 0, G_OPTION_ARG_FILENAME, &restore_state, "start loaded program from state in FILE", "FILE" },
 
 		{ NULL }
 	};
@@ -67,98 +655,112 @@ int main(int argc, char *argv[])
 	/* Check parameters: */
 	if (mem < 0)
 		mem = -mem;
-
-	f = fopen(argv[1], "rb");
-	if (!f) {
-		fprintf(stderr, "Error: can't open file `%s'\n", strerror(errno));
+	if (record && replay) {
+		fprintf(stderr, "Error: program can't be recorded and replayed at once!\n");
 		return EXIT_FAILURE;
 	}
 
-	data = g_byte_array_new();
-	for (;;) {
-		l = fread(buf, 1, sizeof(buf), f);
-		if (l < 0) {
-			fprintf(stderr, "Error: can't read from file `%s'\n", strerror(errno));
+	if (!debug && (argc > 2 || jobs >= 0)) {
+		if (profile || sample || trace) {
+			fprintf(stderr, "Error: profile can't be written for several programs!\n");
 			return EXIT_FAILURE;
 		}
-
-		if (l == 0)
-			break;
-
-		g_byte_array_append(data, buf, l);
+		if (record || replay || save_state || restore_state) {
+			fprintf(stderr, "Error: several programs can't be recorded, replayed or saved!\n");
+			return EXIT_FAILURE;
+		}
+		return run_pool(argc - 1, argv + 1, jobs > 0? jobs: 0, mem, masked, sparse, nojit, noverify);
 	}
-	fclose(f);
 
-	obj = robot_obj_file_new();
-	if (!robot_obj_file_from_byte_array(obj, data, &error)) {
-		fprintf(stderr, "Error: can't parse file `%s'\n", error->message);
+	vm = load_vm(argv[1], mem, masked, sparse, nojit, noverify, profile != NULL, profile || sample || debug? &obj: NULL);
+	if (!vm)
+		return EXIT_FAILURE;
+	/* Stack is under text, which is loaded at SS: */
+	SS = vm->R[1];
+
+	if (restore_state && !robot_vm_restore_state(vm, restore_state, &error)) {
+		fprintf(stderr, "Error: can't restore state `%s'\n", error->message);
 		return EXIT_FAILURE;
 	}
-	g_byte_array_unref(data);
 
-	if (mem <= (int)(obj->text->len + obj->data->len + obj->SS + 0x1000)) {
-		fprintf(stderr, "WARNING: memory size is too small!\n");
-		mem = obj->text->len + obj->data->len + obj->SS + 0x1000;
-		fprintf(stderr, "I will use mem = %d\n", mem);
+	if (trace) {
+		robot_vm_set_trace(vm, trace_size > 0? trace_size: DEFAULT_TRACE_SIZE);
+#ifdef SIGUSR1
+		signal(SIGUSR1, on_dump_request);
+#endif
 	}
 
-	vm = robot_vm_new();
-	robot_vm_allocate_memory(vm, mem);
+	if (sample && !robot_vm_start_sampling(vm, rate, MAX_SAMPLES, &error)) {
+		fprintf(stderr, "Error: can't start sampling `%s'\n", error->message);
+		return EXIT_FAILURE;
+	}
 
-	if (!robot_vm_load(vm, obj, &error)) {
-		fprintf(stderr, "Error: can't load file into VM `%s'\n", error->message);
+	if ((record && !robot_vm_start_recording(vm, record, &error)) ||
+			(replay && !robot_vm_start_replay(vm, replay, &error))) {
+		fprintf(stderr, "Error: %s\n", error->message);
 		return EXIT_FAILURE;
 	}
-	g_object_unref(obj);
+
+	if (stats) {
+		fprintf(stderr, "Fused jumps: %u\n", robot_vm_get_fused_count(vm));
+		fprintf(stderr, "Verified: %s\n", robot_vm_is_verified(vm)? "yes": "no");
+	}
 
 	if (debug) {
-		char *cmd;
+		if (!debug_run_commands(vm, obj, &error)) {
+			fprintf(stderr, "Error: execution fault `%s'\n", error->message);
+			res = EXIT_FAILURE;
+		}
+	} else {
+		guint64 executed = 0;
+		guint64 total = 0;
+		gboolean stop = FALSE;
 
 		while (!stop) {
-			if (!robot_vm_step(vm, &stop, &error)) {
+			if (!robot_vm_run_for(vm, 1 << 20, &executed, &stop, &error)) {
 				fprintf(stderr, "Error: execution fault `%s'\n", error->message);
-				return EXIT_FAILURE;
-			}
-			if (vm->R[0] + 4 < vm->memory->len) {
-				robot_instruction_to_string(vm->memory->data + vm->R[0], instr, sizeof(instr));
-			} else {
-				strcpy(instr, "${OUT OF MEMORY}$");
+				res = EXIT_FAILURE;
+				break;
 			}
+			total += executed;
 
-			for (j = 0; j < 31; j++) {
-				printf("R%d=[%08x] ", j, vm->R[j]);
-				if (j && j % 8 == 0)
-					printf("\n");
-			}
-			printf("\n# %s\n", instr);
-			if (vm->R[1] + 32 < vm->memory->len) {
-				RobotVMWord T = vm->R[1];
-				printf("$ ");
-				i = 0;
-
-				while (i < 8 && T < obj->SS) {
-					printf("%08x ", r32(vm->memory->data + T));
-					++i;
-					T += 4;
-				}
-				printf("\n");
-			}
-			cmd = rl("> ");
-			/* TODO: parse command, show something... */
-			if (!strcmp(cmd, "quit\n") || !strcmp(cmd, "exit\n")) {
-				fprintf(stderr, "Stopped by user.\n");
-				stop = TRUE;
+			if (dump_requested) {
+				dump_requested = 0;
+				dump_trace(vm, trace);
 			}
 		}
-	} else {
-		if (!robot_vm_exec(vm, &error)) {
-			fprintf(stderr, "Error: execution fault `%s'\n", error->message);
-			return EXIT_FAILURE;
+
+		if (save_state && !res && !robot_vm_save_state(vm, save_state, &error)) {
+			fprintf(stderr, "Error: can't save state `%s'\n", error->message);
+			res = EXIT_FAILURE;
+		}
+
+		if (stats && !res) {
+			fprintf(stderr, "Instructions: %" G_GUINT64_FORMAT "\n", total);
+			fprintf(stderr, "Compiled blocks: %u\n", robot_vm_get_jit_count(vm));
 		}
 	}
 
+	/* Profile is written after fault too: */
+	if (profile && !write_profile(vm, obj, profile))
+		res = EXIT_FAILURE;
+	if (trace && !dump_trace(vm, trace))
+		res = EXIT_FAILURE;
+	if (sample) {
+		samples = robot_vm_stop_sampling(vm, &dropped);
+		if (!write_samples(samples, dropped, obj, SS, sample))
+			res = EXIT_FAILURE;
+		g_array_unref(samples);
+	}
+	if (record && !robot_vm_stop_recording(vm, &error)) {
+		fprintf(stderr, "Error: %s\n", error->message);
+		res = EXIT_FAILURE;
+	}
+
+	if (obj)
+		g_object_unref(obj);
 	g_object_unref(vm);
 
-	return 0;
+	return res;
 }
 
@@ -0,0 +1,551 @@
+#include "robot.h"
+#include "robot_vm_jit.h"
+#include <string.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+/* Template compiler of hot blocks for x86-64. Every instruction is translated
+ * into fixed sequence of machine code working with registers of VM in memory:
+ *
+ * rdi - R, rsi - memory, r8 - limit of addresses, eax and ecx - scratch.
+ *
+ * Block ends before instruction it can't compile (EXT, I/O, DIV, STOP) or one
+ * writing R0 and after jump or relative branch. Access out of limit leaves block before the
+ * instruction, so interpreter executes it and reports error. Write into text
+ * calls back VM to invalidate decoded instructions and compiled blocks. */
+
+#define JIT_BUFFER_SIZE (1 << 20)
+/* Instructions in one block: */
+#define JIT_MAX_BLOCK 64
+/* Machine code of one instruction is not longer: */
+#define JIT_MAX_INSN 128
+#define JIT_MAX_CODE ((JIT_MAX_BLOCK + 1) * JIT_MAX_INSN)
+
+/* Words of memory in host order are swizzled, leave them to interpreter: */
+#if defined(ROBOT_VM_HOST_ORDER) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+# define JIT_MEMORY 0
+#else
+# define JIT_MEMORY 1
+#endif
+
+struct _RobotVMJit {
+	guint8 *buf;
+	gsize used;
+	RobotVMJitInvalidateFunc invalidate;
+};
+
+typedef struct _Emitter {
+	guint8 *p;
+	RobotVM *vm;
+	RobotVMJitInvalidateFunc invalidate;
+	RobotVMWord code_start;
+	RobotVMWord code_end;
+	RobotVMWord end;        /* End of compiled instructions */
+} Emitter;
+
+/* Offset of register in R: */
+#define RD(r) ((r) * 4)
+
+/* Condition codes of short jumps: */
+#define JB  0x72
+#define JAE 0x73
+#define JZ  0x74
+#define JNZ 0x75
+
+/* Size of leave(): */
+#define LEAVE_SIZE 13
+
+RobotVMJit* robot_vm_jit_new(RobotVMJitInvalidateFunc invalidate)
+{
+	RobotVMJit *self;
+	gpointer p;
+
+	p = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	self = g_new0(RobotVMJit, 1);
+	self->buf = p;
+	self->used = 0;
+	self->invalidate = invalidate;
+
+	return self;
+}
+
+void robot_vm_jit_free(RobotVMJit *self)
+{
+	munmap(self->buf, JIT_BUFFER_SIZE);
+	g_free(self);
+}
+
+void robot_vm_jit_flush(RobotVMJit *self)
+{
+	self->used = 0;
+}
+
+gboolean robot_vm_jit_full(RobotVMJit *self)
+{
+	return self->used + JIT_MAX_CODE > JIT_BUFFER_SIZE;
+}
+
+static void put(Emitter *e, guint n, ...)
+{
+	va_list ap;
+
+	va_start(ap, n);
+	while (n--)
+		*e->p++ = va_arg(ap, int);
+	va_end(ap);
+}
+
+static void put32(Emitter *e, guint32 v)
+{
+	memcpy(e->p, &v, sizeof(v));
+	e->p += sizeof(v);
+}
+
+static void put64(Emitter *e, guint64 v)
+{
+	memcpy(e->p, &v, sizeof(v));
+	e->p += sizeof(v);
+}
+
+static void load_eax(Emitter *e, guint8 r)   /* mov eax, R[r] */
+{
+	put(e, 3, 0x8b, 0x47, RD(r));
+}
+
+static void load_ecx(Emitter *e, guint8 r)   /* mov ecx, R[r] */
+{
+	put(e, 3, 0x8b, 0x4f, RD(r));
+}
+
+static void store_eax(Emitter *e, guint8 r)  /* mov R[r], eax */
+{
+	put(e, 3, 0x89, 0x47, RD(r));
+}
+
+static void store_ecx(Emitter *e, guint8 r)  /* mov R[r], ecx */
+{
+	put(e, 3, 0x89, 0x4f, RD(r));
+}
+
+static void store_imm(Emitter *e, guint8 r, RobotVMWord v)  /* mov R[r], v */
+{
+	put(e, 3, 0xc7, 0x47, RD(r));
+	put32(e, v);
+}
+
+/* Return count of executed instructions: */
+static void ret(Emitter *e, guint n)
+{
+	put(e, 1, 0xb8);                        /* mov eax, n            */
+	put32(e, n);
+	put(e, 1, 0xc3);                        /* ret                   */
+}
+
+/* R0 = pc, return n: */
+static void leave(Emitter *e, RobotVMWord pc, guint n)
+{
+	store_imm(e, 0, pc);
+	ret(e, n);
+}
+
+/* Leave block unless flags satisfy jcc: */
+static void leave_unless(Emitter *e, guint8 jcc, RobotVMWord pc, guint n)
+{
+	put(e, 2, jcc, LEAVE_SIZE);
+	leave(e, pc, n);
+}
+
+/* Address in rax must be valid for access with the last byte at rax + last: */
+static void check_addr(Emitter *e, guint8 last, RobotVMWord pc, guint n)
+{
+	if (last) {
+		put(e, 4, 0x48, 0x8d, 0x48, last);  /* lea rcx, [rax + last] */
+		put(e, 3, 0x4c, 0x39, 0xc1);        /* cmp rcx, r8           */
+	} else {
+		put(e, 3, 0x4c, 0x39, 0xc0);        /* cmp rax, r8           */
+	}
+	leave_unless(e, JB, pc, n);
+}
+
+/* Write of len bytes to address in eax could touch text (as INVALIDATE() in
+ * interpreter). Let VM invalidate it and leave block if VM dropped blocks: */
+static void check_text(Emitter *e, guint len, RobotVMWord pc, guint n)
+{
+	guint8 *skip;
+
+	put(e, 2, 0x89, 0xc1);                  /* mov ecx, eax          */
+	put(e, 2, 0x81, 0xe9);                  /* sub ecx, start - 3    */
+	put32(e, e->code_start - 3);
+	put(e, 2, 0x81, 0xf9);                  /* cmp ecx, len + 3      */
+	put32(e, e->code_end - e->code_start + 3);
+	put(e, 2, JAE, 0);
+	skip = e->p;
+
+	/* Stack stays aligned: return address and three registers: */
+	put(e, 4, 0x57, 0x56, 0x41, 0x50);      /* push rdi, rsi, r8     */
+	put(e, 2, 0x48, 0xbf);                  /* mov rdi, vm           */
+	put64(e, (guint64)(gsize)e->vm);
+	put(e, 2, 0x89, 0xc6);                  /* mov esi, eax          */
+	put(e, 1, 0xba);                        /* mov edx, len          */
+	put32(e, len);
+	put(e, 2, 0x48, 0xb8);                  /* mov rax, invalidate   */
+	put64(e, (guint64)(gsize)e->invalidate);
+	put(e, 2, 0xff, 0xd0);                  /* call rax              */
+	put(e, 4, 0x41, 0x58, 0x5e, 0x5f);      /* pop r8, rsi, rdi      */
+	put(e, 2, 0x85, 0xc0);                  /* test eax, eax         */
+	leave_unless(e, JZ, pc + 4, n + 1);
+
+	skip[-1] = e->p - skip;
+}
+
+/* load rX; const imm; move/moveif/moveifz r0 rX rC at pc: */
+static void compile_jump(Emitter *e, RobotVMWord pc, guint n, guint8 X, guint8 cmd, guint8 C, RobotVMWord imm)
+{
+	store_imm(e, X, imm);
+
+	if (cmd == ROBOT_VM_MOVE) {
+		leave(e, imm, n);
+		return;
+	}
+
+	if (C == 0)
+		store_imm(e, 0, pc + 12);
+	load_eax(e, C);
+	put(e, 2, 0x85, 0xc0);                  /* test eax, eax         */
+	put(e, 2, cmd == ROBOT_VM_MOVEIF? JZ: JNZ, LEAVE_SIZE);
+	leave(e, imm, n);
+	leave(e, pc + 12, n);
+}
+
+/* jz/jnz rA offset at pc, target is absolute: */
+static void compile_branch(Emitter *e, RobotVMWord pc, guint n, guint8 cmd, guint8 A, RobotVMWord target)
+{
+	if (A == 0)
+		store_imm(e, 0, pc + 4);
+	load_eax(e, A);
+	put(e, 2, 0x85, 0xc0);                  /* test eax, eax         */
+	put(e, 2, cmd == ROBOT_VM_JZ? JNZ: JZ, LEAVE_SIZE);
+	leave(e, target, n);
+	leave(e, pc + 4, n);
+}
+
+/* Translate instruction at *pc. Returns FALSE if it finished the block: */
+static gboolean compile_insn(Emitter *e, RobotVM *vm, RobotVMWord *pc, guint *n)
+{
+	RobotVMWord p = *pc;
+	RobotVMWord w, w2, imm;
+	guint32 reads, writes;
+	guint8 cmd, A, B, C;
+
+	if (*n >= JIT_MAX_BLOCK || p + 4 > e->code_end || !robot_vm_read_word(vm, p, &w, NULL))
+		goto leave;
+
+	cmd = w >> 24;
+	A = (w >> 16) & 0x1f;
+	B = (w >> 8) & 0x1f;
+	C = w & 0x1f;
+	e->end = p + 4;
+
+	switch (cmd) {
+		case ROBOT_VM_LOAD:
+			/* Immediate outside of text could change without invalidation: */
+			if (p + 8 > e->code_end || !robot_vm_read_word(vm, p + 4, &imm, NULL))
+				goto leave;
+			e->end = p + 8;
+
+			if (A == 0) {
+				*n += 1;
+				leave(e, imm, *n);
+				return FALSE;
+			}
+
+			if (p + 12 <= e->code_end && robot_vm_read_word(vm, p + 8, &w2, NULL) &&
+					((w2 >> 16) & 0x1f) == 0 && ((w2 >> 8) & 0x1f) == A &&
+					((w2 >> 24) == ROBOT_VM_MOVE || (w2 >> 24) == ROBOT_VM_MOVEIF || (w2 >> 24) == ROBOT_VM_MOVEIFZ)) {
+				*n += 2;
+				e->end = p + 12;
+				compile_jump(e, p, *n, A, w2 >> 24, w2 & 0x1f, imm);
+				return FALSE;
+			}
+
+			store_imm(e, A, imm);
+			*pc = p + 8;
+			*n += 1;
+			return TRUE;
+
+		case ROBOT_VM_JMP:
+		case ROBOT_VM_JZ:
+		case ROBOT_VM_JNZ:
+			imm = p + 4 + (RobotVMWord)(gint16)(w & 0xffff) * 4;
+			*n += 1;
+			if (cmd == ROBOT_VM_JMP)
+				leave(e, imm, *n);
+			else
+				compile_branch(e, p, *n, cmd, A, imm);
+			return FALSE;
+
+		case ROBOT_VM_NOP:
+			reads = writes = 0;
+			break;
+
+		case ROBOT_VM_W8:
+		case ROBOT_VM_W16:
+		case ROBOT_VM_W32:
+			if (!JIT_MEMORY)
+				goto leave;
+			reads = (1u << A) | (1u << B);
+			writes = 0;
+			break;
+
+		case ROBOT_VM_R8:
+		case ROBOT_VM_R16:
+		case ROBOT_VM_R32:
+			if (!JIT_MEMORY)
+				goto leave;
+			reads = 1u << B;
+			writes = 1u << A;
+			break;
+
+		case ROBOT_VM_SWAP:
+			reads = writes = (1u << A) | (1u << B);
+			break;
+
+		case ROBOT_VM_MOVE:
+		case ROBOT_VM_NEG:
+		case ROBOT_VM_ADDI:
+		case ROBOT_VM_SUBI:
+		case ROBOT_VM_ANDI:
+			reads = 1u << B;
+			writes = 1u << A;
+			break;
+
+		case ROBOT_VM_MOVEIF:
+		case ROBOT_VM_MOVEIFZ:
+		case ROBOT_VM_LSHIFT:
+		case ROBOT_VM_RSHIFT:
+		case ROBOT_VM_SSHIFT:
+		case ROBOT_VM_AND:
+		case ROBOT_VM_OR:
+		case ROBOT_VM_XOR:
+		case ROBOT_VM_ADD:
+		case ROBOT_VM_SUB:
+		case ROBOT_VM_MUL:
+			reads = (1u << B) | (1u << C);
+			writes = 1u << A;
+			break;
+
+		case ROBOT_VM_INCR:
+		case ROBOT_VM_DECR:
+		case ROBOT_VM_INCR4:
+		case ROBOT_VM_DECR4:
+			reads = writes = 1u << A;
+			break;
+
+		default:                /* EXT, STOP, DIV, OUT, IN, block memory and invalid ones */
+			goto leave;
+	}
+
+	/* Instruction reading R0 sees address of the next one: */
+	if (reads & 1)
+		store_imm(e, 0, p + 4);
+
+	/* Move to R0 is jump, it ends block: */
+	if (writes & 1) {
+		switch (cmd) {
+			case ROBOT_VM_MOVEIF:
+			case ROBOT_VM_MOVEIFZ:
+				load_eax(e, C);
+				put(e, 2, 0x85, 0xc0);          /* test eax, eax         */
+				put(e, 2, cmd == ROBOT_VM_MOVEIF? JZ: JNZ, 12);
+				/* fall through */
+			case ROBOT_VM_MOVE:
+				*n += 1;
+				load_eax(e, B);
+				store_eax(e, 0);
+				ret(e, *n);
+				if (cmd != ROBOT_VM_MOVE)
+					leave(e, p + 4, *n);
+				return FALSE;
+		}
+		goto leave;
+	}
+
+	switch (cmd) {
+		case ROBOT_VM_NOP:
+			break;
+
+		case ROBOT_VM_W8:
+			load_eax(e, A);
+			check_addr(e, 0, p, *n);
+			load_ecx(e, B);
+			put(e, 3, 0x88, 0x0c, 0x06);            /* mov [rsi + rax], cl   */
+			check_text(e, 1, p, *n);
+			break;
+
+		case ROBOT_VM_W16:
+			load_eax(e, A);
+			check_addr(e, 1, p, *n);
+			load_ecx(e, B);
+			put(e, 4, 0x66, 0xc1, 0xc1, 0x08);      /* rol cx, 8             */
+			put(e, 4, 0x66, 0x89, 0x0c, 0x06);      /* mov [rsi + rax], cx   */
+			check_text(e, 2, p, *n);
+			break;
+
+		case ROBOT_VM_W32:
+			load_eax(e, B);
+			check_addr(e, 4, p, *n);
+			load_ecx(e, A);
+			put(e, 2, 0x0f, 0xc9);                  /* bswap ecx             */
+			put(e, 3, 0x89, 0x0c, 0x06);            /* mov [rsi + rax], ecx  */
+			check_text(e, 4, p, *n);
+			break;
+
+		case ROBOT_VM_R8:
+			load_eax(e, B);
+			check_addr(e, 0, p, *n);
+			put(e, 4, 0x0f, 0xb6, 0x04, 0x06);      /* movzx eax, byte [rsi + rax] */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_R16:
+			load_eax(e, B);
+			check_addr(e, 1, p, *n);
+			put(e, 4, 0x0f, 0xb7, 0x04, 0x06);      /* movzx eax, word [rsi + rax] */
+			put(e, 4, 0x66, 0xc1, 0xc0, 0x08);      /* rol ax, 8             */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_R32:
+			load_eax(e, B);
+			check_addr(e, 4, p, *n);
+			put(e, 3, 0x8b, 0x04, 0x06);            /* mov eax, [rsi + rax]  */
+			put(e, 2, 0x0f, 0xc8);                  /* bswap eax             */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_SWAP:
+			load_eax(e, A);
+			load_ecx(e, B);
+			store_ecx(e, A);
+			store_eax(e, B);
+			break;
+
+		case ROBOT_VM_MOVE:
+			load_eax(e, B);
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_MOVEIF:
+		case ROBOT_VM_MOVEIFZ:
+			load_eax(e, C);
+			put(e, 2, 0x85, 0xc0);                  /* test eax, eax         */
+			put(e, 2, cmd == ROBOT_VM_MOVEIF? JZ: JNZ, 6);
+			load_eax(e, B);
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_LSHIFT:
+		case ROBOT_VM_RSHIFT:
+		case ROBOT_VM_SSHIFT:
+			load_eax(e, B);
+			load_ecx(e, C);
+			/* shl/shr/sar eax, cl. Count is masked with 31 as in interpreter: */
+			put(e, 2, 0xd3, cmd == ROBOT_VM_LSHIFT? 0xe0: cmd == ROBOT_VM_RSHIFT? 0xe8: 0xf8);
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_AND:
+		case ROBOT_VM_OR:
+		case ROBOT_VM_XOR:
+		case ROBOT_VM_ADD:
+		case ROBOT_VM_SUB:      /* SUB adds as the interpreter does */
+			load_eax(e, B);
+			put(e, 3, cmd == ROBOT_VM_AND? 0x23: cmd == ROBOT_VM_OR? 0x0b: cmd == ROBOT_VM_XOR? 0x33: 0x03,
+					0x47, RD(C));           /* op eax, R[C]          */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_MUL:
+			load_eax(e, B);
+			put(e, 4, 0x0f, 0xaf, 0x47, RD(C));     /* imul eax, R[C]        */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_NEG:
+			load_eax(e, B);
+			put(e, 2, 0xf7, 0xd0);                  /* not eax               */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_ADDI:
+		case ROBOT_VM_SUBI:
+		case ROBOT_VM_ANDI:
+			load_eax(e, B);
+			put(e, 1, cmd == ROBOT_VM_ADDI? 0x05: cmd == ROBOT_VM_SUBI? 0x2d: 0x25);
+			put32(e, w & 0xff);                     /* op eax, imm           */
+			store_eax(e, A);
+			break;
+
+		case ROBOT_VM_INCR:
+			put(e, 3, 0xff, 0x47, RD(A));           /* inc R[A]              */
+			break;
+
+		case ROBOT_VM_DECR:
+			put(e, 3, 0xff, 0x4f, RD(A));           /* dec R[A]              */
+			break;
+
+		case ROBOT_VM_INCR4:
+			put(e, 4, 0x83, 0x47, RD(A), 4);        /* add R[A], 4           */
+			break;
+
+		case ROBOT_VM_DECR4:
+			put(e, 4, 0x83, 0x6f, RD(A), 4);        /* sub R[A], 4           */
+			break;
+	}
+
+	*pc = p + 4;
+	*n += 1;
+	return TRUE;
+
+leave:
+	leave(e, p, *n);
+	return FALSE;
+}
+
+RobotVMJitFunc robot_vm_jit_compile(RobotVMJit *self, RobotVM *vm, RobotVMWord pc,
+		RobotVMWord code_start, RobotVMWord code_len, guint *len, RobotVMWord *end)
+{
+	guint8 *start = self->buf + self->used;
+	Emitter e;
+	guint n = 0;
+
+	if (robot_vm_jit_full(self))
+		return NULL;
+	if (mprotect(self->buf, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) < 0)
+		return NULL;
+
+	e.p = start;
+	e.vm = vm;
+	e.invalidate = self->invalidate;
+	e.end = pc;
+	e.code_start = code_start;
+	e.code_end = code_start + code_len;
+
+	put(&e, 3, 0x49, 0x89, 0xd0);                   /* mov r8, rdx           */
+	while (compile_insn(&e, vm, &pc, &n))
+		;
+
+	if (n) {
+		/* Keep blocks aligned: */
+		self->used = (e.p - self->buf + 15) & ~(gsize)15;
+		*len = n;
+		*end = e.end;
+	}
+
+	mprotect(self->buf, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+	return n? (RobotVMJitFunc)start: NULL;
+}
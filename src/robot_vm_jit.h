@@ -0,0 +1,39 @@
+#ifndef _ROBOT_VM_JIT_H_
+#define _ROBOT_VM_JIT_H_ 1
+
+#include "robot_vm.h"
+
+G_BEGIN_DECLS
+
+/* Internal interface of RobotVM compiler of hot blocks into native code. */
+
+/* Compiled block. Executes instructions from its start address until jump,
+ * instruction it can't execute or memory access it can't check. Sets R0 to
+ * the next instruction and returns count of executed instructions. Memory
+ * access is valid if address of its last byte is below limit. */
+typedef guint32 (*RobotVMJitFunc)(RobotVMWord *R, guint8 *mem, guint64 limit);
+
+/* Called by compiled block after it wrote into text. Returns TRUE if some
+ * blocks were dropped, block leaves then as it could be dropped too: */
+typedef gboolean (*RobotVMJitInvalidateFunc)(RobotVM *vm, RobotVMWord addr, guint len);
+
+typedef struct _RobotVMJit RobotVMJit;
+
+RobotVMJit* robot_vm_jit_new(RobotVMJitInvalidateFunc invalidate);
+void robot_vm_jit_free(RobotVMJit *jit);
+
+/* Drop all compiled blocks: */
+void robot_vm_jit_flush(RobotVMJit *jit);
+/* TRUE if there is no space for one more block: */
+gboolean robot_vm_jit_full(RobotVMJit *jit);
+
+/* Compile block at address pc of text [code_start, code_start + code_len).
+ * Returns NULL if the first instruction can't be compiled. Otherwise *len
+ * is the greatest count of instructions block could execute and *end is the
+ * end of text it was compiled from. */
+RobotVMJitFunc robot_vm_jit_compile(RobotVMJit *jit, RobotVM *vm, RobotVMWord pc,
+		RobotVMWord code_start, RobotVMWord code_len, guint *len, RobotVMWord *end);
+
+G_END_DECLS
+
+#endif /* ROBOT_VM_JIT_H */
@@ -0,0 +1,878 @@
+/* Main interpreter loop of RobotVM. This file is included by robot_vm.c
+ * several times, once for every variant of interpreter:
+ *
+ * RUN_NAME   - name of the function
+ * RUN_MASKED - memory addresses are wrapped with mask of power of two
+ *              address space instead of checking them
+ * RUN_PROFILE - executed instructions are counted per opcode and address,
+ *               superinstructions are executed as separate instructions
+ * RUN_TRACE  - executed instructions are written into trace ring buffer, as
+ *              with RUN_PROFILE; profile is counted too if it is enabled
+ * RUN_HOOKS  - hooks of robot_vm_set_hooks() are called before every
+ *              instruction and after every write; it is built with RUN_PROFILE
+ *              and RUN_TRACE, profile and trace are counted if they are enabled
+ * RUN_VERIFIED - text passed verify(), so fall through and static jumps are
+ *              fetched without check. Code outside of text is run by
+ *              RUN_FALLBACK variant, write into text downgrades VM to it
+ *
+ * Variant executes at most *budget instructions and decreases *budget by
+ * count of executed ones. If ext_break is TRUE it stops before EXT instruction.
+ * Returns TRUE on STOP, break or when the budget is spent. */
+static gboolean RUN_NAME(RobotVM *self, guint64 *budget, gboolean ext_break, GError **error)
+{
+	guint64 count = *budget;
+	RobotVMWord *R = self->R;
+	Decoded *code = self->priv->code;
+	RobotVMWord code_start = self->priv->code_start;
+	RobotVMWord code_len = self->priv->code_len;
+	guint8 *mem = self->priv->mem;
+#if RUN_MASKED
+	RobotVMWord mask = self->priv->mask;
+#else
+	gsize mem_len = self->priv->mem_len;
+#endif
+#if !RUN_VERIFIED
+	Decoded tmp;
+#endif
+	Decoded brk;
+	Decoded *d;
+	RobotVMWord off;
+	RobotVMWord a;
+	RobotVMWord target;
+	Symbol *sym;
+	guint8 A, B, C;
+#ifdef ROBOT_VM_JIT
+	guint16 *hot = self->priv->hot;
+	JitBlock *blk;
+	guint32 n;
+#endif
+#if RUN_PROFILE
+	Profile *prof = self->priv->profile;
+#endif
+#if RUN_TRACE
+	Trace *trace = self->priv->trace;
+	RobotVMTraceRecord dummy;
+	RobotVMTraceRecord *rec = &dummy;
+#endif
+#if RUN_HOOKS
+	RobotVMHooks *hooks = &self->priv->hooks;
+#endif
+
+/* Leave interpreter and give back the rest of budget: */
+#define RETURN(res) \
+	do { \
+		*budget = count; \
+		return (res); \
+	} while (0)
+
+/* Make address of memory access valid. last is offset of the last byte of
+ * access checked by strict variant (word access is checked with 4 as before). */
+#if RUN_MASKED
+# define ADDR(addr, last, msg) \
+	do { \
+		(addr) &= mask; \
+	} while (0)
+#else
+# define ADDR(addr, last, msg) \
+	do { \
+		if ((guint64)(addr) + (last) >= mem_len) { \
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, msg); \
+			RETURN(FALSE); \
+		} \
+	} while (0)
+#endif
+
+/* Count jump to target, block at it is compiled when it gets hot: */
+#ifdef ROBOT_VM_JIT
+# define HOT(target) \
+	do { \
+		off = (target) - code_start; \
+		if (hot && off < code_len && G_UNLIKELY(++hot[off >> 2] == JIT_THRESHOLD)) \
+			jit_hot(self, off); \
+	} while (0)
+# if RUN_MASKED
+#  define JIT_LIMIT ((guint64)mask + 1)
+# else
+#  define JIT_LIMIT mem_len
+# endif
+/* Move to R0 is jump too: */
+# define HOT_MOVE() \
+	do { \
+		if (G_UNLIKELY(A == 0)) \
+			HOT(R[0]); \
+	} while (0)
+#else
+# define HOT(target)
+# define HOT_MOVE()
+#endif
+
+/* Count instruction at R0 - 4: */
+#if RUN_PROFILE
+# define PROFILE(op) \
+	do { \
+		if (RUN_TRACE && !prof) \
+			break; \
+		++prof->ops[op]; \
+		off = R[0] - 4 - code_start; \
+		if (off < code_len) \
+			++prof->pc[off >> 2]; \
+		else \
+			++prof->outside; \
+	} while (0)
+#else
+# define PROFILE(op)
+#endif
+
+/* Write instruction at R0 - 4 into trace. Value of A is written as it is
+ * before instruction and updated by NEXT(): */
+#if RUN_TRACE
+# define TRACE(code) \
+	do { \
+		if (RUN_HOOKS && !trace) \
+			break; \
+		rec = &trace->buf[trace->pos++ & trace->mask]; \
+		rec->pc = R[0] - 4; \
+		rec->op = (guint)(code) < ROBOT_VM_COMMAND_COUNT? (code): ROBOT_VM_LOAD; \
+		rec->A = A; \
+		rec->B = B; \
+		rec->C = C; \
+		rec->value = R[A]; \
+	} while (0)
+# define TRACE_RESULT() rec->value = R[A]
+#else
+# define TRACE(code)
+# define TRACE_RESULT()
+#endif
+
+/* Call step hook for instruction at R0 - 4. VM suspended by it returns before
+ * the instruction, the hook is skipped for it when VM continues: */
+#if RUN_HOOKS
+# define HOOK_STEP() \
+	do { \
+		if (G_UNLIKELY(self->priv->hook_skip)) { \
+			self->priv->hook_skip = FALSE; \
+			break; \
+		} \
+		if (!hooks->step) \
+			break; \
+		R[0] -= 4; \
+		if (!hooks->step(self, R[0], self->priv->hooks_data, error)) \
+			RETURN(FALSE); \
+		if (G_UNLIKELY(self->priv->pending || self->priv->run != RUN_NAME)) { \
+			self->priv->hook_skip = TRUE; \
+			self->priv->break_skip = (d == &brk); \
+			if (self->priv->pending) \
+				RETURN(TRUE); \
+			*budget = count; \
+			return self->priv->run(self, budget, ext_break, error); \
+		} \
+		R[0] += 4; \
+	} while (0)
+/* Call write hook after instruction wrote len bytes at addr. VM suspended by
+ * it returns after the instruction: */
+# define HOOK_WRITE(addr, len) \
+	do { \
+		if (!hooks->write) \
+			break; \
+		TRACE_RESULT(); \
+		if (!hooks->write(self, (addr), (len), self->priv->hooks_data, error)) \
+			RETURN(FALSE); \
+		if (G_UNLIKELY(self->priv->pending)) { \
+			--count; \
+			RETURN(TRUE); \
+		} \
+		if (G_UNLIKELY(self->priv->run != RUN_NAME)) \
+			SWITCH_RUN(); \
+	} while (0)
+/* Block instruction wrote R[C] bytes at R[A]: */
+# define BLOCK_WRITTEN() \
+	do { \
+		if (R[C]) { \
+			a = R[A]; \
+			ADDR(a, 0, "Write out of memory"); \
+			HOOK_WRITE(a, R[C]); \
+		} \
+	} while (0)
+#else
+# define HOOK_STEP()
+# define HOOK_WRITE(addr, len)
+# define BLOCK_WRITTEN()
+#endif
+
+#define INSTRUMENT(op) HOOK_STEP(); PROFILE(op); TRACE(op)
+
+/* Take state of VM again after host code, which could reload program,
+ * reallocate memory or replace profile and trace: */
+#define RELOAD() \
+	do { \
+		code = self->priv->code; \
+		code_start = self->priv->code_start; \
+		code_len = self->priv->code_len; \
+		mem = self->priv->mem; \
+		RELOAD_MEMORY(); \
+		RELOAD_HOT(); \
+		RELOAD_PROFILE(); \
+		RELOAD_TRACE(); \
+	} while (0)
+#if RUN_MASKED
+# define RELOAD_MEMORY() mask = self->priv->mask
+#else
+# define RELOAD_MEMORY() mem_len = self->priv->mem_len
+#endif
+#ifdef ROBOT_VM_JIT
+# define RELOAD_HOT() hot = self->priv->hot
+#else
+# define RELOAD_HOT()
+#endif
+#if RUN_PROFILE
+# define RELOAD_PROFILE() prof = self->priv->profile
+#else
+# define RELOAD_PROFILE()
+#endif
+/* Record of current instruction keeps value of A before the call: */
+#if RUN_TRACE
+# define RELOAD_TRACE() \
+	do { \
+		trace = self->priv->trace; \
+		rec = &dummy; \
+	} while (0)
+#else
+# define RELOAD_TRACE()
+#endif
+
+/* Continue with variant chosen by select_run() after current instruction: */
+#define SWITCH_RUN() \
+	do { \
+		*budget = --count; \
+		if (!count) \
+			RETURN(TRUE); \
+		return self->priv->run(self, budget, ext_break, error); \
+	} while (0)
+
+#if RUN_VERIFIED
+/* Code outside of text is not verified: */
+# define FETCH_SLOW() \
+	do { \
+		*budget = count; \
+		return RUN_FALLBACK(self, budget, ext_break, error); \
+	} while (0)
+/* Verified text can't be left by fall through or static jump: */
+# define FETCH_NEXT() \
+	do { \
+		d = code + ((R[0] - code_start) >> 2); \
+		R[0] += 4; \
+		A = d->A; \
+		B = d->B; \
+		C = d->C; \
+	} while (0)
+/* Instruction set R0 to computed value. Not wrapped in do-while, continue
+ * of switch dispatch in NEXT_CHECKED() must reach the loop: */
+# define CHECK_R0() \
+	if (A == 0) \
+		NEXT_CHECKED()
+/* Write into text downgrades VM: */
+# define WRITTEN(addr, len) \
+	do { \
+		if (G_UNLIKELY((RobotVMWord)((addr) - (code_start - 3)) < code_len + 3)) { \
+			invalidate(self, (addr), (len)); \
+			if (self->priv->run != RUN_NAME) \
+				SWITCH_RUN(); \
+		} \
+	} while (0)
+#else
+# define FETCH_SLOW() \
+	do { \
+		if (!(d = fetch_slow(self, &tmp, error))) \
+			RETURN(FALSE); \
+	} while (0)
+# define FETCH_NEXT() FETCH()
+# define CHECK_R0()
+# define WRITTEN(addr, len) \
+	do { \
+		INVALIDATE(addr, len); \
+		HOOK_WRITE(addr, len); \
+	} while (0)
+#endif
+
+/* Find instruction at PC and move PC to the next one: */
+#define FETCH() \
+	do { \
+		off = R[0] - code_start; \
+		if (G_LIKELY(off < code_len && !(off & 3))) \
+			d = code + (off >> 2); \
+		else \
+			FETCH_SLOW(); \
+		R[0] += 4; \
+		A = d->A; \
+		B = d->B; \
+		C = d->C; \
+	} while (0)
+
+#ifdef ROBOT_VM_THREADED
+	static const void *labels[OP_COUNT] = {
+		[ROBOT_VM_NOP] = &&L_ROBOT_VM_NOP,
+		[ROBOT_VM_LOAD] = &&L_ROBOT_VM_LOAD,
+		[ROBOT_VM_EXT] = &&L_ROBOT_VM_EXT,
+		[ROBOT_VM_W8] = &&L_ROBOT_VM_W8,
+		[ROBOT_VM_R8] = &&L_ROBOT_VM_R8,
+		[ROBOT_VM_W16] = &&L_ROBOT_VM_W16,
+		[ROBOT_VM_R16] = &&L_ROBOT_VM_R16,
+		[ROBOT_VM_W32] = &&L_ROBOT_VM_W32,
+		[ROBOT_VM_R32] = &&L_ROBOT_VM_R32,
+		[ROBOT_VM_SWAP] = &&L_ROBOT_VM_SWAP,
+		[ROBOT_VM_MOVE] = &&L_ROBOT_VM_MOVE,
+		[ROBOT_VM_MOVEIF] = &&L_ROBOT_VM_MOVEIF,
+		[ROBOT_VM_MOVEIFZ] = &&L_ROBOT_VM_MOVEIFZ,
+		[ROBOT_VM_STOP] = &&L_ROBOT_VM_STOP,
+		[ROBOT_VM_LSHIFT] = &&L_ROBOT_VM_LSHIFT,
+		[ROBOT_VM_RSHIFT] = &&L_ROBOT_VM_RSHIFT,
+		[ROBOT_VM_SSHIFT] = &&L_ROBOT_VM_SSHIFT,
+		[ROBOT_VM_AND] = &&L_ROBOT_VM_AND,
+		[ROBOT_VM_OR] = &&L_ROBOT_VM_OR,
+		[ROBOT_VM_XOR] = &&L_ROBOT_VM_XOR,
+		[ROBOT_VM_NEG] = &&L_ROBOT_VM_NEG,
+		[ROBOT_VM_INCR] = &&L_ROBOT_VM_INCR,
+		[ROBOT_VM_DECR] = &&L_ROBOT_VM_DECR,
+		[ROBOT_VM_INCR4] = &&L_ROBOT_VM_INCR4,
+		[ROBOT_VM_DECR4] = &&L_ROBOT_VM_DECR4,
+		[ROBOT_VM_ADD] = &&L_ROBOT_VM_ADD,
+		[ROBOT_VM_SUB] = &&L_ROBOT_VM_SUB,
+		[ROBOT_VM_MUL] = &&L_ROBOT_VM_MUL,
+		[ROBOT_VM_DIV] = &&L_ROBOT_VM_DIV,
+		[ROBOT_VM_OUT] = &&L_ROBOT_VM_OUT,
+		[ROBOT_VM_IN] = &&L_ROBOT_VM_IN,
+		[ROBOT_VM_ADDI] = &&L_ROBOT_VM_ADDI,
+		[ROBOT_VM_SUBI] = &&L_ROBOT_VM_SUBI,
+		[ROBOT_VM_ANDI] = &&L_ROBOT_VM_ANDI,
+		[ROBOT_VM_JMP] = &&L_ROBOT_VM_JMP,
+		[ROBOT_VM_JZ] = &&L_ROBOT_VM_JZ,
+		[ROBOT_VM_JNZ] = &&L_ROBOT_VM_JNZ,
+		[ROBOT_VM_CALL] = &&L_ROBOT_VM_CALL,
+		[ROBOT_VM_RET] = &&L_ROBOT_VM_RET,
+		[ROBOT_VM_MEMCPY] = &&L_ROBOT_VM_MEMCPY,
+		[ROBOT_VM_MEMSET] = &&L_ROBOT_VM_MEMSET,
+		[ROBOT_VM_MEMCMP] = &&L_ROBOT_VM_MEMCMP,
+		[ROBOT_VM_STRLEN] = &&L_ROBOT_VM_STRLEN,
+		[OP_LOAD_MEM] = &&L_OP_LOAD_MEM,
+		[OP_CALL_MEM] = &&L_OP_CALL_MEM,
+		[OP_INVALID] = &&L_INVALID,
+		[OP_GOTO] = &&L_OP_GOTO,
+		[OP_JUMP] = &&L_OP_JUMP,
+		[OP_JUMPIF] = &&L_OP_JUMPIF,
+		[OP_JUMPIFZ] = &&L_OP_JUMPIFZ,
+#ifdef ROBOT_VM_JIT
+		[OP_JIT] = &&L_OP_JIT,
+#else
+		[OP_JIT] = &&L_INVALID,
+#endif
+		[OP_BREAK] = &&L_OP_BREAK,
+		[OP_UNDECODED] = &&L_OP_UNDECODED
+	};
+
+# define TARGET(op) L_##op: INSTRUMENT(op);
+/* Handler which is not counted, it redispatches or counts itself: */
+# define TARGET_QUIET(op) L_##op:
+# define TARGET_INVALID L_INVALID:
+# define REDISPATCH() goto *labels[d->cmd]
+# define NEXT_WITH(fetch) \
+	{ \
+		TRACE_RESULT(); \
+		if (G_UNLIKELY(!--count)) \
+			RETURN(TRUE); \
+		fetch(); \
+		goto *labels[d->cmd]; \
+	}
+# define NEXT() NEXT_WITH(FETCH_NEXT)
+/* Next instruction could be anywhere: */
+# define NEXT_CHECKED() NEXT_WITH(FETCH)
+
+	FETCH();
+	goto *labels[d->cmd];
+	{
+#else
+# define TARGET(op) case op: INSTRUMENT(op);
+# define TARGET_QUIET(op) case op:
+# define TARGET_INVALID default:
+# define REDISPATCH() goto redispatch
+# define NEXT_WITH(fetch) \
+	{ \
+		TRACE_RESULT(); \
+		if (G_UNLIKELY(!--count)) \
+			RETURN(TRUE); \
+		fetch(); \
+		continue; \
+	}
+# define NEXT() NEXT_WITH(FETCH_NEXT)
+# define NEXT_CHECKED() NEXT_WITH(FETCH)
+
+	FETCH();
+	for (;;) {
+redispatch:
+		switch (d->cmd) {
+#endif
+		TARGET(ROBOT_VM_NOP)    /* No operation                              */
+			NEXT();
+
+		TARGET(ROBOT_VM_LOAD)
+load:
+			R[0] += 4;
+			R[A] = d->imm;
+			NEXT();
+
+		TARGET(OP_GOTO)
+			R[0] = d->imm;
+			HOT(d->imm);
+			NEXT();
+
+		/* Superinstructions are counted as two instructions (LOAD and move).
+		 * If budget is smaller or VM is instrumented they are executed as plain LOAD: */
+		TARGET(OP_JUMP)
+			if (RUN_PROFILE || RUN_TRACE || G_UNLIKELY(count < 2))
+				goto load;
+			--count;
+			R[A] = d->imm;
+			R[0] = d->imm;
+			HOT(d->imm);
+			NEXT();
+
+		TARGET(OP_JUMPIF)
+			if (RUN_PROFILE || RUN_TRACE || G_UNLIKELY(count < 2))
+				goto load;
+			--count;
+			R[A] = d->imm;
+			R[0] += 8;
+			if (R[C]) {
+				R[0] = d->imm;
+				HOT(d->imm);
+			}
+			NEXT();
+
+		TARGET(OP_JUMPIFZ)
+			if (RUN_PROFILE || RUN_TRACE || G_UNLIKELY(count < 2))
+				goto load;
+			--count;
+			R[A] = d->imm;
+			R[0] += 8;
+			if (R[C] == 0) {
+				R[0] = d->imm;
+				HOT(d->imm);
+			}
+			NEXT();
+
+		TARGET(OP_LOAD_MEM)
+			a = R[0];
+			ADDR(a, 4, "out of memory");
+			R[0] += 4;
+			R[A] = mem_get32(mem, a);
+			NEXT_CHECKED();
+
+		TARGET_QUIET(ROBOT_VM_EXT)   /* Call function by number in symtable       */
+			if (ext_break) {
+				R[0] -= 4;
+				RETURN(TRUE);
+			}
+			INSTRUMENT(ROBOT_VM_EXT);
+
+			if (self->priv->symtable->len <= R[A]) {
+				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_INVALID_ADDRESS,
+						"Invalid function reference: %u\n", (unsigned)R[A]);
+				RETURN(FALSE);
+			}
+			sym = &g_array_index(self->priv->symtable, Symbol, R[A]);
+			if (!sym->func) {
+				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Invalid function");
+				RETURN(FALSE);
+			}
+#if RUN_PROFILE
+			if (!RUN_TRACE || prof) {
+				if (prof->ext->len <= R[A])
+					g_array_set_size(prof->ext, R[A] + 1);
+				++g_array_index(prof->ext, guint64, R[A]);
+			}
+#endif
+
+			/* Function could print too: */
+			if (self->priv->out.len && !channel_flush(self, error))
+				RETURN(FALSE);
+			if (G_UNLIKELY(self->priv->log)) {
+				if (!log_call(self, sym, error))
+					RETURN(FALSE);
+			} else if (!sym->func(self, sym->userdata, error))
+				RETURN(FALSE);
+
+			/* Function suspended the call, VM waits after EXT: */
+			if (G_UNLIKELY(self->priv->pending)) {
+				--count;
+				RETURN(TRUE);
+			}
+
+			/* Function could reload program or reallocate memory: */
+			if (G_UNLIKELY(self->priv->run != RUN_NAME))
+				SWITCH_RUN();
+			RELOAD();
+			/* Function could change R0 too: */
+			NEXT_CHECKED();
+
+		TARGET(ROBOT_VM_W8)  /* Write byte to address. (*A = B)           */
+			a = R[A];
+			ADDR(a, 0, "Write out of memory");
+			MEM8(mem, a) = R[B];
+			WRITTEN(a, 1);
+			NEXT();
+
+		TARGET(ROBOT_VM_R8)  /* Read byte from address. (B = *A)          */
+			a = R[B];
+			ADDR(a, 0, "Write out of memory");
+			R[A] = MEM8(mem, a);
+			NEXT();
+
+		TARGET(ROBOT_VM_W16)    /* Write uint16 to address. (*A = B)         */
+			a = R[A];
+			ADDR(a, 1, "Write out of memory");
+			mem_put16(mem, a, R[B]);
+			WRITTEN(a, 2);
+			NEXT();
+
+		TARGET(ROBOT_VM_R16)    /* Read uint16 from address. (B = *A)        */
+			a = R[B];
+			ADDR(a, 1, "Write out of memory");
+			R[A] = mem_get16(mem, a);
+			NEXT();
+
+		TARGET(ROBOT_VM_W32)
+			a = R[B];
+			ADDR(a, 4, "out of memory");
+			mem_put32(mem, a, R[A]);
+			WRITTEN(a, 4);
+			NEXT();
+
+		TARGET(ROBOT_VM_R32)
+			a = R[B];
+			ADDR(a, 4, "out of memory");
+			R[A] = mem_get32(mem, a);
+			NEXT();
+
+		TARGET(ROBOT_VM_SWAP) /* Swap A and B                              */
+			a = R[A];
+			R[A] = R[B];
+			R[B] = a;
+			NEXT();
+
+		TARGET(ROBOT_VM_MOVE)
+			R[A] = R[B];
+			HOT_MOVE();
+			CHECK_R0();
+			NEXT();
+
+		TARGET(ROBOT_VM_MOVEIF)
+			if (R[C]) {
+				R[A] = R[B];
+				HOT_MOVE();
+				CHECK_R0();
+			}
+			NEXT();
+
+		TARGET(ROBOT_VM_MOVEIFZ)
+			if (R[C] == 0) {
+				R[A] = R[B];
+				HOT_MOVE();
+				CHECK_R0();
+			}
+			NEXT();
+
+		TARGET(ROBOT_VM_STOP)
+			self->priv->stop = TRUE;
+			self->priv->exit_code = R[A];
+			--count;
+			RETURN(TRUE);
+
+		/* Binary operations: */
+		TARGET(ROBOT_VM_LSHIFT)
+			R[A] = R[B] << (R[C] & 31);
+			NEXT();
+
+		TARGET(ROBOT_VM_RSHIFT)
+			R[A] = R[B] >> (R[C] & 31);
+			NEXT();
+
+		TARGET(ROBOT_VM_SSHIFT)
+			R[A] = ((gint32)R[B]) >> (R[C] & 31);
+			NEXT();
+
+		TARGET(ROBOT_VM_AND)
+			R[A] = R[B] & R[C];
+			NEXT();
+
+		TARGET(ROBOT_VM_OR)
+			R[A] = R[B] | R[C];
+			NEXT();
+
+		TARGET(ROBOT_VM_XOR)
+			R[A] = R[B] ^ R[C];
+			NEXT();
+
+		TARGET(ROBOT_VM_NEG)
+			R[A] = ~R[B];
+			NEXT();
+
+		/* Arithmetic operations: */
+		TARGET(ROBOT_VM_INCR)   /* ++self->A                                 */
+			++R[A];
+			NEXT();
+
+		TARGET(ROBOT_VM_DECR)   /* --self->A                                 */
+			--R[A];
+			NEXT();
+
+		TARGET(ROBOT_VM_INCR4)   /* ++self->A                                 */
+			R[A] += 4;
+			NEXT();
+
+		TARGET(ROBOT_VM_DECR4)   /* --self->A                                 */
+			R[A] -= 4;
+			NEXT();
+
+		TARGET(ROBOT_VM_ADD)
+			/* TODO: overflow! */
+			R[A] = R[B] + R[C];
+			NEXT();
+
+		TARGET(ROBOT_VM_SUB)
+			/* TODO: overflow! */
+			R[A] = R[B] + R[C];
+			NEXT();
+
+		TARGET(ROBOT_VM_MUL)
+			/* TODO: overflow! */
+			R[A] = R[B] * R[C];
+			NEXT();
+
+		TARGET(ROBOT_VM_DIV)    /* PUSH(POP() / POP())                       */
+			if (!R[C]) {
+				g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Division by zero");
+				RETURN(FALSE);
+			}
+			R[A] = R[B] / R[C];
+			R[31] = R[B] % R[C];
+			NEXT();
+
+		/* I/O */
+		/* Bytes are buffered, see channel_flush() and channel_fill(): */
+		TARGET(ROBOT_VM_OUT)    /* Out symbol from stack to console.         */
+			/* TODO: unicode! */
+			if (G_UNLIKELY(self->priv->out.len == CHANNEL_BUFFER) && !channel_flush(self, error))
+				RETURN(FALSE);
+			self->priv->out.buf[self->priv->out.len++] = R[A];
+			NEXT();
+
+		TARGET(ROBOT_VM_IN)     /* Input symbol from console to stack.       */
+			/* TODO: unicode! */
+			if (self->priv->in.pos == self->priv->in.len && !channel_fill(self, error))
+				RETURN(FALSE);
+			/* -1 at the end of input: */
+			R[A] = self->priv->in.pos < self->priv->in.len? self->priv->in.buf[self->priv->in.pos++]: (RobotVMWord)-1;
+			NEXT();
+
+		/* Immediate operands, byte is decoded into imm: */
+		TARGET(ROBOT_VM_ADDI)
+			R[A] = R[B] + d->imm;
+			NEXT();
+
+		TARGET(ROBOT_VM_SUBI)
+			R[A] = R[B] - d->imm;
+			NEXT();
+
+		TARGET(ROBOT_VM_ANDI)
+			R[A] = R[B] & d->imm;
+			NEXT();
+
+		/* Relative branches, target is decoded into imm: */
+		TARGET(ROBOT_VM_JMP)
+			R[0] = d->imm;
+			HOT(d->imm);
+			NEXT();
+
+		TARGET(ROBOT_VM_JZ)
+			if (R[A] == 0) {
+				R[0] = d->imm;
+				HOT(d->imm);
+			}
+			NEXT();
+
+		TARGET(ROBOT_VM_JNZ)
+			if (R[A]) {
+				R[0] = d->imm;
+				HOT(d->imm);
+			}
+			NEXT();
+
+		/* Calls. Return address is written to stack as by decr4 r1; write32: */
+		TARGET(ROBOT_VM_CALL)
+			a = R[1] - 4;
+			ADDR(a, 4, "Stack out of memory");
+			R[0] += 4;
+			mem_put32(mem, a, R[0]);
+			R[1] -= 4;
+#if RUN_VERIFIED
+			ras_push(self->priv, R[0]);
+#endif
+			R[0] = d->imm;
+			HOT(d->imm);
+			WRITTEN(a, 4);
+			NEXT();
+
+		TARGET_QUIET(OP_CALL_MEM)
+			INSTRUMENT(ROBOT_VM_CALL);
+			a = R[0];
+			ADDR(a, 4, "out of memory");
+			target = mem_get32(mem, a);
+			a = R[1] - 4;
+			ADDR(a, 4, "Stack out of memory");
+			R[0] += 4;
+			mem_put32(mem, a, R[0]);
+			R[1] -= 4;
+			R[0] = target;
+			HOT(target);
+			WRITTEN(a, 4);
+			NEXT_CHECKED();
+
+		TARGET(ROBOT_VM_RET)
+			a = R[1];
+			ADDR(a, 4, "Stack out of memory");
+			R[0] = mem_get32(mem, a);
+			R[1] += 4;
+			HOT(R[0]);
+#if RUN_VERIFIED
+			if (G_LIKELY(ras_pop(self->priv, R[0])))
+				NEXT();
+#endif
+			NEXT_CHECKED();
+
+		/* Block memory operations, see block_copy() and others. Write into
+		 * text is invalidated by them: */
+		TARGET(ROBOT_VM_MEMCPY)
+			if (!block_copy(self, R[A], R[B], R[C], error))
+				RETURN(FALSE);
+			if (RUN_VERIFIED && G_UNLIKELY(self->priv->run != RUN_NAME))
+				SWITCH_RUN();
+			BLOCK_WRITTEN();
+			NEXT();
+
+		TARGET(ROBOT_VM_MEMSET)
+			if (!block_set(self, R[A], R[B], R[C], error))
+				RETURN(FALSE);
+			if (RUN_VERIFIED && G_UNLIKELY(self->priv->run != RUN_NAME))
+				SWITCH_RUN();
+			BLOCK_WRITTEN();
+			NEXT();
+
+		TARGET(ROBOT_VM_MEMCMP)
+			if (!block_compare(self, R[A], R[B], R[C], &R[A], error))
+				RETURN(FALSE);
+			NEXT();
+
+		TARGET(ROBOT_VM_STRLEN)
+			if (!block_length(self, R[B], &R[A], error))
+				RETURN(FALSE);
+			NEXT();
+
+#ifdef ROBOT_VM_JIT
+		/* Compiled block is executed only if it can't run out of budget: */
+		TARGET_QUIET(OP_JIT)
+			blk = &g_array_index(self->priv->blocks, JitBlock, d->imm);
+			if (G_LIKELY(count >= blk->len)) {
+				R[0] -= 4;
+				n = blk->func(R, mem, JIT_LIMIT);
+				if (G_LIKELY(n)) {
+					count -= n - 1;
+					/* Block could write into text and leave it anywhere: */
+					if (RUN_VERIFIED && G_UNLIKELY(self->priv->run != RUN_NAME))
+						SWITCH_RUN();
+					NEXT_CHECKED();
+				}
+				R[0] += 4;
+			}
+			d = &blk->orig;
+			A = d->A;
+			B = d->B;
+			C = d->C;
+			REDISPATCH();
+#endif
+
+		/* Instruction at breakpoint is decoded from memory again. VM which
+		 * waited at breakpoint executes it without the hook: */
+		TARGET_QUIET(OP_BREAK)
+			decode_insn(self, R[0] - 4, &brk, TRUE);
+			if (ext_break && brk.cmd == ROBOT_VM_EXT) {
+				R[0] -= 4;
+				RETURN(TRUE);
+			}
+			if (G_UNLIKELY(self->priv->break_skip)) {
+				self->priv->break_skip = FALSE;
+			} else {
+				R[0] -= 4;
+				if (!break_hit(self, error))
+					RETURN(FALSE);
+				if (self->priv->pending || self->priv->run != RUN_NAME) {
+					self->priv->break_skip = TRUE;
+					RETURN(TRUE);
+				}
+				RELOAD();
+				R[0] += 4;
+			}
+			d = &brk;
+			A = d->A;
+			B = d->B;
+			C = d->C;
+			REDISPATCH();
+
+		TARGET_QUIET(OP_UNDECODED)
+			decode(self, R[0] - 4, d);
+			A = d->A;
+			B = d->B;
+			C = d->C;
+			REDISPATCH();
+
+		TARGET_INVALID
+			R[0] -= 4;
+			g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_INVALID_INSTRUCTION,
+					"Invalid instruction %02x at %x", MEM8(mem, R[0]), (unsigned)R[0]);
+			RETURN(FALSE);
+#ifndef ROBOT_VM_THREADED
+		}
+#endif
+	}
+
+#undef RETURN
+#undef ADDR
+#undef TARGET
+#undef TARGET_QUIET
+#undef TARGET_INVALID
+#undef PROFILE
+#undef TRACE
+#undef TRACE_RESULT
+#undef INSTRUMENT
+#undef HOOK_STEP
+#undef HOOK_WRITE
+#undef BLOCK_WRITTEN
+#undef REDISPATCH
+#undef NEXT
+#undef NEXT_WITH
+#undef NEXT_CHECKED
+#undef FETCH
+#undef FETCH_SLOW
+#undef FETCH_NEXT
+#undef CHECK_R0
+#undef WRITTEN
+#undef SWITCH_RUN
+#undef RELOAD
+#undef RELOAD_MEMORY
+#undef RELOAD_HOT
+#undef RELOAD_PROFILE
+#undef RELOAD_TRACE
+#undef HOT
+#undef HOT_MOVE
+#undef JIT_LIMIT
+
+	return TRUE; /* not reached */
+}
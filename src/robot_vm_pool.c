@@ -0,0 +1,320 @@
+#include "robot.h"
+
+/* Default count of instructions in one slice of execution: */
+#define DEFAULT_SLICE (1 << 16)
+/* Threads executing EXT of parked VMs per worker: */
+#define EXT_THREADS 4
+
+typedef struct _Job {
+	RobotVM *vm;
+	guint64 executed;
+	GError *error;
+	gboolean done;
+} Job;
+
+typedef struct _Worker {
+	RobotVMPool *pool;
+	GThread *thread;
+
+	/* Run queue. Owner takes VMs from head, thieves from tail: */
+	GMutex lock;
+	GQueue queue;
+} Worker;
+
+struct _RobotVMPoolPrivate {
+	guint64 slice;
+	GPtrArray *jobs;
+
+	guint n_workers;
+	Worker *workers;
+	GThreadPool *ext;   /* Executes EXT instructions of parked VMs */
+
+	/* Idle workers sleep on cond until some VM is queued: */
+	GMutex lock;
+	GCond cond;
+	gint sleeping;
+	gint queued;        /* VMs in run queues        */
+	gint remaining;     /* VMs which are not done   */
+	gint next;          /* Queue for next parked VM */
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE(RobotVMPool, robot_vm_pool, G_TYPE_OBJECT)
+
+static void job_free(gpointer p)
+{
+	Job *job = p;
+
+	g_object_unref(job->vm);
+	if (job->error)
+		g_error_free(job->error);
+	g_free(job);
+}
+
+static void finalize(GObject *obj)
+{
+	RobotVMPool *self = ROBOT_VM_POOL(obj);
+	guint i;
+
+	for (i = 0; i < self->priv->n_workers; i++) {
+		g_mutex_clear(&self->priv->workers[i].lock);
+	}
+	g_free(self->priv->workers);
+	g_ptr_array_unref(self->priv->jobs);
+	g_mutex_clear(&self->priv->lock);
+	g_cond_clear(&self->priv->cond);
+	self->priv = NULL;
+}
+
+static void robot_vm_pool_class_init(RobotVMPoolClass *klass)
+{
+	GObjectClass *objcls = G_OBJECT_CLASS(klass);
+	objcls->finalize = finalize;
+}
+
+static void robot_vm_pool_init(RobotVMPool *self)
+{
+	self->priv = robot_vm_pool_get_instance_private(self);
+	self->priv->slice = DEFAULT_SLICE;
+	self->priv->jobs = g_ptr_array_new_with_free_func(job_free);
+	self->priv->n_workers = 0;
+	self->priv->workers = NULL;
+	self->priv->ext = NULL;
+	g_mutex_init(&self->priv->lock);
+	g_cond_init(&self->priv->cond);
+	self->priv->sleeping = 0;
+	self->priv->queued = 0;
+	self->priv->remaining = 0;
+	self->priv->next = 0;
+}
+
+RobotVMPool* robot_vm_pool_new(guint n_threads)
+{
+	RobotVMPool *self = g_object_new(ROBOT_TYPE_VM_POOL, NULL);
+	guint i;
+
+	if (!n_threads)
+		n_threads = g_get_num_processors();
+
+	self->priv->n_workers = n_threads;
+	self->priv->workers = g_new0(Worker, n_threads);
+	for (i = 0; i < n_threads; i++) {
+		self->priv->workers[i].pool = self;
+		g_mutex_init(&self->priv->workers[i].lock);
+		g_queue_init(&self->priv->workers[i].queue);
+	}
+
+	return self;
+}
+
+void robot_vm_pool_set_slice(RobotVMPool *self, guint64 slice)
+{
+	self->priv->slice = slice? slice: DEFAULT_SLICE;
+}
+
+guint robot_vm_pool_add(RobotVMPool *self, RobotVM *vm)
+{
+	Job *job = g_new0(Job, 1);
+
+	job->vm = g_object_ref(vm);
+	g_ptr_array_add(self->priv->jobs, job);
+
+	return self->priv->jobs->len - 1;
+}
+
+/* Put VM to the end of run queue and wake up idle worker: */
+static void push(RobotVMPool *self, Worker *w, Job *job)
+{
+	g_mutex_lock(&w->lock);
+	g_queue_push_tail(&w->queue, job);
+	g_mutex_unlock(&w->lock);
+
+	g_atomic_int_inc(&self->priv->queued);
+	if (g_atomic_int_get(&self->priv->sleeping)) {
+		g_mutex_lock(&self->priv->lock);
+		g_cond_signal(&self->priv->cond);
+		g_mutex_unlock(&self->priv->lock);
+	}
+}
+
+/* Take VM from own queue or steal it from other workers: */
+static Job* pop(RobotVMPool *self, Worker *w)
+{
+	guint n = self->priv->n_workers;
+	guint idx = w - self->priv->workers;
+	guint i;
+	Worker *v;
+	Job *job;
+
+	g_mutex_lock(&w->lock);
+	job = g_queue_pop_head(&w->queue);
+	g_mutex_unlock(&w->lock);
+
+	for (i = 1; !job && i < n; i++) {
+		v = &self->priv->workers[(idx + i) % n];
+		g_mutex_lock(&v->lock);
+		job = g_queue_pop_tail(&v->queue);
+		g_mutex_unlock(&v->lock);
+	}
+
+	if (job)
+		g_atomic_int_add(&self->priv->queued, -1);
+
+	return job;
+}
+
+static void finish(RobotVMPool *self, Job *job)
+{
+	job->done = TRUE;
+
+	if (g_atomic_int_dec_and_test(&self->priv->remaining)) {
+		g_mutex_lock(&self->priv->lock);
+		g_cond_broadcast(&self->priv->cond);
+		g_mutex_unlock(&self->priv->lock);
+	}
+}
+
+/* Execute EXT of parked VM and return it to run queue: */
+static void ext_main(gpointer data, gpointer userdata)
+{
+	RobotVMPool *self = userdata;
+	Job *job = data;
+	gboolean stop = FALSE;
+	guint idx;
+
+	if (!robot_vm_step(job->vm, &stop, &job->error)) {
+		finish(self, job);
+		return;
+	}
+
+	++job->executed;
+	if (robot_vm_is_pending(job->vm)) {
+		/* Nothing would resume it, callbacks of pool VMs block instead: */
+		g_set_error(&job->error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Function suspended VM of pool");
+		finish(self, job);
+		return;
+	}
+	if (stop) {
+		finish(self, job);
+		return;
+	}
+
+	idx = (guint)g_atomic_int_add(&self->priv->next, 1) % self->priv->n_workers;
+	push(self, &self->priv->workers[idx], job);
+}
+
+/* Whether VM waits before EXT instruction: */
+static gboolean at_ext(RobotVM *vm)
+{
+	RobotVMWord insn;
+
+	return robot_vm_read_word(vm, vm->R[0], &insn, NULL) && (insn >> 24) == ROBOT_VM_EXT;
+}
+
+static gpointer worker_main(gpointer data)
+{
+	Worker *w = data;
+	RobotVMPool *self = w->pool;
+	guint64 executed;
+	gboolean stop;
+	Job *job;
+
+	for (;;) {
+		job = pop(self, w);
+
+		if (!job) {
+			if (!g_atomic_int_get(&self->priv->remaining))
+				break;
+
+			g_mutex_lock(&self->priv->lock);
+			g_atomic_int_inc(&self->priv->sleeping);
+			while (!g_atomic_int_get(&self->priv->queued) && g_atomic_int_get(&self->priv->remaining))
+				g_cond_wait(&self->priv->cond, &self->priv->lock);
+			g_atomic_int_add(&self->priv->sleeping, -1);
+			g_mutex_unlock(&self->priv->lock);
+			continue;
+		}
+
+		stop = FALSE;
+		executed = 0;
+		if (!robot_vm_run_for(job->vm, self->priv->slice, &executed, &stop, &job->error)) {
+			job->executed += executed;
+			finish(self, job);
+			continue;
+		}
+		job->executed += executed;
+
+		if (stop) {
+			finish(self, job);
+		} else if (robot_vm_is_pending(job->vm)) {
+			/* Nothing would resume it: */
+			g_set_error(&job->error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "VM of pool is suspended");
+			finish(self, job);
+		} else if (at_ext(job->vm)) {
+			/* VM stopped before EXT. Park it, callback could block: */
+			g_thread_pool_push(self->priv->ext, job, NULL);
+		} else {
+			push(self, w, job);
+		}
+	}
+
+	return NULL;
+}
+
+gboolean robot_vm_pool_run(RobotVMPool *self, GError **error)
+{
+	guint i, n = 0;
+	Job *job;
+
+	self->priv->ext = g_thread_pool_new(ext_main, self, self->priv->n_workers * EXT_THREADS, FALSE, error);
+	if (!self->priv->ext)
+		return FALSE;
+
+	/* Distribute new VMs between workers: */
+	for (i = 0; i < self->priv->jobs->len; i++) {
+		job = g_ptr_array_index(self->priv->jobs, i);
+		if (job->done)
+			continue;
+
+		g_queue_push_tail(&self->priv->workers[n % self->priv->n_workers].queue, job);
+		++n;
+	}
+	self->priv->queued = n;
+	self->priv->remaining = n;
+
+	for (i = 0; i < self->priv->n_workers; i++) {
+		self->priv->workers[i].thread = g_thread_new("robot-vm-pool", worker_main, &self->priv->workers[i]);
+	}
+	for (i = 0; i < self->priv->n_workers; i++) {
+		g_thread_join(self->priv->workers[i].thread);
+		self->priv->workers[i].thread = NULL;
+	}
+
+	g_thread_pool_free(self->priv->ext, FALSE, TRUE);
+	self->priv->ext = NULL;
+
+	return TRUE;
+}
+
+gboolean robot_vm_pool_get_result(RobotVMPool *self, guint idx, RobotVMWord *exit_code, guint64 *executed, GError **error)
+{
+	Job *job;
+
+	if (idx >= self->priv->jobs->len) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid VM index: %u", idx);
+		return FALSE;
+	}
+	job = g_ptr_array_index(self->priv->jobs, idx);
+
+	if (executed)
+		*executed = job->executed;
+
+	if (job->error) {
+		g_propagate_error(error, g_error_copy(job->error));
+		return FALSE;
+	}
+
+	if (exit_code)
+		*exit_code = robot_vm_get_exit_code(job->vm);
+
+	return TRUE;
+}
@@ -0,0 +1,58 @@
+#ifndef _ROBOT_VM_POOL_H_
+#define _ROBOT_VM_POOL_H_ 1
+
+#include <glib-object.h>
+#include "robot_vm.h"
+
+G_BEGIN_DECLS
+
+/* Type conversion macroses: */
+#define ROBOT_TYPE_VM_POOL                   (robot_vm_pool_get_type())
+#define ROBOT_VM_POOL(obj)                   (G_TYPE_CHECK_INSTANCE_CAST((obj),  ROBOT_TYPE_VM_POOL, RobotVMPool))
+#define ROBOT_IS_VM_POOL(obj)                (G_TYPE_CHECK_INSTANCE_TYPE ((obj), ROBOT_TYPE_VM_POOL))
+#define ROBOT_VM_POOL_CLASS(klass)           (G_TYPE_CHECK_CLASS_CAST ((klass),  ROBOT_TYPE_VM_POOL, RobotVMPoolClass))
+#define ROBOT_IS_VM_POOL_CLASS(klass)        (G_TYPE_CHECK_CLASS_TYPE ((klass),  ROBOT_TYPE_VM_POOL))
+#define ROBOT_VM_POOL_GET_CLASS(obj)         (G_TYPE_INSTANCE_GET_CLASS ((obj),  ROBOT_TYPE_VM_POOL, RobotVMPoolClass))
+
+/* get_type prototype: */
+GType robot_vm_pool_get_type(void);
+
+/* Structures definitions: */
+typedef struct _RobotVMPool RobotVMPool;
+typedef struct _RobotVMPoolClass RobotVMPoolClass;
+typedef struct _RobotVMPoolPrivate RobotVMPoolPrivate;
+
+/* Pool runs many loaded VMs on several worker threads. Every worker has own
+ * run queue and steals VMs from queues of others when its queue is empty.
+ * VMs are executed by slices of robot_vm_run_for(). EXT instructions are
+ * executed by separate threads, so VM is parked while callback blocks and
+ * workers keep running other VMs. Callbacks of one VM are never called
+ * concurrently, but callbacks of different VMs are. */
+struct _RobotVMPool {
+	GObject parent_instance;
+
+	RobotVMPoolPrivate *priv;
+};
+
+struct _RobotVMPoolClass {
+	GObjectClass parent_class;
+};
+
+/* Create pool with n_threads workers (0 - one per processor): */
+RobotVMPool* robot_vm_pool_new(guint n_threads);
+
+/* Count of instructions executed by VM before it is moved to the end of queue: */
+void robot_vm_pool_set_slice(RobotVMPool *self, guint64 slice);
+
+/* Add loaded VM to pool. Returns index of VM for robot_vm_pool_get_result(): */
+guint robot_vm_pool_add(RobotVMPool *self, RobotVM *vm);
+
+/* Run all added VMs until they stop or fail: */
+gboolean robot_vm_pool_run(RobotVMPool *self, GError **error);
+
+/* Result of VM after robot_vm_pool_run(). Returns FALSE and error of VM if it failed: */
+gboolean robot_vm_pool_get_result(RobotVMPool *self, guint idx, RobotVMWord *exit_code, guint64 *executed, GError **error);
+
+G_END_DECLS
+
+#endif /* ROBOT_VM_POOL_H */
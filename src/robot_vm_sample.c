@@ -0,0 +1,109 @@
+#include "robot.h"
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_SETITIMER
+# include <signal.h>
+# include <sys/time.h>
+#endif
+
+/* Sampling profiler. Timer of process CPU time sends SIGPROF, handler stores
+ * R0 of sampled VM into preallocated buffer. Slot of buffer is taken by atomic
+ * increment, so handler takes no locks and doesn't allocate. Only one VM of
+ * process is sampled at a time as the timer is process wide. */
+#ifdef HAVE_SETITIMER
+static RobotVM * volatile sampled = NULL;
+static RobotVMWord *samples = NULL;
+static guint max_samples = 0;
+static gint n_samples = 0;
+static struct sigaction old_action;
+
+static void on_sample(int sig)
+{
+	RobotVM *vm = sampled;
+	gint i;
+
+	if (!vm)
+		return;
+
+	i = g_atomic_int_add(&n_samples, 1);
+	if (i >= 0 && (guint)i < max_samples)
+		samples[i] = vm->R[0];
+}
+#endif
+
+gboolean robot_vm_start_sampling(RobotVM *self, guint hz, guint max, GError **error)
+{
+#ifdef HAVE_SETITIMER
+	struct sigaction action;
+	struct itimerval timer;
+
+	if (sampled) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Other VM is sampled already");
+		return FALSE;
+	}
+	if (!hz || hz > 1000000 || !max) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Invalid sampling rate or buffer size");
+		return FALSE;
+	}
+
+	samples = g_new(RobotVMWord, max);
+	max_samples = max;
+	g_atomic_int_set(&n_samples, 0);
+	sampled = g_object_ref(self);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+
+	if (sigaction(SIGPROF, &action, &old_action) || setitimer(ITIMER_PROF, &timer, NULL)) {
+		g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Can't start sampling timer `%s'", strerror(errno));
+		sigaction(SIGPROF, &old_action, NULL);
+		g_object_unref(sampled);
+		sampled = NULL;
+		g_free(samples);
+		samples = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+#else
+	g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_GENERAL, "Sampling is not supported on this system");
+	return FALSE;
+#endif
+}
+
+GArray* robot_vm_stop_sampling(RobotVM *self, guint *dropped)
+{
+#ifdef HAVE_SETITIMER
+	struct itimerval timer;
+	GArray *res;
+	guint n;
+
+	if (!sampled || sampled != self)
+		return NULL;
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &old_action, NULL);
+	sampled = NULL;
+
+	n = g_atomic_int_get(&n_samples);
+	if (dropped)
+		*dropped = n > max_samples? n - max_samples: 0;
+	n = MIN(n, max_samples);
+
+	res = g_array_sized_new(FALSE, FALSE, sizeof(RobotVMWord), n);
+	g_array_append_vals(res, samples, n);
+	g_free(samples);
+	samples = NULL;
+	g_object_unref(self);
+
+	return res;
+#else
+	return NULL;
+#endif
+}
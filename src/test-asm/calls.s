@@ -0,0 +1,40 @@
+# Benchmark of calls: recursive Fibonacci number, every call is CALL/RET pair.
+# Result is exit code.
+
+.stack 4096
+.text
+
+load r5
+const 1
+load r2
+const 27
+call
+const @fib
+stop r3
+
+# Function fib: r2 - argument, r3 - result, r4 is changed
+:fib
+rshift r4 r2 r5
+jnz r4 @recurse
+move r3 r2
+ret
+
+:recurse
+# Save argument
+decr4 r1
+write32 r2 r1
+subi r2 r2 1
+call
+const @fib
+read32 r2 r1
+# Save fib(n - 1)
+decr4 r1
+write32 r3 r1
+subi r2 r2 2
+call
+const @fib
+read32 r4 r1
+incr4 r1
+incr4 r1
+add r3 r3 r4
+ret
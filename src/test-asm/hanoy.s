@@ -27,10 +27,7 @@ incr r2
 load r0
 const @print_string
 :exit_print_string
-# return
-read32 r2 r1
-incr4 r1
-move r0 r2
+ret
 
 # Function hanoy (arguments on stack)
 :hanoy
@@ -46,9 +43,7 @@ incr4 r1
 incr4 r1
 incr4 r1
 incr4 r1
-read32 r2 r1
-incr4 r1
-move r0 r2
+ret
 
 :real_start
 
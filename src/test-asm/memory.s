@@ -0,0 +1,54 @@
+# Benchmark of memory access: copy buffer word by word and byte by byte
+# many times. Run it with and without --masked to compare memory modes.
+
+.text
+
+load r2
+const 100000
+load r6
+const @outer
+load r7
+const @inner
+load r8
+const @done
+load r9
+const 64
+
+:outer
+moveifz r0 r8 r2
+load r3
+const @src
+load r4
+const @dst
+move r5 r9
+
+:inner
+read32 r10 r3
+write32 r10 r4
+read8 r11 r3
+write8 r4 r11
+read16 r11 r3
+write16 r4 r11
+incr4 r3
+incr4 r4
+decr r5
+moveif r0 r7 r5
+decr r2
+move r0 r6
+
+:done
+load r3
+const @dst
+read8 r10 r3
+out r10
+load r10
+const 10
+out r10
+xor r4 r4 r4
+stop r4
+
+# .data
+:src
+"ABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGH"
+:dst
+"ABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGH"
@@ -0,0 +1,79 @@
+/* Test of RobotVM block memory instructions. Program copies, fills and
+ * compares strings, results are checked in its registers. At the end it fills
+ * block crossing the end of address space: strict memory faults there and
+ * masked one wraps the block. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *program =
+	".text\n"
+	"load r2\nconst @src\nload r3\nconst @dst\n"
+	/* r4 - length, r5 - length with zero: */
+	"strlen r4 r2\nmove r5 r4\nincr r5\n"
+	"memcpy r3 r2 r5\nmove r6 r3\nmemcmp r6 r2 r5\n"
+	/* dst is "Hello, world" now: */
+	"load r7\nconst 72\nload r8\nconst 1\nmemset r3 r7 r8\n"
+	"move r9 r3\nmemcmp r9 r2 r5\nmove r10 r2\nmemcmp r10 r3 r5\n"
+	/* Overlapping copy, dst is "HHell, world": */
+	"move r11 r3\nincr r11\nload r12\nconst 4\nmemcpy r11 r3 r12\nread32 r11 r3\n"
+	/* Block of 4 bytes at the end of address space, string from it has 4 bytes in masked memory: */
+	"load r12\nconst 0xfffffffe\nload r13\nconst 4\nmemset r12 r7 r13\nstrlen r14 r12\n"
+	"xor r15 r15 r15\nstop r15\n"
+	":src\n\"hello, world\"\n"
+	":dst\n{ ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff }\n";
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	RobotVMWord expected[] = { 12, 13, 0, 72, 1, (RobotVMWord)-1, 1, 0x4848656c, 0xfffffffe, 4, 4 };
+	GError *error = NULL;
+	RobotVM *vm;
+	gboolean masked, ok;
+	int res = 0;
+	guint i, n;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	for (masked = 0; masked < 2; masked++) {
+		vm = robot_vm_new();
+		if (masked)
+			robot_vm_set_memory_mode(vm, ROBOT_VM_MEMORY_MASKED);
+		robot_vm_allocate_memory(vm, 0x10000);
+		if (!robot_vm_load(vm, obj, &error)) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+
+		/* Strict memory faults before strlen r14: */
+		ok = robot_vm_exec(vm, &error);
+		if (masked? ok: g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT)) {
+			n = G_N_ELEMENTS(expected) - (masked? 0: 1);
+		} else {
+			fprintf(stderr, "%s: unexpected result `%s'\n", masked? "masked": "strict", error? error->message: "");
+			n = 0;
+			res = 1;
+		}
+		g_clear_error(&error);
+
+		for (i = 0; i < n; i++) {
+			if (vm->R[4 + i] != expected[i]) {
+				fprintf(stderr, "%s: R%u: %x != %x\n", masked? "masked": "strict", 4 + i,
+						(unsigned)vm->R[4 + i], (unsigned)expected[i]);
+				res = 1;
+			}
+		}
+
+		g_object_unref(vm);
+	}
+
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
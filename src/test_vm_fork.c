@@ -0,0 +1,101 @@
+/* Test of snapshot and fork. Program writes a word and stops at checkpoint,
+ * then passes the word through %twice and writes the result back. Fork of the
+ * snapshot replaces %twice and adds a function, neither its memory nor its
+ * functions may reach the original VM. */
+#include "robot.h"
+#include <stdio.h>
+
+#define ADDR 0x20000
+
+static const char *program =
+	".text\n"
+	"load r2\nconst 0x20000\nload r3\nconst 21\nwrite32 r3 r2\n"
+	"load r12\nconst 1\nstop r12\n"
+	/* After checkpoint: */
+	"read32 r5 r2\n"
+	"decr4 r1\nwrite32 r5 r1\nload r3\nconst %twice\next r3\nread32 r5 r1\nincr4 r1\n"
+	"write32 r5 r2\nstop r5\n";
+
+static gboolean twice(RobotVM *vm, gpointer userdata, GError **error)
+{
+	RobotVMWord w;
+
+	return robot_vm_stack_pop_word(vm, &w, error) && robot_vm_stack_push_word(vm, w * 2, error);
+}
+
+static gboolean thrice(RobotVM *vm, gpointer userdata, GError **error)
+{
+	RobotVMWord w;
+
+	return robot_vm_stack_pop_word(vm, &w, error) && robot_vm_stack_push_word(vm, w * 3, error);
+}
+
+static void free_counted(gpointer userdata)
+{
+	++*(guint*)userdata;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	GError *error = NULL;
+	RobotVMSnapshot *snapshot;
+	RobotVM *vm, *forked;
+	RobotVMWord w;
+	guint freed = 0;
+	int res = 0;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	vm = robot_vm_new();
+	robot_vm_add_function(vm, "twice", twice, &freed, free_counted);
+	robot_vm_allocate_memory(vm, 0x100000);
+	if (!robot_vm_load(vm, obj, &error) || !robot_vm_exec(vm, &error) ||
+			!(snapshot = robot_vm_snapshot(vm, &error)) || !(forked = robot_vm_fork(snapshot, &error))) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	/* Replaced userdata is owned by the original VM: */
+	robot_vm_add_function(forked, "twice", thrice, NULL, NULL);
+	robot_vm_add_function(forked, "probe", twice, NULL, NULL);
+	if (freed || robot_vm_has_function(vm, "probe") || !robot_vm_has_function(forked, "probe")) {
+		fprintf(stderr, "Functions of fork reach the original, userdata freed %u times\n", freed);
+		res = 1;
+	}
+
+	if (!robot_vm_exec(forked, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_exit_code(forked) != 63 || !robot_vm_read_word(vm, ADDR, &w, NULL) || w != 21) {
+		fprintf(stderr, "Fork: exit code %u, original has %u\n", (unsigned)robot_vm_get_exit_code(forked), (unsigned)w);
+		res = 1;
+	}
+
+	if (!robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_exit_code(vm) != 42 || !robot_vm_read_word(forked, ADDR, &w, NULL) || w != 63) {
+		fprintf(stderr, "Original: exit code %u, fork has %u\n", (unsigned)robot_vm_get_exit_code(vm), (unsigned)w);
+		res = 1;
+	}
+
+	g_object_unref(forked);
+	robot_vm_snapshot_unref(snapshot);
+	g_object_unref(vm);
+	if (freed != 1) {
+		fprintf(stderr, "Userdata freed %u times\n", freed);
+		res = 1;
+	}
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
@@ -0,0 +1,198 @@
+/* Test of VM hooks and breakpoints. Step hook must be called once for every
+ * executed instruction, also when it suspends VM in the middle of the loop, and
+ * write hook must get every write of program. Breakpoints at the start of the
+ * loop and at move of fused jump must stop VM at every iteration. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SUSPEND_STEP 10
+
+static const char *program =
+	".text\n"
+	"load r2\nconst 0x8000\nload r3\nconst 5\n"
+	":loop\n"
+	"write32 r3 r2\nincr4 r2\ndecr r3\nload r11\nconst @loop\n"
+	":branch\n"
+	"moveif r0 r11 r3\n"
+	"load r4\nconst 8\nmemset r2 r3 r4\n"
+	"stop r3\n";
+
+typedef struct _Hooked {
+	guint steps;
+	RobotVMWord suspended;  /* Address at which step hook suspended VM */
+	GArray *writes;         /* Pairs of address and length */
+} Hooked;
+
+static gboolean step(RobotVM *vm, RobotVMWord pc, gpointer userdata, GError **error)
+{
+	Hooked *hooked = userdata;
+
+	if (++hooked->steps == SUSPEND_STEP) {
+		hooked->suspended = pc;
+		robot_vm_suspend(vm);
+	}
+
+	return TRUE;
+}
+
+/* Breakpoint hook which doesn't stop VM: */
+static gboolean count_break(RobotVM *vm, RobotVMWord pc, gpointer userdata, GError **error)
+{
+	++*(guint*)userdata;
+
+	return TRUE;
+}
+
+static gboolean write(RobotVM *vm, RobotVMWord addr, RobotVMWord len, gpointer userdata, GError **error)
+{
+	Hooked *hooked = userdata;
+
+	g_array_append_val(hooked->writes, addr);
+	g_array_append_val(hooked->writes, len);
+
+	return TRUE;
+}
+
+static RobotVMWord label(RobotObjFile *obj, RobotVM *vm, const char *name)
+{
+	RobotObjFileSymbol *sym;
+	guint i;
+
+	for (i = 0; i < obj->sym->len; i++) {
+		sym = &g_array_index(obj->sym, RobotObjFileSymbol, i);
+		if (!strcmp(sym->name, name))
+			return vm->R[1] + sym->addr;
+	}
+
+	return 0;
+}
+
+/* Run program with breakpoints, VM waits at them unless hook is set: */
+static int test_breaks(RobotObjFile *obj, gboolean hook)
+{
+	RobotVMHooks hooks = { NULL, NULL, count_break };
+	RobotVMWord breaks[2];
+	GError *error = NULL;
+	guint hits = 0;
+	RobotVM *vm;
+	int res = 0;
+
+	vm = robot_vm_new();
+	if (hook)
+		robot_vm_set_hooks(vm, &hooks, &hits);
+	robot_vm_allocate_memory(vm, 0x10000);
+	if (!robot_vm_load(vm, obj, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	breaks[0] = label(obj, vm, "loop");
+	breaks[1] = label(obj, vm, "branch");
+	robot_vm_set_breakpoint(vm, breaks[0]);
+	robot_vm_set_breakpoint(vm, breaks[1]);
+
+	for (;;) {
+		if (!robot_vm_exec(vm, &error)) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+		if (!robot_vm_is_pending(vm))
+			break;
+		if (vm->R[0] != breaks[hits++ & 1]) {
+			fprintf(stderr, "VM waits at %x\n", (unsigned)vm->R[0]);
+			res = 1;
+			break;
+		}
+		robot_vm_resume(vm, NULL);
+	}
+
+	if (hits != 10 || vm->R[2] != 0x8014) {
+		fprintf(stderr, "%s: %u breakpoints, R2 = %x\n", hook? "hook": "suspend", hits, (unsigned)vm->R[2]);
+		res = 1;
+	}
+
+	g_object_unref(vm);
+
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	RobotVMHooks hooks = { step, write, NULL };
+	RobotVMWord expected[] = { 0x8000, 4, 0x8004, 4, 0x8008, 4, 0x800c, 4, 0x8010, 4, 0x8014, 8 };
+	Hooked hooked = { 0, 0, NULL };
+	GError *error = NULL;
+	guint64 executed;
+	gboolean stop;
+	RobotVM *vm;
+	int res = 0;
+	guint i;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	/* Count of instructions without hooks: */
+	vm = robot_vm_new();
+	robot_vm_allocate_memory(vm, 0x10000);
+	if (!robot_vm_load(vm, obj, &error) ||
+			!robot_vm_run_for(vm, G_MAXUINT64, &executed, &stop, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	g_object_unref(vm);
+
+	hooked.writes = g_array_new(FALSE, FALSE, sizeof(RobotVMWord));
+	vm = robot_vm_new();
+	robot_vm_set_hooks(vm, &hooks, &hooked);
+	robot_vm_allocate_memory(vm, 0x10000);
+	if (!robot_vm_load(vm, obj, &error) || !robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	/* VM waits before the instruction: */
+	if (!robot_vm_is_pending(vm) || vm->R[0] != hooked.suspended) {
+		fprintf(stderr, "VM is not suspended at %x\n", (unsigned)hooked.suspended);
+		res = 1;
+	}
+	robot_vm_resume(vm, NULL);
+	if (!robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	if (hooked.steps != executed) {
+		fprintf(stderr, "%u steps of %u instructions\n", hooked.steps, (unsigned)executed);
+		res = 1;
+	}
+	if (hooked.writes->len != G_N_ELEMENTS(expected)) {
+		fprintf(stderr, "%u writes\n", hooked.writes->len / 2);
+		res = 1;
+	} else {
+		for (i = 0; i < hooked.writes->len; i += 2) {
+			if (g_array_index(hooked.writes, RobotVMWord, i) != expected[i] ||
+					g_array_index(hooked.writes, RobotVMWord, i + 1) != expected[i + 1]) {
+				fprintf(stderr, "Write %u: %x %u\n", i / 2, (unsigned)g_array_index(hooked.writes, RobotVMWord, i),
+						(unsigned)g_array_index(hooked.writes, RobotVMWord, i + 1));
+				res = 1;
+			}
+		}
+	}
+
+	g_array_unref(hooked.writes);
+	g_object_unref(vm);
+
+	if (test_breaks(obj, FALSE) || test_breaks(obj, TRUE))
+		res = 1;
+
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
@@ -0,0 +1,291 @@
+/* Differential test of RobotVM compiler of hot blocks. Random programs with
+ * hot loops are executed with JIT and without it, results must be the same:
+ * registers, memory, count of executed instructions and errors. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGRAMS 300
+#define MEMORY 0x10000
+
+/* Registers: r2 - loop counter, r11, r12 - temporary, r13 - loop address,
+ * r14 - mask of buffer, r15 - buffer at the bottom of memory: */
+#define DST() g_rand_int_range(rnd, 3, 11)
+#define SRC() g_rand_int_range(rnd, 0, 16)
+
+static const char *binary[] = { "lshift", "rshift", "sshift", "and", "or", "xor", "add", "sub", "mul" };
+static const char *unary[] = { "neg", "move" };
+static const char *cond[] = { "moveif", "moveifz" };
+static const char *incr[] = { "incr", "decr", "incr4", "decr4" };
+static const char *imm[] = { "addi", "subi", "andi" };
+static const char *branch[] = { "jz", "jnz" };
+
+#define PICK(a) a[g_rand_int_range(rnd, 0, G_N_ELEMENTS(a))]
+
+/* Items of called function don't call it again: */
+static gboolean in_sub;
+
+static gboolean mix(RobotVM *vm, gpointer userdata, GError **error)
+{
+	vm->R[3] ^= vm->R[4] * 2654435761u;
+	return robot_vm_write_word(vm, 0x100, vm->R[3], error);
+}
+
+static void gen_item(GRand *rnd, GString *s, guint *label)
+{
+	guint l;
+
+	switch (g_rand_int_range(rnd, 0, 16)) {
+		case 0:
+		case 1:
+			g_string_append_printf(s, "%s r%d r%d r%d\n", PICK(binary), DST(), SRC(), SRC());
+			break;
+
+		case 2:
+			g_string_append_printf(s, "%s r%d r%d\n", PICK(unary), DST(), SRC());
+			break;
+
+		case 3:
+			g_string_append_printf(s, "%s r%d r%d r%d\n", PICK(cond), DST(), SRC(), SRC());
+			break;
+
+		case 4:
+			g_string_append_printf(s, "%s r%d\n", PICK(incr), DST());
+			break;
+
+		case 5:
+			g_string_append_printf(s, "swap r%d r%d\n", DST(), DST());
+			break;
+
+		case 6:
+			g_string_append_printf(s, "load r%d\nconst %u\n", DST(), g_rand_int(rnd));
+			break;
+
+		case 7:
+			g_string_append_printf(s, "and r11 r%d r14\nadd r11 r11 r15\n", SRC());
+			switch (g_rand_int_range(rnd, 0, 3)) {
+				case 0: g_string_append_printf(s, "read8 r%d r11\n", DST()); break;
+				case 1: g_string_append_printf(s, "read16 r%d r11\n", DST()); break;
+				case 2: g_string_append_printf(s, "read32 r%d r11\n", DST()); break;
+			}
+			break;
+
+		case 8:
+			g_string_append_printf(s, "and r11 r%d r14\nadd r11 r11 r15\n", SRC());
+			switch (g_rand_int_range(rnd, 0, 3)) {
+				case 0: g_string_append_printf(s, "write8 r11 r%d\n", SRC()); break;
+				case 1: g_string_append_printf(s, "write16 r11 r%d\n", SRC()); break;
+				case 2: g_string_append_printf(s, "write32 r%d r11\n", SRC()); break;
+			}
+			break;
+
+		case 9:
+			g_string_append_printf(s, "load r12\nconst %u\ndiv r%d r%d r12\n", g_rand_int_range(rnd, 1, 1000), DST(), SRC());
+			break;
+
+		case 10:
+			g_string_append(s, "load r12\nconst %mix\next r12\n");
+			break;
+
+		case 11:
+			/* Conditional jump over the next item: */
+			l = (*label)++;
+			g_string_append_printf(s, "load r12\nconst @l%u\n%s r0 r12 r%d\n", l, PICK(cond), SRC());
+			gen_item(rnd, s, label);
+			g_string_append_printf(s, ":l%u\n", l);
+			break;
+
+		case 12:
+			/* Instruction after write is toggled between incr r3 and nop: */
+			l = (*label)++;
+			g_string_append_printf(s, "load r11\nconst 1\nand r11 r2 r11\nload r12\nconst %u\n"
+					"moveifz r12 r11 r11\nload r11\nconst @l%u\nwrite32 r12 r11\n",
+					(ROBOT_VM_INCR << 24) | (3 << 16), l);
+			g_string_append_printf(s, ":l%u\nincr r3\n", l);
+			break;
+
+		case 13:
+			g_string_append_printf(s, "%s r%d r%d %u\n", PICK(imm), DST(), SRC(), g_rand_int_range(rnd, 0, 256));
+			break;
+
+		case 14:
+			/* Relative branch over the next item: */
+			l = (*label)++;
+			g_string_append_printf(s, "%s r%d @l%u\n", PICK(branch), SRC(), l);
+			gen_item(rnd, s, label);
+			g_string_append_printf(s, ":l%u\n", l);
+			break;
+
+		case 15:
+			if (!in_sub)
+				g_string_append(s, "call\nconst @sub\n");
+			break;
+	}
+}
+
+static gchar* gen_program(GRand *rnd)
+{
+	GString *s = g_string_new(".text\nload r14\nconst 255\nload r15\nconst 256\n");
+	guint label = 0;
+	guint loops = g_rand_int_range(rnd, 1, 4);
+	guint i, j, n;
+
+	for (i = 0; i < loops; i++) {
+		g_string_append_printf(s, "load r2\nconst %u\nload r13\nconst @loop%u\n:loop%u\n",
+				g_rand_int_range(rnd, 1, 2000), i, i);
+
+		n = g_rand_int_range(rnd, 1, 40);
+		for (j = 0; j < n; j++) {
+			gen_item(rnd, s, &label);
+		}
+
+		g_string_append(s, "decr r2\n");
+		switch (g_rand_int_range(rnd, 0, 3)) {
+			case 0: g_string_append_printf(s, "load r12\nconst @loop%u\nmoveif r0 r12 r2\n", i); break;
+			case 1: g_string_append(s, "moveif r0 r13 r2\n"); break;
+			case 2: g_string_append_printf(s, "jnz r2 @loop%u\n", i); break;
+		}
+	}
+
+	/* Some programs fail: */
+	if (g_rand_int_range(rnd, 0, 8) == 0)
+		g_string_append_printf(s, "load r11\nconst %u\nread32 r3 r11\n", g_rand_int_range(rnd, MEMORY - 8, MEMORY * 4));
+
+	g_string_append(s, "stop r3\n");
+
+	/* Function called by items: */
+	g_string_append(s, ":sub\n");
+	in_sub = TRUE;
+	n = g_rand_int_range(rnd, 1, 5);
+	for (j = 0; j < n; j++) {
+		gen_item(rnd, s, &label);
+	}
+	in_sub = FALSE;
+	g_string_append(s, "ret\n");
+
+	return g_string_free(s, FALSE);
+}
+
+static RobotVM* new_vm(RobotObjFile *obj, gboolean masked, gboolean jit)
+{
+	RobotVM *vm = robot_vm_new();
+	GError *error = NULL;
+
+	robot_vm_add_function(vm, "mix", mix, NULL, NULL);
+	if (masked)
+		robot_vm_set_memory_mode(vm, ROBOT_VM_MEMORY_MASKED);
+	robot_vm_set_jit_enabled(vm, jit);
+	robot_vm_allocate_memory(vm, MEMORY);
+
+	if (!robot_vm_load(vm, obj, &error)) {
+		fprintf(stderr, "Error: can't load program `%s'\n", error->message);
+		exit(1);
+	}
+
+	return vm;
+}
+
+/* Run VM by slices of random size (0 - without limit). Returns error message or NULL: */
+static gchar* run(RobotVM *vm, GRand *rnd, guint64 *total)
+{
+	GError *error = NULL;
+	gboolean stop = FALSE;
+	guint64 executed;
+	guint64 slice;
+	gchar *msg;
+
+	*total = 0;
+	while (!stop) {
+		slice = rnd? (guint64)g_rand_int_range(rnd, 1, 5000): G_MAXUINT64;
+		executed = 0;
+		if (!robot_vm_run_for(vm, slice, &executed, &stop, &error)) {
+			*total += executed;
+			msg = g_strdup(error->message);
+			g_error_free(error);
+			return msg;
+		}
+		*total += executed;
+	}
+
+	return NULL;
+}
+
+static gboolean compare(RobotVM *a, RobotVM *b)
+{
+	static guint8 ma[MEMORY], mb[MEMORY];
+	guint i;
+
+	for (i = 0; i < 32; i++) {
+		if (a->R[i] != b->R[i]) {
+			fprintf(stderr, "R%u: %08x != %08x\n", i, (unsigned)a->R[i], (unsigned)b->R[i]);
+			return FALSE;
+		}
+	}
+
+	if (robot_vm_get_exit_code(a) != robot_vm_get_exit_code(b)) {
+		fprintf(stderr, "exit code: %u != %u\n", (unsigned)robot_vm_get_exit_code(a), (unsigned)robot_vm_get_exit_code(b));
+		return FALSE;
+	}
+
+	robot_vm_read_memory(a, 0, ma, MEMORY, NULL);
+	robot_vm_read_memory(b, 0, mb, MEMORY, NULL);
+	if (memcmp(ma, mb, MEMORY)) {
+		fprintf(stderr, "memory differs\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	GRand *rnd = g_rand_new_with_seed(argc > 1? atoi(argv[1]): 1);
+	GError *error = NULL;
+	RobotObjFile *obj;
+	RobotVM *a, *b;
+	gchar *prog;
+	gchar *ea, *eb;
+	guint64 ta, tb;
+	guint blocks = 0;
+	guint i, masked;
+
+	for (i = 0; i < PROGRAMS; i++) {
+		prog = gen_program(rnd);
+		obj = robot_obj_file_new();
+		if (!robot_obj_file_compile(obj, prog, &error)) {
+			fprintf(stderr, "Error: can't compile program `%s'\n%s", error->message, prog);
+			return 1;
+		}
+
+		for (masked = 0; masked < 2; masked++) {
+			a = new_vm(obj, masked, FALSE);
+			b = new_vm(obj, masked, TRUE);
+
+			ea = run(a, NULL, &ta);
+			eb = run(b, rnd, &tb);
+			blocks += robot_vm_get_jit_count(b);
+
+			if (g_strcmp0(ea, eb) || ta != tb || !compare(a, b)) {
+				fprintf(stderr, "Program %u (%s memory) differs: `%s' != `%s', %" G_GUINT64_FORMAT
+						" != %" G_GUINT64_FORMAT " instructions\n%s",
+						i, masked? "masked": "strict", ea? ea: "", eb? eb: "", ta, tb, prog);
+				return 1;
+			}
+
+			g_free(ea);
+			g_free(eb);
+			g_object_unref(a);
+			g_object_unref(b);
+		}
+
+		g_object_unref(obj);
+		g_free(prog);
+	}
+
+	printf("%u programs, %u compiled blocks: OK\n", PROGRAMS, blocks);
+	g_rand_free(rnd);
+
+	/* Nothing compiled means JIT is not tested at all: */
+	return blocks? 0: 1;
+}
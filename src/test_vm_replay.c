@@ -0,0 +1,193 @@
+/* Test of record and replay. Program sums its input and results of function
+ * %random, which suspends every other call. Replaying VM gets other input and
+ * function which fails, but it must get the same results without suspending. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *program =
+	".text\n"
+	"xor r5 r5 r5\n"
+	":read\n"
+	"in r2\nmove r3 r2\nincr r3\n"
+	"load r11\nconst @random\nmoveifz r0 r11 r3\n"
+	"add r5 r5 r2\nload r11\nconst @read\nmove r0 r11\n"
+	":random\n"
+	"load r6\nconst 10\n"
+	":loop\n"
+	"decr4 r1\nwrite32 r6 r1\n"
+	"load r3\nconst %random\next r3\n"
+	"read32 r4 r1\nincr4 r1\n"
+	"add r5 r5 r4\ndecr r6\n"
+	"load r11\nconst @loop\nmoveif r0 r11 r6\n"
+	"stop r5\n";
+
+/* End of input and call of %random which writes 4 bytes at 0x100000000: */
+static const guint8 bad_log[] = {
+	'R', 'V', 'M', 'R', 'I', 0,
+	'E', 1, 0, 1, 0x80, 0x80, 0x80, 0x80, 0x10, 4, 0xde, 0xad, 0xbe, 0xef
+};
+
+typedef struct _Random {
+	RobotVMWord state;
+	RobotVMWord pending;    /* Result of suspended call */
+} Random;
+
+/* Result depends on argument and state of generator, the count of calls is in R7: */
+static gboolean random_word(RobotVM *vm, gpointer userdata, GError **error)
+{
+	Random *random = userdata;
+	RobotVMWord arg;
+
+	if (!robot_vm_stack_pop_word(vm, &arg, error))
+		return FALSE;
+
+	random->state = random->state * 1103515245 + 12345;
+	++vm->R[7];
+	if (arg & 1) {
+		random->pending = (random->state >> 16) ^ arg;
+		robot_vm_suspend(vm);
+		return TRUE;
+	}
+
+	return robot_vm_stack_push_word(vm, (random->state >> 16) ^ arg, error);
+}
+
+static gboolean not_replayed(RobotVM *vm, gpointer userdata, GError **error)
+{
+	g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT, "Function is called in replay");
+
+	return FALSE;
+}
+
+static RobotVM* new_vm(RobotObjFile *obj, const char *input, RobotVMFunc func, gpointer userdata)
+{
+	GError *error = NULL;
+	RobotVM *vm;
+
+	vm = robot_vm_new();
+	robot_vm_add_function(vm, "random", func, userdata, NULL);
+	robot_vm_set_input_data(vm, input, strlen(input));
+	robot_vm_allocate_memory(vm, 0x10000);
+	if (!robot_vm_load(vm, obj, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		exit(1);
+	}
+
+	return vm;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	Random random = { 1, 0 };
+	GError *error = NULL;
+	gchar *log;
+	RobotVM *vm;
+	RobotVMWord exit_code, calls, w;
+	guint suspended = 0;
+	int res = 0, fd;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	fd = g_file_open_tmp("test_vm_replay_XXXXXX", &log, &error);
+	if (fd < 0) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	close(fd);
+
+	vm = new_vm(obj, "hello", random_word, &random);
+	if (!robot_vm_start_recording(vm, log, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	for (;;) {
+		if (!robot_vm_exec(vm, &error)) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+		if (!robot_vm_is_pending(vm))
+			break;
+		++suspended;
+		robot_vm_resume_word(vm, random.pending);
+	}
+	if (!robot_vm_stop_recording(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	exit_code = robot_vm_get_exit_code(vm);
+	calls = vm->R[7];
+	g_object_unref(vm);
+
+	if (suspended != 5 || calls != 10) {
+		fprintf(stderr, "Recorded %u calls, %u suspended\n", (unsigned)calls, suspended);
+		res = 1;
+	}
+
+	vm = new_vm(obj, "other input", not_replayed, NULL);
+	if (!robot_vm_start_replay(vm, log, &error) || !robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_is_pending(vm) || robot_vm_get_exit_code(vm) != exit_code || vm->R[7] != calls) {
+		fprintf(stderr, "Replay: exit code %x != %x, %u calls\n", (unsigned)robot_vm_get_exit_code(vm),
+				(unsigned)exit_code, (unsigned)vm->R[7]);
+		res = 1;
+	}
+
+	/* Log is used up, so the second run doesn't match it: */
+	if (!robot_vm_load(vm, obj, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_exec(vm, &error) || !g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_IO)) {
+		fprintf(stderr, "Run after the end of log: %s\n", error? error->message: "no error");
+		res = 1;
+	}
+	g_clear_error(&error);
+
+	/* Functions are called again after replay: */
+	robot_vm_stop_replay(vm);
+	if (!robot_vm_load(vm, obj, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_exec(vm, &error) || !g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT)) {
+		fprintf(stderr, "Run after replay: %s\n", error? error->message: "no error");
+		res = 1;
+	}
+	g_clear_error(&error);
+	g_object_unref(vm);
+
+	/* Address of written memory out of 32 bits doesn't match program: */
+	if (!g_file_set_contents(log, (const gchar*)bad_log, sizeof(bad_log), &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	vm = new_vm(obj, "", not_replayed, NULL);
+	if (!robot_vm_start_replay(vm, log, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_exec(vm, &error) || !g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_IO) ||
+			!robot_vm_read_word(vm, 0, &w, NULL) || w == 0xdeadbeef) {
+		fprintf(stderr, "Invalid address: %s\n", error? error->message: "no error");
+		res = 1;
+	}
+	g_clear_error(&error);
+	g_object_unref(vm);
+
+	remove(log);
+	g_free(log);
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
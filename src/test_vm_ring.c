@@ -0,0 +1,112 @@
+/* Test of RobotVM syscall ring. Program submits several requests by one call of
+ * %submit and reads completions, results are checked in its registers. It runs
+ * again with %fail which fails without error. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *program =
+	".text\n"
+	/* Entries 0 and 1 call add, entry 2 calls fail, entry 3 has invalid function: */
+	"load r2\nconst %add\nload r11\nconst @e0\nwrite32 r2 r11\n"
+	"load r11\nconst @e1\nwrite32 r2 r11\n"
+	"load r2\nconst %fail\nload r11\nconst @e2\nwrite32 r2 r11\n"
+	"load r2\nconst @args0\nload r11\nconst @e0args\nwrite32 r2 r11\n"
+	"load r2\nconst @args1\nload r11\nconst @e1args\nwrite32 r2 r11\n"
+	/* Submit 4 entries starting from head 2, so the ring wraps: */
+	"load r2\nconst 6\nload r11\nconst @tail\nwrite32 r2 r11\n"
+	"load r10\nconst @ring\ndecr4 r1\nwrite32 r10 r1\n"
+	"load r3\nconst %submit\next r3\n"
+	/* r4, r5 - results of add, r6 - status of fail, r7 - status of invalid, r8 - head: */
+	"load r11\nconst @e0res\nread32 r4 r11\n"
+	"load r11\nconst @e1res\nread32 r5 r11\n"
+	"load r11\nconst @e2status\nread32 r6 r11\n"
+	"load r11\nconst @e3status\nread32 r7 r11\n"
+	"load r11\nconst @head\nread32 r8 r11\n"
+	"xor r9 r9 r9\nstop r9\n"
+	/* Ring is in text: references from text to data don't count padding of text */
+	":ring\n{ 00 00 00 04 }\n:head\n{ 00 00 00 02 }\n:tail\n{ 00 00 00 02 00 00 00 00 }\n"
+	/* Entries 2, 3, 0, 1 of ring: */
+	":e2\n{ 00 00 00 00 00 00 00 00 }\n:e2status\n{ 00 00 00 00 00 00 00 00 }\n"
+	":e3\n{ 00 00 ff ff 00 00 00 00 }\n:e3status\n{ 00 00 00 00 00 00 00 00 }\n"
+	":e0\n{ 00 00 00 00 }\n:e0args\n{ 00 00 00 00 00 00 00 03 }\n:e0res\n{ 00 00 00 00 }\n"
+	":e1\n{ 00 00 00 00 }\n:e1args\n{ 00 00 00 00 00 00 00 03 }\n:e1res\n{ 00 00 00 00 }\n"
+	":args0\n{ 00 00 00 01 00 00 00 02 00 00 00 03 }\n"
+	":args1\n{ 00 00 00 0a 00 00 00 14 00 00 00 00 }\n";
+
+/* Sum of argument words, their count is userdata: */
+static gboolean add(RobotVM *vm, gpointer userdata, GError **error)
+{
+	RobotVMWord w, sum = 0;
+	guint n = GPOINTER_TO_UINT(userdata);
+
+	while (n--) {
+		if (!robot_vm_stack_pop_word(vm, &w, error))
+			return FALSE;
+		sum += w;
+	}
+
+	return robot_vm_stack_push_word(vm, sum, error);
+}
+
+static gboolean fail(RobotVM *vm, gpointer userdata, GError **error)
+{
+	g_set_error(error, ROBOT_ERROR, ROBOT_ERROR_IO, "Failed on purpose");
+	return FALSE;
+}
+
+static gboolean fail_silently(RobotVM *vm, gpointer userdata, GError **error)
+{
+	return FALSE;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	RobotVM *vm;
+	GError *error = NULL;
+	RobotVMWord expected[] = { 6, 30, ROBOT_ERROR_IO, ROBOT_ERROR_INVALID_ADDRESS, 6 };
+	gboolean silent;
+	int res = 0;
+	guint i;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	for (silent = 0; silent < 2; silent++) {
+		vm = robot_vm_new();
+		robot_vm_add_function(vm, "add", add, GUINT_TO_POINTER(3), NULL);
+		robot_vm_add_function(vm, "fail", silent? fail_silently: fail, NULL, NULL);
+		robot_vm_allocate_memory(vm, 0x10000);
+
+		if (!robot_vm_load(vm, obj, &error) || !robot_vm_exec(vm, &error)) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+
+		/* Failure without error is general one: */
+		expected[2] = silent? ROBOT_ERROR_GENERAL: ROBOT_ERROR_IO;
+		for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+			if (vm->R[4 + i] != expected[i]) {
+				fprintf(stderr, "R%u: %u != %u\n", 4 + i, (unsigned)vm->R[4 + i], (unsigned)expected[i]);
+				res = 1;
+			}
+		}
+
+		if (vm->R[1] != obj->SS) {
+			fprintf(stderr, "Stack is not restored: %x != %x\n", (unsigned)vm->R[1], (unsigned)obj->SS);
+			res = 1;
+		}
+
+		g_object_unref(vm);
+	}
+
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
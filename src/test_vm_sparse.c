@@ -0,0 +1,97 @@
+/* Test of sparse memory. Program writes a word near the top of big memory and
+ * stops at checkpoint, then increments the word. Fork of the VM and the VM
+ * moved to heap and back must keep the contents and run the rest of program. */
+#include "robot.h"
+#include <stdio.h>
+
+#define MEMORY 0x10000000
+#define TOP (MEMORY - 16)
+
+static const char *program =
+	".text\n"
+	"load r2\nconst 0xffffff0\nload r3\nconst 0x12345678\nwrite32 r3 r2\n"
+	"load r12\nconst 1\nstop r12\n"
+	/* After checkpoint: */
+	"read32 r5 r2\nincr r5\nwrite32 r5 r2\nstop r5\n";
+
+static gboolean check_word(RobotVM *vm, const char *what, RobotVMWord expected)
+{
+	RobotVMWord w = 0;
+
+	if (robot_vm_read_word(vm, TOP, &w, NULL) && w == expected)
+		return TRUE;
+
+	fprintf(stderr, "%s: %x at the top instead of %x\n", what, (unsigned)w, (unsigned)expected);
+	return FALSE;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	GError *error = NULL;
+	RobotVMSnapshot *snapshot;
+	RobotVM *vm, *forked;
+	int res = 0;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	vm = robot_vm_new();
+	if (!robot_vm_set_memory_backend(vm, ROBOT_VM_MEMORY_SPARSE, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	robot_vm_allocate_memory(vm, MEMORY);
+	if (!robot_vm_load(vm, obj, &error) || !robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_memory_backend(vm) != ROBOT_VM_MEMORY_SPARSE || !check_word(vm, "Sparse", 0x12345678))
+		res = 1;
+
+	/* Fork keeps the backend, its writes and growth don't reach the original: */
+	if (!(snapshot = robot_vm_snapshot(vm, &error)) || !(forked = robot_vm_fork(snapshot, &error))) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_memory_backend(forked) != ROBOT_VM_MEMORY_SPARSE || !check_word(forked, "Fork", 0x12345678))
+		res = 1;
+	robot_vm_write_word(forked, TOP, 0x100, NULL);
+	robot_vm_allocate_memory(forked, 2 * MEMORY);
+	if (!robot_vm_exec(forked, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_exit_code(forked) != 0x101 || robot_vm_get_memory_size(forked) < 2 * MEMORY ||
+			!check_word(vm, "Original", 0x12345678))
+		res = 1;
+	g_object_unref(forked);
+	robot_vm_snapshot_unref(snapshot);
+
+	/* Memory moves between backends: */
+	if (!robot_vm_set_memory_backend(vm, ROBOT_VM_MEMORY_HEAP, &error) ||
+			robot_vm_get_memory_backend(vm) != ROBOT_VM_MEMORY_HEAP || !check_word(vm, "Heap", 0x12345678) ||
+			!robot_vm_set_memory_backend(vm, ROBOT_VM_MEMORY_SPARSE, &error) ||
+			robot_vm_get_memory_backend(vm) != ROBOT_VM_MEMORY_SPARSE || !check_word(vm, "Sparse again", 0x12345678)) {
+		fprintf(stderr, "Move between backends: %s\n", error? error->message: "contents changed");
+		g_clear_error(&error);
+		res = 1;
+	}
+	if (!robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_exit_code(vm) != 0x12345679 || robot_vm_get_memory_size(vm) != MEMORY) {
+		fprintf(stderr, "Original: exit code %x\n", (unsigned)robot_vm_get_exit_code(vm));
+		res = 1;
+	}
+	g_object_unref(vm);
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
@@ -0,0 +1,169 @@
+/* Test of saved state. Program fills table and stops at checkpoint, the state
+ * is saved there. VMs restored from it (with functions added in other order,
+ * also fork of such VM) must finish the program with the same result as the
+ * original one. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MEMORY 0x100000
+
+static const char *program =
+	".text\n"
+	"load r2\nconst 0x20000\nload r3\nconst 256\n"
+	":fill\n"
+	"write32 r3 r2\nincr4 r2\ndecr r3\nload r11\nconst @fill\nmoveif r0 r11 r3\n"
+	"load r7\nconst 0x1234\nload r12\nconst 1\nstop r12\n"
+	/* After checkpoint: */
+	"load r2\nconst 0x20000\nload r3\nconst 256\nxor r5 r5 r5\n"
+	":sum\n"
+	"read32 r4 r2\nadd r5 r5 r4\nincr4 r2\ndecr r3\nload r11\nconst @sum\nmoveif r0 r11 r3\n"
+	"decr4 r1\nwrite32 r5 r1\nload r3\nconst %twice\next r3\nread32 r5 r1\nincr4 r1\n"
+	"add r5 r5 r7\nstop r5\n";
+
+#define RESULT (2 * 256 * 257 / 2 + 0x1234)
+
+static gboolean twice(RobotVM *vm, gpointer userdata, GError **error)
+{
+	RobotVMWord w;
+
+	return robot_vm_stack_pop_word(vm, &w, error) && robot_vm_stack_push_word(vm, w * 2, error);
+}
+
+static gboolean first(RobotVM *vm, gpointer userdata, GError **error)
+{
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	GError *error = NULL;
+	gchar *state;
+	struct stat st;
+	RobotVMSnapshot *snapshot;
+	RobotVM *vm, *forked;
+	RobotVMWord pc;
+	gchar *data;
+	gsize len;
+	guint i;
+	gboolean verified;
+	int res = 0, fd;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	fd = g_file_open_tmp("test_vm_state_XXXXXX", &state, &error);
+	if (fd < 0) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	close(fd);
+
+	vm = robot_vm_new();
+	robot_vm_add_function(vm, "first", first, NULL, NULL);
+	robot_vm_add_function(vm, "twice", twice, NULL, NULL);
+	robot_vm_allocate_memory(vm, MEMORY);
+	if (!robot_vm_load(vm, obj, &error) || !robot_vm_exec(vm, &error) ||
+			!robot_vm_save_state(vm, state, &error) || !robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	verified = robot_vm_is_verified(vm);
+	if (robot_vm_get_exit_code(vm) != RESULT) {
+		fprintf(stderr, "Original: exit code %u\n", (unsigned)robot_vm_get_exit_code(vm));
+		res = 1;
+	}
+	g_object_unref(vm);
+
+	/* Pages of zeroes are not in the file: */
+	if (stat(state, &st) || st.st_size > MEMORY / 16) {
+		fprintf(stderr, "State of %u bytes\n", (unsigned)st.st_size);
+		res = 1;
+	}
+
+	vm = robot_vm_new();
+	robot_vm_add_function(vm, "twice", twice, NULL, NULL);
+	robot_vm_add_function(vm, "first", first, NULL, NULL);
+	if (!robot_vm_restore_state(vm, state, &error) || !robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_exit_code(vm) != RESULT || robot_vm_get_memory_size(vm) < MEMORY ||
+			robot_vm_is_verified(vm) != verified) {
+		fprintf(stderr, "Restored: exit code %u, %u bytes of memory\n", (unsigned)robot_vm_get_exit_code(vm),
+				(unsigned)robot_vm_get_memory_size(vm));
+		res = 1;
+	}
+	g_object_unref(vm);
+
+	/* Fork restored with other order of functions doesn't reorder functions
+	 * shared with the VM it was forked from: */
+	vm = robot_vm_new();
+	robot_vm_add_function(vm, "twice", twice, NULL, NULL);
+	robot_vm_add_function(vm, "first", first, NULL, NULL);
+	robot_vm_allocate_memory(vm, MEMORY);
+	if (!robot_vm_load(vm, obj, &error) || !robot_vm_exec(vm, &error) ||
+			!(snapshot = robot_vm_snapshot(vm, &error)) || !(forked = robot_vm_fork(snapshot, &error)) ||
+			!robot_vm_restore_state(forked, state, &error) || !robot_vm_exec(forked, &error) ||
+			!robot_vm_exec(vm, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_get_exit_code(forked) != RESULT || robot_vm_get_exit_code(vm) != RESULT) {
+		fprintf(stderr, "Fork: exit code %u, original: %u\n", (unsigned)robot_vm_get_exit_code(forked),
+				(unsigned)robot_vm_get_exit_code(vm));
+		res = 1;
+	}
+	g_object_unref(forked);
+	robot_vm_snapshot_unref(snapshot);
+	g_object_unref(vm);
+
+	/* Saved function which VM doesn't have fails: */
+	vm = robot_vm_new();
+	if (!robot_vm_restore_state(vm, state, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (robot_vm_exec(vm, &error) || !g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_EXECUTION_FAULT)) {
+		fprintf(stderr, "Restored without function: %s\n", error? error->message: "no error");
+		res = 1;
+	}
+	g_clear_error(&error);
+
+	/* Invalid files don't change VM. Mask of masked memory must fit into memory: */
+	pc = vm->R[0];
+	if (!g_file_get_contents(state, &data, &len, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	data[7] |= 2;
+	memset(data + 140, 0xff, 4);
+	for (i = 0; i < 2; i++) {
+		if (!g_file_set_contents(state, data, i? 4: (gssize)len, &error)) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+		if (robot_vm_restore_state(vm, state, &error) || !g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_IO) ||
+				vm->R[0] != pc) {
+			fprintf(stderr, "Invalid state %u: %s\n", i, error? error->message: "no error");
+			res = 1;
+		}
+		g_clear_error(&error);
+	}
+	g_free(data);
+	g_object_unref(vm);
+
+	remove(state);
+	g_free(state);
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
@@ -0,0 +1,127 @@
+/* Test of suspendable EXT calls. One thread drives many VMs, function %walk
+ * suspends the call and the host resumes it after several ticks as animation
+ * of robot would do. The first VM gets failure instead of the 5th result. */
+#include "robot.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_VMS 200
+#define SLICE 1000
+
+static const char *program =
+	".text\n"
+	"xor r5 r5 r5\nload r6\nconst 10\n"
+	":loop\n"
+	"decr4 r1\nwrite32 r6 r1\n"
+	"load r3\nconst %walk\next r3\n"
+	"read32 r4 r1\nincr4 r1\n"
+	"add r5 r5 r4\ndecr r6\n"
+	"load r11\nconst @loop\nmoveif r0 r11 r6\n"
+	"stop r5\n";
+
+typedef struct _Action {
+	RobotVM *vm;
+	RobotVMWord arg;
+	guint ticks;
+} Action;
+
+/* Start walk, result is twice the argument: */
+static gboolean walk(RobotVM *vm, gpointer userdata, GError **error)
+{
+	GQueue *actions = userdata;
+	Action *action = g_new(Action, 1);
+
+	if (!robot_vm_stack_pop_word(vm, &action->arg, error)) {
+		g_free(action);
+		return FALSE;
+	}
+
+	action->vm = vm;
+	action->ticks = 1 + (action->arg * 7 + GPOINTER_TO_UINT(vm)) % 5;
+	g_queue_push_tail(actions, action);
+	robot_vm_suspend(vm);
+
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	GQueue actions = G_QUEUE_INIT;
+	RobotVM *vms[N_VMS];
+	gboolean done[N_VMS] = { FALSE };
+	guint remaining = N_VMS, i, n;
+	GError *error = NULL;
+	guint64 executed;
+	gboolean stop;
+	Action *action;
+	int res = 0;
+
+	if (!robot_obj_file_compile(obj, program, &error)) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+
+	for (i = 0; i < N_VMS; i++) {
+		vms[i] = robot_vm_new();
+		robot_vm_add_function(vms[i], "walk", walk, &actions, NULL);
+		robot_vm_allocate_memory(vms[i], 0x10000);
+		if (!robot_vm_load(vms[i], obj, &error)) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+	}
+
+	while (remaining) {
+		/* Run VMs which are not waiting: */
+		for (i = 0; i < N_VMS; i++) {
+			if (done[i] || robot_vm_is_pending(vms[i]))
+				continue;
+
+			if (!robot_vm_run_for(vms[i], SLICE, &executed, &stop, &error)) {
+				if (i != 0 || !g_error_matches(error, ROBOT_ERROR, ROBOT_ERROR_IO)) {
+					fprintf(stderr, "VM %u: `%s'\n", i, error->message);
+					res = 1;
+				}
+				g_clear_error(&error);
+				done[i] = TRUE;
+				--remaining;
+			} else if (stop) {
+				if (i == 0 || robot_vm_get_exit_code(vms[i]) != 110) {
+					fprintf(stderr, "VM %u: exit code %u\n", i, (unsigned)robot_vm_get_exit_code(vms[i]));
+					res = 1;
+				}
+				if (vms[i]->R[1] != obj->SS) {
+					fprintf(stderr, "VM %u: stack is not restored\n", i);
+					res = 1;
+				}
+				done[i] = TRUE;
+				--remaining;
+			}
+		}
+
+		/* Tick of animation, finished walks resume their VMs: */
+		for (n = g_queue_get_length(&actions); n; n--) {
+			action = g_queue_pop_head(&actions);
+			if (--action->ticks) {
+				g_queue_push_tail(&actions, action);
+				continue;
+			}
+
+			if (action->vm == vms[0] && action->arg == 6)
+				robot_vm_resume(action->vm, g_error_new(ROBOT_ERROR, ROBOT_ERROR_IO, "Robot fell"));
+			else
+				robot_vm_resume_word(action->vm, action->arg * 2);
+			g_free(action);
+		}
+	}
+
+	for (i = 0; i < N_VMS; i++)
+		g_object_unref(vms[i]);
+	g_object_unref(obj);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}
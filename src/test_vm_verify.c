@@ -0,0 +1,126 @@
+/* Test of text verification. Program calls a subroutine in a loop; variants
+ * which compute R0, jump to or call an address which is not relocated or fall
+ * through the end of text must not be verified, but run with the same result.
+ * Program writing into its text must run the written instruction. */
+#include "robot.h"
+#include <stdio.h>
+
+/* Offsets of labels :loop and :sub in text: */
+#define LOOP 12
+#define SUB 40
+
+#define PROGRAM(call, jump, tail) \
+	".text\n" \
+	"load r6\nconst 5\nxor r5 r5 r5\n" \
+	":loop\n" \
+	"call\nconst " call "\ndecr r6\nload r11\nconst " jump "\nmoveif r0 r11 r6\nstop r5\n" \
+	":sub\n" \
+	"incr r5\nret\n" \
+	tail
+
+#define RESULT 5
+
+/* Instruction at :patch is replaced by the one at :src: */
+static const char *selfmod =
+	".text\n"
+	"load r5\nconst 7\nload r2\nconst @patch\nload r4\nconst @src\n"
+	"read32 r3 r4\nwrite32 r3 r2\n"
+	":patch\n"
+	"incr r5\nstop r5\n"
+	":src\n"
+	"decr r5\nstop r5\n";
+
+static RobotVM* run(const char *program, gboolean verify, gboolean *verified, GError **error)
+{
+	RobotObjFile *obj = robot_obj_file_new();
+	RobotVM *vm = robot_vm_new();
+
+	robot_vm_set_verify_enabled(vm, verify);
+	robot_vm_allocate_memory(vm, 0x10000);
+	if (!robot_obj_file_compile(obj, program, error) || !robot_vm_load(vm, obj, error)) {
+		g_object_unref(obj);
+		g_object_unref(vm);
+		return NULL;
+	}
+	g_object_unref(obj);
+
+	*verified = robot_vm_is_verified(vm);
+	if (!robot_vm_exec(vm, error)) {
+		g_object_unref(vm);
+		return NULL;
+	}
+
+	return vm;
+}
+
+int main(int argc, char *argv[])
+{
+	GError *error = NULL;
+	RobotVMWord start;
+	gboolean verified;
+	gchar *programs[6];
+	RobotVM *vm;
+	guint i;
+	int res = 0;
+
+	vm = run(PROGRAM("@sub", "@loop", ""), TRUE, &verified, &error);
+	if (!vm) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (!verified || robot_vm_get_exit_code(vm) != RESULT) {
+		fprintf(stderr, "Valid program: verified %d, exit code %u\n", verified, (unsigned)robot_vm_get_exit_code(vm));
+		res = 1;
+	}
+	g_object_unref(vm);
+
+	/* Address of text for immediates which are not relocated, entry is
+	 * the start of text: */
+	vm = run(".text\nstop r0\n", TRUE, &verified, &error);
+	if (!vm) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	start = robot_vm_get_exit_code(vm) - 4;
+	g_object_unref(vm);
+
+	programs[0] = g_strdup(PROGRAM("@sub", "@loop", ""));
+	programs[1] = g_strdup(PROGRAM("@sub", "@loop", "add r0 r5 r6\nstop r5\n"));
+	programs[2] = g_strdup_printf(PROGRAM("@sub", "%u", ""), (unsigned)(start + LOOP));
+	programs[3] = g_strdup_printf(PROGRAM("%u", "@loop", ""), (unsigned)(start + SUB));
+	programs[4] = g_strdup(PROGRAM("@sub", "@loop", "nop\n"));
+	programs[5] = NULL;
+
+	for (i = 0; programs[i]; i++) {
+		/* The first one is checked with verification disabled: */
+		vm = run(programs[i], i > 0, &verified, &error);
+		if (!vm) {
+			fprintf(stderr, "Error: `%s'\n", error->message);
+			return 1;
+		}
+		if (verified || robot_vm_get_exit_code(vm) != RESULT) {
+			fprintf(stderr, "Program %u: verified %d, exit code %u\n", i, verified, (unsigned)robot_vm_get_exit_code(vm));
+			res = 1;
+		}
+		g_object_unref(vm);
+		g_free(programs[i]);
+	}
+
+	/* Write into text drops VM to checked interpreter: */
+	vm = run(selfmod, TRUE, &verified, &error);
+	if (!vm) {
+		fprintf(stderr, "Error: `%s'\n", error->message);
+		return 1;
+	}
+	if (!verified || robot_vm_is_verified(vm) || robot_vm_get_exit_code(vm) != 6) {
+		fprintf(stderr, "Self-modifying program: verified %d, after run %d, exit code %u\n", verified,
+				robot_vm_is_verified(vm), (unsigned)robot_vm_get_exit_code(vm));
+		res = 1;
+	}
+	g_object_unref(vm);
+
+	if (!res)
+		printf("OK\n");
+
+	return res;
+}